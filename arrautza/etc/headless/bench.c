@@ -0,0 +1,347 @@
+/* bench.c
+ * Microbenchmarks against the real game code, for the headless runner.
+ * These run instead of a replay, and don't call egg_client_init(): Each bench sets up only what it needs.
+ *
+ *   make headless && out/arrautza-headless --bench=NAME
+ *
+ * NAME is one of those listed in HEADLESS_BENCH_FOR_EACH, or "all".
+ * Times are wall clock, so run a few times and don't trust small differences.
+ */
+
+#include "arrautza.h"
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#define HEADLESS_BENCH_FOR_EACH \
+  _(physics) \
+  _(groups) \
+  _(sort) \
+  _(stobus)
+
+static double bench_now() {
+  struct timespec tv={0};
+  clock_gettime(CLOCK_MONOTONIC,&tv);
+  return (double)tv.tv_sec+(double)tv.tv_nsec/1000000000.0;
+}
+
+/* physics: physics_update() on crowds of solid sprites, from 50 to 5000.
+ * "screen": Everybody on one screen, hitboxes shrinking as the crowd grows, so density holds constant.
+ * "field": Fixed hitboxes, the field growing with the crowd. Also constant density, but spilling well offscreen.
+ * Either way, 5% are parked in a column just off the left edge.
+ * Sprites drift a little each frame, so nobody sleeps.
+ * Per-sprite cost should hold roughly flat as the count grows. If it climbs, the broadphase isn't doing its job.
+ */
+
+static const struct sprctl bench_sprctl_physics={
+  .name="bench_physics",
+  .objlen=sizeof(struct sprite),
+};
+
+static int bench_physics_populate(struct sprgrp *sprgrp,int spritec,int field) {
+  double hbscale=field?1.0:sqrt(50.0/spritec);
+  double fieldscale=field?sqrt(spritec/50.0):1.0;
+  int i=0; for (;i<spritec;i++) {
+    struct sprite *sprite=sprite_new_uninitialized(&bench_sprctl_physics);
+    if (!sprite) return -1;
+    double radius=(0.3+(rand()%40)/100.0)*hbscale;
+    sprite->hbl=sprite->hbr=sprite->hbu=sprite->hbd=radius;
+    sprite->x=(rand()%(COLC*1000))*fieldscale/1000.0;
+    sprite->y=(rand()%(ROWC*1000))*fieldscale/1000.0;
+    if (!(rand()%20)) sprite->x=-3.0;
+    sprite->pvx=sprite->x;
+    sprite->pvy=sprite->y;
+    sprite->invmass=(rand()%5)?(1+rand()%255):0;
+    int err=sprgrp_add(sprgrp,sprite);
+    sprite_del(sprite);
+    if (err<0) return -1;
+  }
+  return 0;
+}
+
+static void bench_physics_drift(struct sprgrp *sprgrp,double limit) {
+  int i=sprgrp->sprc;
+  while (i-->0) {
+    struct sprite *sprite=sprgrp->sprv[i];
+    sprite->x+=0.05*((i%3)-1);
+    sprite->y+=0.03;
+    if (sprite->y>limit) sprite->y=0.0;
+  }
+}
+
+static int bench_physics() {
+  const int spritecv[]={50,200,500,1000,2000,5000};
+  const int spritecc=sizeof(spritecv)/sizeof(int);
+  struct sprgrp *sprgrp=sprgrp_new(SPRGRP_MODE_EXPLICIT);
+  if (!sprgrp) return -1;
+  int field=0; for (;field<2;field++) {
+    fprintf(stdout,"physics, %s:\n      n    us/frame  us/sprite\n",field?"field":"screen");
+    int i=0; for (;i<spritecc;i++) {
+      int spritec=spritecv[i];
+      srand(i+1);
+      if (bench_physics_populate(sprgrp,spritec,field)<0) {
+        sprgrp_clear(sprgrp);
+        sprgrp_del(sprgrp);
+        return -1;
+      }
+      double limit=field?(ROWC*sqrt(spritec/50.0)):ROWC;
+      int framec=(spritec<=500)?200:(spritec<=2000)?40:10;
+      physics_update(sprgrp,0.016); // Warm up, and let the initial crowd shove apart.
+      double elapsed=0.0;
+      int framep=0; for (;framep<framec;framep++) {
+        bench_physics_drift(sprgrp,limit);
+        double start=bench_now();
+        physics_update(sprgrp,0.016);
+        elapsed+=bench_now()-start;
+      }
+      double us=elapsed*1000000.0/framec;
+      fprintf(stdout,"  %5d  %10.1f  %9.3f\n",spritec,us,us/spritec);
+      sprgrp_clear(sprgrp);
+    }
+  }
+  sprgrp_del(sprgrp);
+  return 0;
+}
+
+/* groups: Global group membership churn.
+ * 400 sprites, 4M random toggles across four global groups, 32M liveness/membership checks,
+ * and 200 rounds of spawning 400 sprites and killing them via DEATHROW.
+ * The checksum only exists to keep the checks from being optimized out.
+ */
+
+static const struct sprctl bench_sprctl_groups={
+  .name="bench_groups",
+  .objlen=sizeof(struct sprite),
+  .grpmask=(1<<SPRGRP_UPDATE)|(1<<SPRGRP_RENDER)|(1<<SPRGRP_SOLID),
+};
+
+static int bench_groups() {
+  #define BENCH_GROUPS_SPRITEC 400
+  struct sprite *spritev[BENCH_GROUPS_SPRITEC];
+  const int togglec=4000000,checkc=16000000,roundc=200;
+  sprgrpv_init();
+  int i=0; for (;i<BENCH_GROUPS_SPRITEC;i++) {
+    if (!(spritev[i]=sprite_spawn_resless(&bench_sprctl_groups,0,0,i%COLC,i%ROWC,0,0))) return -1;
+  }
+  
+  double start=bench_now();
+  uint32_t seed=1;
+  for (i=0;i<togglec;i++) {
+    seed=seed*1103515245+12345;
+    struct sprite *sprite=spritev[(seed>>8)%BENCH_GROUPS_SPRITEC];
+    struct sprgrp *sprgrp=sprgrpv+SPRGRP_FOOTING+((seed>>20)&3); // FOOTING,SOLID,HERONOTIFY,FRAGILE
+    if (sprgrp_has(sprgrp,sprite)) sprgrp_remove(sprgrp,sprite);
+    else sprgrp_add(sprgrp,sprite);
+  }
+  double togglet=bench_now()-start;
+  
+  start=bench_now();
+  int checksum=0;
+  for (i=0;i<checkc;i++) {
+    seed=seed*1103515245+12345;
+    struct sprite *sprite=spritev[(seed>>8)%BENCH_GROUPS_SPRITEC];
+    if (sprite_if_alive(sprite)) checksum++;
+    if (sprite_in_group(sprite,SOLID)) checksum++;
+  }
+  double checkt=bench_now()-start;
+  
+  start=bench_now();
+  int round=0; for (;round<roundc;round++) {
+    for (i=0;i<BENCH_GROUPS_SPRITEC;i++) {
+      struct sprite *sprite=sprite_spawn_resless(&bench_sprctl_groups,0,0,1.0,1.0,0,0);
+      if (!sprite) return -1;
+      sprite_add_group(sprite,FRAGILE);
+      sprite_kill_soon(sprite);
+    }
+    sprgrp_kill(sprgrpv+SPRGRP_DEATHROW);
+  }
+  double spawnt=bench_now()-start;
+  sprgrp_kill(sprgrpv+SPRGRP_KEEPALIVE);
+  
+  fprintf(stdout,
+    "groups: toggle %.1f ns/op, membership %.2f ns/check, spawn+kill %.1f ns/sprite (checksum %d)\n",
+    togglet*1e9/togglec,checkt*1e9/(checkc*2),spawnt*1e9/(roundc*BENCH_GROUPS_SPRITEC),checksum
+  );
+  #undef BENCH_GROUPS_SPRITEC
+  return 0;
+}
+
+/* sort: sprgrp_render() on a RENDER-mode group, which is mostly the sort.
+ * 600 frames of coherent vertical motion, 10% of sprites on a second layer.
+ * With churn, one sprite leaves and rejoins every 10 frames, forcing a full sort.
+ * Sprites have no image, so nothing actually draws.
+ */
+
+struct bench_sprite_sort {
+  struct sprite hdr;
+  double dy;
+};
+
+static const struct sprctl bench_sprctl_sort={
+  .name="bench_sort",
+  .objlen=sizeof(struct bench_sprite_sort),
+};
+
+static int bench_sort_run(int spritec,int churn) {
+  struct sprgrp *sprgrp=sprgrp_new(SPRGRP_MODE_RENDER);
+  if (!sprgrp) return -1;
+  int i=0; for (;i<spritec;i++) {
+    struct sprite *sprite=sprite_new_uninitialized(&bench_sprctl_sort);
+    if (!sprite) break;
+    sprite->x=sprite->rpx=(rand()%(COLC*100))/100.0;
+    sprite->y=sprite->rpy=(rand()%(ROWC*100))/100.0;
+    sprite->layer=(rand()%10)?100:101;
+    ((struct bench_sprite_sort*)sprite)->dy=((rand()%200)-100)/10000.0;
+    int err=sprgrp_add(sprgrp,sprite);
+    sprite_del(sprite);
+    if (err<0) break;
+  }
+  if (i<spritec) {
+    sprgrp_clear(sprgrp);
+    sprgrp_del(sprgrp);
+    return -1;
+  }
+  const int framec=600;
+  double total=0.0,worst=0.0;
+  int framep=0; for (;framep<framec;framep++) {
+    for (i=0;i<spritec;i++) {
+      struct bench_sprite_sort *sprite=(struct bench_sprite_sort*)sprgrp->sprv[i];
+      sprite->hdr.y+=sprite->dy;
+      if ((sprite->hdr.y<0.0)||(sprite->hdr.y>ROWC)) sprite->dy=-sprite->dy;
+      sprite->hdr.rpy=sprite->hdr.y;
+    }
+    if (churn&&!(framep%10)) {
+      struct sprite *sprite=sprgrp->sprv[rand()%spritec];
+      sprite_ref(sprite);
+      sprgrp_remove(sprgrp,sprite);
+      sprgrp_add(sprgrp,sprite);
+      sprite_del(sprite);
+    }
+    double start=bench_now();
+    sprgrp_render(1,sprgrp);
+    double elapsed=bench_now()-start;
+    total+=elapsed;
+    if (elapsed>worst) worst=elapsed;
+  }
+  int inversionc=0;
+  for (i=1;i<spritec;i++) {
+    const struct sprite *a=sprgrp->sprv[i-1],*b=sprgrp->sprv[i];
+    if (a->layer>b->layer) inversionc++;
+    else if ((a->layer==b->layer)&&(a->by+a->bh>b->by+b->bh)) inversionc++;
+  }
+  fprintf(stdout,"  %5d%c  %8.1f  %8.1f  %d\n",spritec,churn?'*':' ',total*1e6/framec,worst*1e6,inversionc);
+  sprgrp_clear(sprgrp);
+  sprgrp_del(sprgrp);
+  return 0;
+}
+
+static int bench_sort() {
+  srand(1);
+  fprintf(stdout,"sort (* with churn):\n      n    mean(us)  worst(us)  inversions\n");
+  if (bench_sort_run(50,0)<0) return -1;
+  if (bench_sort_run(1000,0)<0) return -1;
+  if (bench_sort_run(4000,0)<0) return -1;
+  if (bench_sort_run(10000,0)<0) return -1;
+  if (bench_sort_run(10000,1)<0) return -1;
+  return 0;
+}
+
+/* stobus: Encode and decode cost at 1000 and 4000 fields of random size 0..31,
+ * then autosave write frequency over 60 simulated seconds at 60 Hz, 2000 fields:
+ * A change every frame, a burst of 50 changes every 10 s, and idle.
+ * Uses (g.stobus), since that's what autosave writes.
+ */
+
+static int bench_stobus_codec(int fieldc) {
+  struct stobus stobus={0};
+  srand(fieldc);
+  int bitc=0,i=0; for (;i<fieldc;i++) {
+    int c=rand()%32;
+    if (stobus_define(&stobus,i+1,c)<0) return -1;
+    if (c) stobus_set(&stobus,i+1,rand()&((1u<<c)-1));
+    bitc+=c;
+  }
+  int dsta=stobus_encode(0,0,&stobus);
+  char *dst=malloc(dsta+1);
+  if (!dst) return -1;
+  const int repc=2000;
+  int dstc=0;
+  double start=bench_now();
+  for (i=0;i<repc;i++) dstc=stobus_encode(dst,dsta+1,&stobus);
+  double encodet=bench_now()-start;
+  start=bench_now();
+  for (i=0;i<repc;i++) {
+    if (stobus_decode(&stobus,dst,dstc)<0) {
+      free(dst);
+      stobus_cleanup(&stobus);
+      return -1;
+    }
+  }
+  double decodet=bench_now()-start;
+  fprintf(stdout,"  %5d  %6d  %6d  %8.2f  %8.2f\n",fieldc,bitc,dstc,encodet*1e6/repc,decodet*1e6/repc);
+  free(dst);
+  stobus_cleanup(&stobus);
+  return 0;
+}
+
+static int bench_stobus_autosave(const char *name,int period,int burstc) {
+  const int framec=3600;
+  int setc=0,framep;
+  for (framep=0;framep<framec;framep++) autosave_update(1.0/60.0); // Drain any cooldown left from the last run.
+  int writec0=autosave_get_write_count();
+  for (framep=0;framep<framec;framep++) {
+    if (period&&!(framep%period)) {
+      int i=burstc; while (i-->0) {
+        int id=1+rand()%2000;
+        stobus_set(&g.stobus,id,stobus_get(&g.stobus,id)^1);
+        setc++;
+      }
+    }
+    stobus_flush(&g.stobus);
+    autosave_update(1.0/60.0);
+  }
+  fprintf(stdout,"  %-12s %5d sets, %3d writes\n",name,setc,autosave_get_write_count()-writec0);
+  return 0;
+}
+
+static int bench_stobus() {
+  fprintf(stdout,"stobus:\n  fields    bits   chars  enc(us)  dec(us)\n");
+  if (bench_stobus_codec(1000)<0) return -1;
+  if (bench_stobus_codec(4000)<0) return -1;
+  srand(1);
+  int i=0; for (;i<2000;i++) {
+    if (stobus_define(&g.stobus,i+1,1+rand()%31)<0) return -1;
+  }
+  stobus_set_deferred(&g.stobus,1);
+  g.stobus.dirty=0;
+  fprintf(stdout,"autosave, 60 s at 60 Hz:\n");
+  if (bench_stobus_autosave("every frame",1,1)<0) return -1;
+  if (bench_stobus_autosave("burst/10s",600,50)<0) return -1;
+  if (bench_stobus_autosave("idle",0,0)<0) return -1;
+  return 0;
+}
+
+/* Main entry point.
+ */
+
+int headless_bench(const char *name) {
+  int all=!strcmp(name,"all"),found=0;
+  #define _(tag) if (all||!strcmp(name,#tag)) { \
+    found=1; \
+    if (bench_##tag()<0) { \
+      fprintf(stderr,"bench %s failed\n",#tag); \
+      return -1; \
+    } \
+  }
+  HEADLESS_BENCH_FOR_EACH
+  #undef _
+  if (!found) {
+    fprintf(stderr,"Unknown bench '%s'. Try:",name);
+    #define _(tag) fprintf(stderr," %s",#tag);
+    HEADLESS_BENCH_FOR_EACH
+    #undef _
+    fprintf(stderr," all\n");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,521 @@
+/* headless.c
+ * Native stand-in for the Egg runtime, to play back a replay with no window, audio, or input.
+ * Rendering still runs, against textures that only know their size, so we exercise the whole frame.
+ * Resources come straight off the data directory as built under mid/. Images are not decoded, and strings are not loaded.
+ * At each frame, we fold a hash of the game's state into a running checksum.
+ * Play the same replay twice and you must get the same checksum. That's the test.
+ * We also report speed, draw calls per frame as counted by src/draw.c, physics sleepers, and sprite culling and batching.
+ *
+ * The wasm build uses our own xorshift rand() from src/stdlib, and so must we, or the sessions will diverge.
+ * Even so, nobody has shown a wasm recording playing back identically here. Two caveats:
+ *  - Float math from libm could in theory differ from the wasm runtime's.
+ *  - Sprite addresses come from the host malloc, which lays out nothing like the wasm build's first-fit heap.
+ *    Groups sort by sprite->serial rather than address, so that should no longer matter.
+ *    But anything that orders sprites by pointer would make the checksum depend on the allocator.
+ *    `make replay-check` plays each replay in etc/replay under two heap layouts to catch that.
+ *
+ *   make headless && out/arrautza-headless [--data=mid/data] [--fps=60] REPLAY
+ *   make headless && out/arrautza-headless --bench=NAME
+ *
+ * With --bench, we run one of the microbenchmarks in bench.c instead of a replay.
+ *
+ * Get a REPLAY by setting REPLAY_RECORD_ENABLE in src/replay.c, then pull "replay" out of the store.
+ */
+
+#include "arrautza.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <time.h>
+
+/* Globals.
+ */
+
+static struct {
+  const char *datapath;
+  int terminate;
+  struct headless_res {
+    int tid,qual,rid;
+    void *v;
+    int c;
+  } *resv;
+  int resc,resa;
+  struct headless_texture {
+    int w,h,fmt;
+  } *texturev; // Indexed by texid. Zero (w) means unused.
+  int texturec,texturea;
+  struct headless_store {
+    char *k,*v;
+    int kc,vc;
+  } *storev;
+  int storec,storea;
+} headless={0};
+
+/* rand, exactly as src/stdlib/rand.c does it.
+ */
+
+static uint32_t headless_rand_state=1;
+
+int rand() {
+  headless_rand_state^=headless_rand_state<<13;
+  headless_rand_state^=headless_rand_state>>17;
+  headless_rand_state^=headless_rand_state<<5;
+  return headless_rand_state&0x7fffffff;
+}
+
+void srand(unsigned int seed) {
+  headless_rand_state=seed;
+}
+
+/* Platform basics.
+ */
+
+void egg_log(const char *fmt,...) {
+  va_list vargs;
+  va_start(vargs,fmt);
+  vfprintf(stderr,fmt,vargs);
+  va_end(vargs);
+  fprintf(stderr,"\n");
+}
+
+double egg_time_real() {
+  struct timespec tv={0};
+  clock_gettime(CLOCK_REALTIME,&tv);
+  return (double)tv.tv_sec+(double)tv.tv_nsec/1000000000.0;
+}
+
+void egg_request_termination() {
+  headless.terminate=1;
+}
+
+int egg_get_user_languages(int *v,int a) {
+  return 0;
+}
+
+/* Input: There is none.
+ */
+
+int egg_event_get(union egg_event *v,int a) {
+  return 0;
+}
+
+int egg_event_enable(int type,int enable) {
+  return 0;
+}
+
+void egg_show_cursor(int show) {
+}
+
+int egg_lock_cursor(int lock) {
+  return 0;
+}
+
+/* Audio: Also none.
+ */
+
+void egg_audio_play_song(int qual,int songid,int force,int repeat) {
+}
+
+/* Store, in memory only.
+ */
+
+int egg_store_get(char *v,int va,const char *k,int kc) {
+  if (!k||(kc<1)) return 0;
+  const struct headless_store *entry=headless.storev;
+  int i=headless.storec;
+  for (;i-->0;entry++) {
+    if ((entry->kc!=kc)||memcmp(entry->k,k,kc)) continue;
+    if (v&&(entry->vc<=va)) memcpy(v,entry->v,entry->vc);
+    return entry->vc;
+  }
+  return 0;
+}
+
+int egg_store_set(const char *k,int kc,const char *v,int vc) {
+  if (!k||(kc<1)||(vc<0)) return -1;
+  struct headless_store *entry=headless.storev;
+  int i=headless.storec;
+  for (;i-->0;entry++) {
+    if ((entry->kc==kc)&&!memcmp(entry->k,k,kc)) break;
+  }
+  if (i<0) {
+    if (headless.storec>=headless.storea) {
+      int na=headless.storea+8;
+      void *nv=realloc(headless.storev,sizeof(struct headless_store)*na);
+      if (!nv) return -1;
+      headless.storev=nv;
+      headless.storea=na;
+    }
+    entry=headless.storev+headless.storec++;
+    memset(entry,0,sizeof(struct headless_store));
+    if (!(entry->k=malloc(kc))) return -1;
+    memcpy(entry->k,k,kc);
+    entry->kc=kc;
+  }
+  void *nv=malloc(vc?vc:1);
+  if (!nv) return -1;
+  memcpy(nv,v,vc);
+  if (entry->v) free(entry->v);
+  entry->v=nv;
+  entry->vc=vc;
+  return 0;
+}
+
+/* Resources.
+ */
+
+static int headless_res_cmp(const void *a,const void *b) {
+  const struct headless_res *A=a,*B=b;
+  if (A->tid!=B->tid) return A->tid-B->tid;
+  if (A->qual!=B->qual) return A->qual-B->qual;
+  return A->rid-B->rid;
+}
+
+static int headless_res_search(int tid,int qual,int rid) {
+  struct headless_res q={.tid=tid,.qual=qual,.rid=rid};
+  int lo=0,hi=headless.resc;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+    int cmp=headless_res_cmp(&q,headless.resv+ck);
+    if (cmp<0) hi=ck;
+    else if (cmp>0) lo=ck+1;
+    else return ck;
+  }
+  return -1;
+}
+
+static int headless_res_add(int tid,int rid,const char *path) {
+  FILE *f=fopen(path,"rb");
+  if (!f) return -1;
+  fseek(f,0,SEEK_END);
+  int c=ftell(f);
+  fseek(f,0,SEEK_SET);
+  void *v=malloc(c?c:1);
+  if (!v||(fread(v,1,c,f)!=c)) {
+    fclose(f);
+    if (v) free(v);
+    return -1;
+  }
+  fclose(f);
+  if (headless.resc>=headless.resa) {
+    int na=headless.resa+64;
+    void *nv=realloc(headless.resv,sizeof(struct headless_res)*na);
+    if (!nv) { free(v); return -1; }
+    headless.resv=nv;
+    headless.resa=na;
+  }
+  struct headless_res *res=headless.resv+headless.resc++;
+  res->tid=tid;
+  res->qual=0;
+  res->rid=rid;
+  res->v=v;
+  res->c=c;
+  return 0;
+}
+
+/* Files are "RID" or "RID-NAME[.EXT]", in a directory named for their type.
+ * Strings are skipped: They're text and need resid.h to resolve, and the game can run without them.
+ */
+
+static int headless_load_type(int tid,const char *tname) {
+  if (tid==EGG_RESTYPE_string) return 0;
+  char path[1024];
+  int pathc=snprintf(path,sizeof(path),"%s/%s",headless.datapath,tname);
+  if ((pathc<1)||(pathc>=sizeof(path))) return -1;
+  DIR *dir=opendir(path);
+  if (!dir) return 0;
+  struct dirent *de;
+  while (de=readdir(dir)) {
+    const char *base=de->d_name;
+    int rid=0,basep=0;
+    for (;(base[basep]>='0')&&(base[basep]<='9');basep++) rid=rid*10+base[basep]-'0';
+    if (!basep||(rid<1)||(rid>0xffff)) continue;
+    if (base[basep]&&(base[basep]!='-')&&(base[basep]!='.')) continue;
+    snprintf(path+pathc,sizeof(path)-pathc,"/%s",base);
+    if (headless_res_add(tid,rid,path)<0) {
+      egg_log("%s: Failed to read file",path);
+      closedir(dir);
+      return -1;
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+static int headless_load_resources() {
+  #define _(tag) if (headless_load_type(EGG_RESTYPE_##tag,#tag)<0) return -1;
+  EGG_RESTYPE_FOR_EACH
+  CUSTOM_RESTYPE_FOR_EACH
+  #undef _
+  qsort(headless.resv,headless.resc,sizeof(struct headless_res),headless_res_cmp);
+  return 0;
+}
+
+int egg_res_get(void *dst,int dsta,int tid,int qual,int rid) {
+  int p=headless_res_search(tid,qual,rid);
+  if (p<0) return 0;
+  const struct headless_res *res=headless.resv+p;
+  if (dst&&(res->c<=dsta)) memcpy(dst,res->v,res->c);
+  return res->c;
+}
+
+int egg_res_for_each(int (*cb)(int tid,int qual,int rid,int len,void *userdata),void *userdata) {
+  const struct headless_res *res=headless.resv;
+  int i=headless.resc,err;
+  for (;i-->0;res++) {
+    if (err=cb(res->tid,res->qual,res->rid,res->c,userdata)) return err;
+  }
+  return 0;
+}
+
+/* Images: We read the size from a PNG header and nothing more.
+ */
+
+static int headless_image_size(int *w,int *h,int qual,int imageid) {
+  int p=headless_res_search(EGG_RESTYPE_image,qual,imageid);
+  if (p<0) return -1;
+  const uint8_t *src=headless.resv[p].v;
+  if ((headless.resv[p].c<24)||memcmp(src,"\x89PNG\r\n\x1a\n",8)||memcmp(src+12,"IHDR",4)) return -1;
+  *w=(src[16]<<24)|(src[17]<<16)|(src[18]<<8)|src[19];
+  *h=(src[20]<<24)|(src[21]<<16)|(src[22]<<8)|src[23];
+  return 0;
+}
+
+void egg_image_get_header(int *w,int *h,int *stride,int *fmt,int qual,int imageid) {
+  // Leave it zero. font_add_page() would want to decode the pixels, and we can't.
+}
+
+int egg_image_decode(void *dst,int dsta,int qual,int imageid) {
+  return -1;
+}
+
+/* Textures: Just a size per texid.
+ */
+
+static struct headless_texture *headless_texture_get(int texid) {
+  if ((texid<1)||(texid>=headless.texturec)) return 0;
+  struct headless_texture *texture=headless.texturev+texid;
+  if (texture->w<1) return 0;
+  return texture;
+}
+
+int egg_texture_new() {
+  int texid=1;
+  for (;texid<headless.texturec;texid++) {
+    if (headless.texturev[texid].w<1) break;
+  }
+  if (texid>=headless.texturea) {
+    int na=headless.texturea+32;
+    void *nv=realloc(headless.texturev,sizeof(struct headless_texture)*na);
+    if (!nv) return -1;
+    headless.texturev=nv;
+    headless.texturea=na;
+  }
+  if (texid>=headless.texturec) headless.texturec=texid+1;
+  struct headless_texture *texture=headless.texturev+texid;
+  texture->w=texture->h=1; // Allocated but empty.
+  texture->fmt=EGG_TEX_FMT_RGBA;
+  return texid;
+}
+
+void egg_texture_del(int texid) {
+  if (texid<=1) return;
+  struct headless_texture *texture=headless_texture_get(texid);
+  if (texture) texture->w=0;
+}
+
+int egg_texture_get_header(int *w,int *h,int *fmt,int texid) {
+  const struct headless_texture *texture=headless_texture_get(texid);
+  if (!texture) return -1;
+  if (w) *w=texture->w;
+  if (h) *h=texture->h;
+  if (fmt) *fmt=texture->fmt;
+  return 0;
+}
+
+int egg_texture_load_image(int texid,int qual,int imageid) {
+  struct headless_texture *texture=headless_texture_get(texid);
+  if (!texture) return -1;
+  int w=0,h=0;
+  if (headless_image_size(&w,&h,qual,imageid)<0) return -1;
+  texture->w=w;
+  texture->h=h;
+  texture->fmt=EGG_TEX_FMT_RGBA;
+  return 0;
+}
+
+int egg_texture_upload(int texid,int w,int h,int stride,int fmt,const void *src,int srcc) {
+  struct headless_texture *texture=headless_texture_get(texid);
+  if (!texture||(w<1)||(h<1)) return -1;
+  texture->w=w;
+  texture->h=h;
+  texture->fmt=fmt;
+  return 0;
+}
+
+void egg_texture_clear(int texid) {
+}
+
+/* Rendering: Noop.
+ */
+
+void egg_render_tint(uint32_t rgba) {}
+void egg_render_alpha(uint8_t a) {}
+void egg_draw_rect(int dsttexid,int x,int y,int w,int h,uint32_t rgba) {}
+void egg_draw_decal(int dsttexid,int srctexid,int dstx,int dsty,int srcx,int srcy,int w,int h,int xform) {}
+void egg_draw_decal_mode7(int dsttexid,int srctexid,int dstx,int dsty,int srcx,int srcy,int w,int h,int rotate,int xscale,int yscale) {}
+void egg_draw_tile(int dsttexid,int srctexid,const struct egg_draw_tile *v,int c) {}
+
+/* Hash the game's state.
+ * Sprites are summed, not chained, so the order of groups doesn't matter, only their content.
+ */
+
+static uint64_t headless_mix(uint64_t h,uint64_t v) {
+  h^=v;
+  h*=0x100000001b3ull;
+  return h^(h>>29);
+}
+
+static uint64_t headless_mix_double(uint64_t h,double v) {
+  uint64_t bits;
+  memcpy(&bits,&v,sizeof(bits));
+  return headless_mix(h,bits);
+}
+
+static uint64_t headless_hash_state() {
+  uint64_t sum=0;
+  const struct sprgrp *keepalive=sprgrpv+SPRGRP_KEEPALIVE;
+  int i=keepalive->sprc;
+  while (i-->0) {
+    const struct sprite *sprite=keepalive->sprv[i];
+    uint64_t h=0xcbf29ce484222325ull;
+    h=headless_mix(h,sprctl_id(sprite->sprctl));
+    h=headless_mix_double(h,sprite->x);
+    h=headless_mix_double(h,sprite->y);
+    h=headless_mix(h,sprite->tileid);
+    h=headless_mix(h,sprite->imageid);
+    h=headless_mix(h,sprite->grpmask);
+    sum+=h;
+  }
+  uint64_t h=headless_mix(0xcbf29ce484222325ull,sum);
+  h=headless_mix(h,g.mapid);
+  h=headless_mix(h,g.menuc);
+  h=headless_mix(h,g.hp);
+  int itemid=0; for (;itemid<=ITEM_COUNT;itemid++) h=headless_mix(h,g.itemqual[itemid]);
+  int cellp=0; for (;cellp<COLC*ROWC;cellp++) h=headless_mix(h,g.map.v[cellp]);
+  char stobus[1024];
+  int stobusc=stobus_encode(stobus,sizeof(stobus),&g.stobus);
+  if ((stobusc<0)||(stobusc>sizeof(stobus))) stobusc=0;
+  for (i=0;i<stobusc;i++) h=headless_mix(h,stobus[i]);
+  return h;
+}
+
+/* Read file.
+ */
+
+static int headless_file_read(void *dstpp,const char *path) {
+  FILE *f=fopen(path,"rb");
+  if (!f) return -1;
+  fseek(f,0,SEEK_END);
+  int c=ftell(f);
+  fseek(f,0,SEEK_SET);
+  char *v=malloc(c+1);
+  if (!v||(fread(v,1,c,f)!=c)) {
+    fclose(f);
+    if (v) free(v);
+    return -1;
+  }
+  fclose(f);
+  v[c]=0;
+  *(void**)dstpp=v;
+  return c;
+}
+
+/* Main.
+ */
+
+int headless_bench(const char *name); // bench.c
+
+int main(int argc,char **argv) {
+  const char *replaypath=0,*bench=0;
+  double fps=60.0;
+  headless.datapath="mid/data";
+  int argi=1; for (;argi<argc;argi++) {
+    const char *arg=argv[argi];
+    if (!memcmp(arg,"--data=",7)) headless.datapath=arg+7;
+    else if (!memcmp(arg,"--fps=",6)) fps=atof(arg+6);
+    else if (!memcmp(arg,"--bench=",8)) bench=arg+8;
+    else if ((arg[0]!='-')&&!replaypath) replaypath=arg;
+    else {
+      fprintf(stderr,"Usage: %s [--data=mid/data] [--fps=60] REPLAY\n   Or: %s --bench=NAME\n",argv[0],argv[0]);
+      return 1;
+    }
+  }
+  if (bench) return (headless_bench(bench)<0)?1:0;
+  if (!replaypath||(fps<=0.0)) {
+    fprintf(stderr,"Usage: %s [--data=mid/data] [--fps=60] REPLAY\n   Or: %s --bench=NAME\n",argv[0],argv[0]);
+    return 1;
+  }
+
+  if (headless_load_resources()<0) return 1;
+  if (egg_texture_new()!=1) return 1;
+  egg_texture_upload(1,SCREENW,SCREENH,SCREENW<<2,EGG_TEX_FMT_RGBA,0,0);
+
+  char *replay=0;
+  int replayc=headless_file_read(&replay,replaypath);
+  if (replayc<0) {
+    fprintf(stderr,"%s: Failed to read file\n",replaypath);
+    return 1;
+  }
+  if (replay_play_begin(replay,replayc)<0) {
+    fprintf(stderr,"%s: Not a replay, or unsupported version\n",replaypath);
+    return 1;
+  }
+
+  if (egg_client_init()<0) {
+    fprintf(stderr,"%s: egg_client_init failed\n",argv[0]);
+    return 1;
+  }
+
+  // (elapsed) here is only a placeholder; main.c replaces it with the recorded one.
+  int framec=0;
+  uint64_t checksum=0xcbf29ce484222325ull;
+  double awakesum=0.0,asleepsum=0.0,culledsum=0.0,sprdrawsum=0.0;
+  double starttime=egg_time_real();
+  while (!headless.terminate) {
+    egg_client_update(1.0/fps);
+    if (headless.terminate) break;
+    egg_client_render();
+    checksum=headless_mix(checksum,headless_hash_state());
+    int awakec=0,asleepc=0;
+    physics_get_sleep_counts(&awakec,&asleepc);
+    awakesum+=awakec;
+    asleepsum+=asleepc;
+    culledsum+=sprgrp_render_get_culled_count();
+    sprdrawsum+=sprgrp_render_get_draw_count();
+    framec++;
+  }
+  double elapsed=egg_time_real()-starttime;
+
+  egg_client_quit();
+  fprintf(stdout,
+    "%s: %d frames in %.3f s, %.0f frames/s. checksum %016llx\n",
+    replaypath,framec,elapsed,(elapsed>0.0)?(framec/elapsed):0.0,(unsigned long long)checksum
+  );
+  struct drawstats sum,max;
+  int drawframec=drawstats_get_totals(&sum,&max);
+  if (drawframec>0) {
+    int callc=sum.tilecallc+sum.decalc+sum.rectc;
+    fprintf(stdout,
+      "Per frame: %.1f draw calls (max %d), %.1f tiles, %.1f vertices, %.1f binds, %.1f targets, %.1f tint/alpha changes, %.1f redundant.\n",
+      (double)callc/drawframec,max.tilecallc+max.decalc+max.rectc,(double)sum.tilec/drawframec,(double)sum.vtxc/drawframec,
+      (double)sum.bindc/drawframec,(double)sum.targetc/drawframec,(double)(sum.tintc+sum.alphac)/drawframec,(double)sum.redundantc/drawframec
+    );
+  }
+  if (framec>0) {
+    fprintf(stdout,"Physics per frame: %.1f awake, %.1f asleep.\n",awakesum/framec,asleepsum/framec);
+    fprintf(stdout,"Sprites per frame: %.1f culled offscreen, %.1f draw calls.\n",culledsum/framec,sprdrawsum/framec);
+    fprintf(stdout,"Autosave: %d writes, %.2f/s.\n",autosave_get_write_count(),autosave_get_write_count()*fps/framec);
+  }
+  return 0;
+}
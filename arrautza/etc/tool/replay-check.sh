@@ -0,0 +1,48 @@
+#!/bin/sh
+# replay-check.sh HEADLESS DATADIR REPLAY...
+# Plays each replay under two heap layouts, and fails if the checksums disagree.
+# The second run sets glibc's MALLOC_MMAP_THRESHOLD_ tiny, so every allocation gets its own mapping,
+# and sprites land at addresses unrelated to the first run's.
+# Replays named STEM.N.txt with the same STEM must also agree with each other,
+# eg quickload.1.txt quick-saves, and quickload.2.txt quick-saves and quick-loads in the same frames.
+
+if [ "$#" -lt 3 ] ; then
+  echo "Usage: $0 HEADLESS DATADIR REPLAY..." >&2
+  exit 1
+fi
+HEADLESS="$1"
+DATADIR="$2"
+shift 2
+
+checksum() {
+  "$@" 2>/dev/null | sed -n 's/.*checksum \([0-9a-f]*\)$/\1/p'
+}
+
+STATUS=0
+SEEN=""
+for REPLAY in "$@" ; do
+  A="$(checksum "$HEADLESS" --data="$DATADIR" "$REPLAY")"
+  B="$(checksum env MALLOC_MMAP_THRESHOLD_=64 "$HEADLESS" --data="$DATADIR" "$REPLAY")"
+  if [ -z "$A" ] ; then
+    echo "$REPLAY: FAIL, no checksum"
+    STATUS=1
+  elif [ "$A" != "$B" ] ; then
+    echo "$REPLAY: FAIL, $A vs $B under a different heap layout"
+    STATUS=1
+  else
+    echo "$REPLAY: $A"
+  fi
+  NAME="$(basename "$REPLAY" .txt)"
+  STEM="${NAME%%.*}"
+  if [ -n "$A" ] && [ "$STEM" != "$NAME" ] ; then
+    PEER="$(printf '%s\n' "$SEEN" | sed -n "s/^$STEM \(.*\)$/\1/p" | head -n1)"
+    if [ -z "$PEER" ] ; then
+      SEEN="$SEEN
+$STEM $A"
+    elif [ "$PEER" != "$A" ] ; then
+      echo "$REPLAY: FAIL, other $STEM replays got $PEER"
+      STATUS=1
+    fi
+  fi
+done
+exit $STATUS
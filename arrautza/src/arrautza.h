@@ -10,6 +10,13 @@
 #include "util/font.h"
 #include "resid.h"
 
+/* Nonzero enables the frame profiler (F3 overlay, F4 trace dump) and the reports logged at quit.
+ * Shipping builds leave it off. `make DEBUG=1` turns it on; `make clean` first, the objects don't track it.
+ */
+#ifndef ARRAUTZA_DEBUG
+  #define ARRAUTZA_DEBUG 0
+#endif
+
 /* These must remain in sync:
  *  - TILESIZE*COLC==SCREENW
  *  - TILESIZE*ROWC==SCREENH
@@ -40,6 +47,9 @@
 #define MAPCMD_ucoord 0x40 /* u16:x u16:y */
 #define MAPCMD_door 0x80 /* u16:pt u16:mapid u16:dstpt u8:reserved1 u8:reserved2 */
 #define MAPCMD_sprite 0x81 /* u16:pt u16:spriteid u8:a u8:b u8:c u8:d */
+#define MAPCMD_walls 0xe0 /* u8:physics u8:x u8:y u8:w u8:h ... */ // Builder generates these. (x,y,w,h) repeat, in cells.
+#define MAPCMD_sprimages 0xe1 /* u16:imageid ... */ // Builder generates. Every image used by this map's sprites.
+#define MAPCMD_IS_POI(opcode) ((opcode)==MAPCMD_door) /* Begins with u16:pt, and the hero might care when stepping there. */
 #define MAPCMD_FOR_EACH \
   _(hero) \
   _(song) \
@@ -50,11 +60,14 @@
   _(neighbors) \
   _(ucoord) \
   _(door) \
-  _(sprite)
+  _(sprite) \
+  _(walls) \
+  _(sprimages)
 
 /* Sprite commands.
  * Same idea as map commands (exact same length rules too).
  */
+#define SPRITECMD_ccd       0x01 /* Sweep against walls from the previous position. For fast movers. */
 #define SPRITECMD_image     0x20 /* u16:imageid */
 #define SPRITECMD_tileid    0x21 /* u8:tileid u8:unused */
 #define SPRITECMD_xform     0x22 /* u8:xform u8:unused */
@@ -64,6 +77,7 @@
 #define SPRITECMD_groups    0x40 /* u32:grpmask */
 #define SPRITECMD_mapsolids 0x41 /* u32:physics */
 #define SPRITECMD_FOR_EACH \
+  _(ccd) \
   _(image) \
   _(tileid) \
   _(xform) \
@@ -150,6 +164,8 @@ extern struct globals {
   int texid_font_tiles;
   int texid_tilesheet;
   uint16_t imageid_tilesheet;
+  int texid_maplayer; // All of (map.v), prerendered.
+  int maplayer_dirty;
   uint16_t mapid;
   struct {
     uint16_t mapid;
@@ -157,21 +173,23 @@ extern struct globals {
     int transition;
   } mapnext;
   struct map map;
-  uint8_t poibits[(COLC*ROWC+7)>>3]; // LRTB cell index big-endianly. Nonzero if something exists at that cell.
+  struct map_index mapindex; // Commands in (map) by opcode, and POIs by cell.
   int16_t ucoordx,ucoordy; // Universal world coordinates of the map.
   
   int instate;
   int menu_pause_selection; // Persists even when the menu doesn't exist.
   
-  int texid_transtex; // Contains the outgoing frame during a transition.
+  int texid_worldv[2]; // Map and sprites render here, then copy to the framebuffer. Ping-pong at each transition.
+  int worldp; // Which of (texid_worldv) we're rendering into.
+  int texid_transtex; // Contains the outgoing frame during a transition. One of (texid_worldv), the one we're not using.
   double transclock; // Counts down during transition.
   double transtotal; // Full duration of transition. Constant during a transition.
   int transition;
   int transfx,transfy; // Focus point in old frame, for SPOTLIGHT. (for new frame, we find it dynamically).
   uint32_t transrgba; // For FADE_BLACK and SPOTLIGHT. Alpha must be opaque.
-  int renderx,rendery; // Where to put the new frame. Relevant for PAN transitions.
   int texid_spotlight;
   int renderseq;
+  double renderlerp; // 0..1, how far we are from the last update step to the next. Sprites render interpolated by this much.
   
   struct menu *menuv[MENU_LIMIT];
   int menuc;
@@ -199,6 +217,136 @@ int load_neighbor(uint8_t mapcmd);
 // main.c calls this at strategic times to commit a map change. Noop if no change pending.
 int check_map_change();
 
+/* Neighbor maps are loaded gradually, ahead of time. See prefetch.c.
+ * prefetch_update() does a small piece of work, once per frame during play.
+ * prefetch_take_map() loads (mapid) into (g.map,g.mapindex), its tilesheet texture, and physics walls.
+ * prefetch_note_frame() collects update times, and prefetch_report() logs them, split by proximity to a map change.
+ */
+void prefetch_update();
+int prefetch_take_map(uint16_t mapid);
+void prefetch_note_frame(double s);
+void prefetch_report();
+
+/* Autosave writes (g.stobus) to the store when it's dirty, at most once per second.
+ * Call autosave_update() once per frame, after stobus_flush().
+ * autosave_load() replaces (g.stobus) with the stored copy. >0 if loaded, 0 if nothing stored, <0 if invalid.
+ */
+void autosave_update(double elapsed);
+int autosave_load();
+int autosave_get_write_count();
+
+/* Savestate: A binary snapshot of globals, map, stobus, and sprites. See savestate.c.
+ * Encode returns the length and points (*dstpp) at our own buffer, valid until the next encode.
+ * Decode replaces the entire game state, without running any sprite's init or ready.
+ * A malformed snapshot returns -2 before anything changes, and the game carries on as it was.
+ * Failing after that (map load, allocation, a sprctl load hook) leaves the game undefined; you should reset_game().
+ * savestate_handle_save() and savestate_handle_load() are only for sprctl save and load hooks.
+ */
+int savestate_encode(const void **dstpp);
+int savestate_decode(const void *src,int srcc);
+uint32_t savestate_handle_save(uint32_t handle);
+uint32_t savestate_handle_load(uint32_t token);
+
+/* Input recording and deterministic replay. See replay.c.
+ * main.c feeds the recorder at each frame, cb_joy, and state-changing raw key.
+ * replay_play_begin() must happen before egg_client_init(), and (src) must stay alive throughout.
+ * While playing, main.c takes (elapsed) and input from the recording, and ignores real input.
+ * replay_play_frame() returns the event count, or <0 at the end.
+ */
+struct replay_event {
+  char type; // 's' state, 'k' keycode
+  int v;
+};
+void replay_record_begin(int seed);
+void replay_record_frame(double elapsed);
+void replay_record_state(int state);
+void replay_record_key(int keycode);
+int replay_record_save();
+int replay_play_begin(const char *src,int srcc);
+int replay_playing();
+int replay_get_seed();
+int replay_get_frame_count();
+int replay_play_frame(double *elapsed,struct replay_event *eventv,int eventa);
+
+/* Frame phase profiler. See profiler.c.
+ * Fence each phase with profiler_begin() and profiler_end(). Phases must not nest, so the graph can stack them.
+ * main.c calls profiler_frame_begin() at the start of update and profiler_frame_end() at the end of render.
+ * profiler_key() returns nonzero if it consumed the key (F3 overlay, F4 trace dump).
+ */
+#define PROFILER_PHASE_input       0 /* inkeep and replay */
+#define PROFILER_PHASE_menu        1 /* Menu updates, instead of the game. */
+#define PROFILER_PHASE_sprupdate   2
+#define PROFILER_PHASE_physics     3
+#define PROFILER_PHASE_footing     4
+#define PROFILER_PHASE_heronotify  5
+#define PROFILER_PHASE_deathrow    6
+#define PROFILER_PHASE_mapchange   7 /* stobus_flush and check_map_change, in the fixed step. */
+#define PROFILER_PHASE_prefetch    8
+#define PROFILER_PHASE_autosave    9
+#define PROFILER_PHASE_map        10 /* Render, from here on. */
+#define PROFILER_PHASE_sprsort    11 /* Bounds and sort, in sprgrp_render. */
+#define PROFILER_PHASE_sprdraw    12 /* Queue and flush, in sprgrp_render. */
+#define PROFILER_PHASE_hud        13
+#define PROFILER_PHASE_menurender 14
+#define PROFILER_PHASE_COUNT      15
+#define PROFILER_PHASE_FOR_EACH \
+  _(input) \
+  _(menu) \
+  _(sprupdate) \
+  _(physics) \
+  _(footing) \
+  _(heronotify) \
+  _(deathrow) \
+  _(mapchange) \
+  _(prefetch) \
+  _(autosave) \
+  _(map) \
+  _(sprsort) \
+  _(sprdraw) \
+  _(hud) \
+  _(menurender)
+void profiler_begin(int phase);
+void profiler_end(int phase);
+void profiler_frame_begin();
+void profiler_frame_end();
+int profiler_key(int keycode);
+void profiler_render();
+void profiler_report();
+
+/* Draw through these instead of egg_draw_* and egg_render_*, so we can count. See draw.c.
+ * main.c brackets render with drawstats_frame_begin() and drawstats_frame_end().
+ * drawstats_get_totals() returns the frame count, and fills in sum and max per field.
+ */
+struct drawstats {
+  int tilecallc; // egg_draw_tile calls...
+  int tilec; // ...and tiles in them.
+  int decalc; // Including mode7.
+  int rectc;
+  int clearc;
+  int vtxc;
+  int bindc; // Source texture changed since the last draw.
+  int targetc; // Output texture changed since the last draw.
+  int tintc,alphac; // Real changes.
+  int redundantc; // Tint or alpha set to what it already was.
+};
+void draw_tile(int dsttexid,int srctexid,const struct egg_draw_tile *v,int c);
+void draw_decal(int dsttexid,int srctexid,int dstx,int dsty,int srcx,int srcy,int w,int h,int xform);
+void draw_decal_mode7(int dsttexid,int srctexid,int dstx,int dsty,int srcx,int srcy,int w,int h,int rotate,int xscale,int yscale);
+void draw_rect(int dsttexid,int x,int y,int w,int h,uint32_t rgba);
+void draw_clear(int texid);
+void draw_tint(uint32_t rgba);
+void draw_alpha(uint8_t alpha);
+void drawstats_frame_begin();
+void drawstats_frame_end();
+const struct drawstats *drawstats_get_last();
+int drawstats_get_totals(struct drawstats *sum,struct drawstats *max);
+void drawstats_report();
+
+/* The map layer is drawn once into (g.texid_maplayer), and render_map() copies it out whole.
+ * If you change (g.map.v), tell us which cell, and it will be redrawn at the next render.
+ */
+void map_dirty_cell(int col,int row);
+void map_dirty_all();
 void render_map(int dsttexid);
 void check_sprites_footing(struct sprgrp *sprgrp);
 void check_sprites_heronotify(struct sprgrp *observers,struct sprgrp *heroes);
@@ -214,6 +362,7 @@ void update_compass(double elapsed);
 void game_over();
 
 // Hello menu calls this as it dismisses. Clears globals and loads the first map.
-int reset_game();
+// With (resume), restores the autosaved stobus after clearing.
+int reset_game(int resume);
   
 #endif
@@ -0,0 +1,80 @@
+#include "arrautza.h"
+
+/* Autosave.
+ * Whenever (g.stobus) is dirty, encode it and write to the store.
+ * Writes are throttled to one per AUTOSAVE_INTERVAL: The first change after a quiet period saves immediately,
+ * and a burst of changes after that coalesces into one write when the interval expires.
+ * reset_game() reads it back when continuing.
+ */
+
+#define AUTOSAVE_INTERVAL 1.0 /* s, minimum time between writes */
+#define AUTOSAVE_KEY "stobus"
+
+static double autosave_cooldown=0.0;
+static char *autosave_buf=0;
+static int autosave_bufa=0;
+static int autosave_writec=0;
+
+/* Encode and write, unconditionally.
+ */
+
+static int autosave_write() {
+  int len=stobus_encode(autosave_buf,autosave_bufa,&g.stobus);
+  if (len>autosave_bufa) {
+    int na=(len+256)&~255;
+    void *nv=realloc(autosave_buf,na);
+    if (!nv) return -1;
+    autosave_buf=nv;
+    autosave_bufa=na;
+    if ((len=stobus_encode(autosave_buf,autosave_bufa,&g.stobus))>autosave_bufa) return -1;
+  }
+  if (egg_store_set(AUTOSAVE_KEY,sizeof(AUTOSAVE_KEY)-1,autosave_buf,len)<0) {
+    egg_log("Failed to write %d bytes of saved state.",len);
+    return -1;
+  }
+  g.stobus.dirty=0;
+  autosave_writec++;
+  return 0;
+}
+
+/* Read from the store and decode into (g.stobus).
+ * Replays must not depend on the store, so we never load while one is playing.
+ */
+
+int autosave_load() {
+  if (replay_playing()) return 0;
+  int len=egg_store_get(autosave_buf,autosave_bufa,AUTOSAVE_KEY,sizeof(AUTOSAVE_KEY)-1);
+  if (len>autosave_bufa) {
+    int na=(len+256)&~255;
+    void *nv=realloc(autosave_buf,na);
+    if (!nv) return -1;
+    autosave_buf=nv;
+    autosave_bufa=na;
+    if ((len=egg_store_get(autosave_buf,autosave_bufa,AUTOSAVE_KEY,sizeof(AUTOSAVE_KEY)-1))>autosave_bufa) return -1;
+  }
+  if (len<1) return 0;
+  if (stobus_decode(&g.stobus,autosave_buf,len)<0) {
+    egg_log("Failed to decode %d bytes of saved state.",len);
+    return -1;
+  }
+  return 1;
+}
+
+/* Update.
+ */
+
+void autosave_update(double elapsed) {
+  if (autosave_cooldown>0.0) autosave_cooldown-=elapsed;
+  if (!g.stobus.dirty) return;
+  if (autosave_cooldown>0.0) return;
+  autosave_write();
+  // Reset the cooldown even if the write failed, so a broken store doesn't get hammered every frame.
+  autosave_cooldown=AUTOSAVE_INTERVAL;
+}
+
+/* Trivial accessors.
+ */
+
+int autosave_get_write_count() {
+  return autosave_writec;
+}
@@ -34,6 +34,11 @@ int builder_compile_tilesheet();
 int builder_compile_sprctl();
 int builder_compile_sprite();
 
+/* Read the "physics" table from tilesheet text into (physics), which must be 256 bytes.
+ * Returns >0 if present, 0 if absent, or <0 on error. (path) is only for logging.
+ */
+int builder_decode_tilesheet_physics(uint8_t *physics,const char *src,int srcc,const char *path);
+
 /* 1..63 on success, 0 on error. Type IDs are 6 bits and zero is forbidden.
  */
 int builder_restype_eval(const char *src,int srcc);
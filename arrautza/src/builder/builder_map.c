@@ -1,4 +1,5 @@
 #include "builder.h"
+#include "fs.h"
 
 /* Evaluate command.
  */
@@ -238,6 +239,321 @@ static int compile_cells(uint8_t *dst,const char *src) {
   return 0;
 }
 
+/* Measure a compiled command. Same rules as runtime map_command_measure().
+ */
+ 
+static int measure_command(const uint8_t *src,int srcc) {
+  if (srcc<1) return -1;
+  switch (src[0]&0xe0) {
+    case 0x00: return src[0]?1:0;
+    case 0x20: return (srcc>=3)?3:-1;
+    case 0x40: return (srcc>=5)?5:-1;
+    case 0x60: return (srcc>=7)?7:-1;
+    case 0x80: return (srcc>=9)?9:-1;
+    case 0xa0: return (srcc>=13)?13:-1;
+    case 0xc0: return (srcc>=17)?17:-1;
+    case 0xe0: {
+        if (src[0]>=0xf0) return -1;
+        if (srcc<2) return -1;
+        if (2+src[1]>srcc) return -1;
+        return 2+src[1];
+      }
+  }
+  return -1;
+}
+
+/* Find a resource's source file by its ID, from the "ID" or "ID-NAME" basename.
+ */
+ 
+struct find_resource_context {
+  int rid;
+  char path[1024];
+};
+
+static int find_resource_cb(const char *path,const char *base,char type,void *userdata) {
+  struct find_resource_context *ctx=userdata;
+  int rid=0,i=0;
+  for (;(base[i]>='0')&&(base[i]<='9');i++) rid=rid*10+base[i]-'0';
+  if (!i||(base[i]&&(base[i]!='-'))) return 0;
+  if (rid!=ctx->rid) return 0;
+  int pathc=0; while (path[pathc]) pathc++;
+  if (pathc>=sizeof(ctx->path)) return 0;
+  memcpy(ctx->path,path,pathc+1);
+  return 1;
+}
+
+/* Load the physics table for a given image, from its tilesheet source.
+ * Returns >0 if found, 0 if there's no tilesheet, or <0 on errors.
+ */
+ 
+static int read_tilesheet_physics(uint8_t *physics,int imageid) {
+  struct find_resource_context ctx={.rid=imageid};
+  if (dir_read("src/data/tilesheet",find_resource_cb,&ctx)<=0) return 0;
+  char *src=0;
+  int srcc=file_read(&src,ctx.path);
+  if (srcc<0) {
+    fprintf(stderr,"%s: Failed to read file.\n",ctx.path);
+    return -2;
+  }
+  int err=builder_decode_tilesheet_physics(physics,src,srcc,ctx.path);
+  free(src);
+  return err;
+}
+
+/* Rectangle cover for one physics class.
+ * We try a few strategies and keep whichever produces the fewest rectangles.
+ * Optimal partitioning is possible but intricate, and these are within a wall or two of it on real maps.
+ * All strategies produce disjoint rectangles, same as the runtime merge did.
+ */
+ 
+struct wallrect {
+  uint8_t x,y,w,h;
+};
+
+#define WALLRECT_LIMIT (COLC*ROWC)
+
+// Largest uncovered rectangle first, repeat until covered.
+static int cover_largest_first(struct wallrect *dst,const uint8_t *mask) {
+  uint8_t pending[COLC*ROWC];
+  memcpy(pending,mask,sizeof(pending));
+  int dstc=0;
+  for (;;) {
+    int bestarea=0;
+    struct wallrect best={0};
+    int height[COLC]={0};
+    int row=0; for (;row<ROWC;row++) {
+      int col;
+      for (col=0;col<COLC;col++) {
+        if (pending[row*COLC+col]) height[col]++;
+        else height[col]=0;
+      }
+      // Each column as the right edge, extend leftward while the minimum height holds something.
+      for (col=0;col<COLC;col++) {
+        int h=height[col],x=col;
+        for (;(x>=0)&&height[x];x--) {
+          if (height[x]<h) h=height[x];
+          int area=(col-x+1)*h;
+          if (area>bestarea) {
+            bestarea=area;
+            best.x=x;
+            best.y=row-h+1;
+            best.w=col-x+1;
+            best.h=h;
+          }
+        }
+      }
+    }
+    if (!bestarea) break;
+    dst[dstc++]=best;
+    int y=best.y; for (;y<best.y+best.h;y++) memset(pending+y*COLC+best.x,0,best.w);
+  }
+  return dstc;
+}
+
+// Maximal horizontal runs, then merge each with an identical run directly above. Or transposed.
+static int cover_strips(struct wallrect *dst,const uint8_t *mask,int vertical) {
+  int dstc=0;
+  int majorc=vertical?COLC:ROWC;
+  int minorc=vertical?ROWC:COLC;
+  int major=0; for (;major<majorc;major++) {
+    int minor=0;
+    while (minor<minorc) {
+      #define MASK(maj,min) (vertical?mask[(min)*COLC+(maj)]:mask[(maj)*COLC+(min)])
+      if (!MASK(major,minor)) { minor++; continue; }
+      int start=minor;
+      while ((minor<minorc)&&MASK(major,minor)) minor++;
+      #undef MASK
+      int len=minor-start;
+      struct wallrect *rect=0;
+      int i=dstc; while (i-->0) {
+        struct wallrect *q=dst+i;
+        if (vertical) {
+          if ((q->y==start)&&(q->h==len)&&(q->x+q->w==major)) { rect=q; break; }
+        } else {
+          if ((q->x==start)&&(q->w==len)&&(q->y+q->h==major)) { rect=q; break; }
+        }
+      }
+      if (rect) {
+        if (vertical) rect->w++;
+        else rect->h++;
+      } else {
+        rect=dst+dstc++;
+        if (vertical) {
+          rect->x=major;
+          rect->y=start;
+          rect->w=1;
+          rect->h=len;
+        } else {
+          rect->x=start;
+          rect->y=major;
+          rect->w=len;
+          rect->h=1;
+        }
+      }
+    }
+  }
+  return dstc;
+}
+
+static int cover_mask(struct wallrect *dst,const uint8_t *mask) {
+  struct wallrect tmp[WALLRECT_LIMIT];
+  int dstc=cover_largest_first(dst,mask);
+  int tmpc=cover_strips(tmp,mask,0);
+  if (tmpc<dstc) {
+    memcpy(dst,tmp,sizeof(struct wallrect)*tmpc);
+    dstc=tmpc;
+  }
+  tmpc=cover_strips(tmp,mask,1);
+  if (tmpc<dstc) {
+    memcpy(dst,tmp,sizeof(struct wallrect)*tmpc);
+    dstc=tmpc;
+  }
+  return dstc;
+}
+
+/* Append MAPCMD_walls commands to (map), describing the solid regions of its cells.
+ * This is an optimization: The runtime falls back to merging cells itself if we don't.
+ * So quietly do nothing if we can't find the tilesheet, or the map already has walls.
+ * If there isn't room for them, log a warning and carry on.
+ */
+ 
+static int generate_walls(struct map *map,int cmdc) {
+  int imageid=0,p=0;
+  while (p<cmdc) {
+    int len=measure_command(map->commands+p,cmdc-p);
+    if (len<1) break;
+    if (map->commands[p]==MAPCMD_walls) return cmdc;
+    if ((map->commands[p]==MAPCMD_image)&&(len==3)) imageid=(map->commands[p+1]<<8)|map->commands[p+2];
+    p+=len;
+  }
+  if (!imageid) return cmdc;
+  uint8_t physics[256]={0};
+  int err=read_tilesheet_physics(physics,imageid);
+  if (err<=0) return err?err:cmdc;
+  
+  // Every rect covers at least one cell, and each costs at most 4 bytes plus a 3-byte chunk header.
+  uint8_t dst[WALLRECT_LIMIT*7];
+  int dstc=0,wallc=0;
+  // The runtime only has 32 physics classes and ignores walls for any higher.
+  int ph=1; for (;ph<32;ph++) {
+    uint8_t mask[COLC*ROWC];
+    int i=COLC*ROWC,any=0;
+    while (i-->0) if (mask[i]=(physics[map->v[i]]==ph)) any=1;
+    if (!any) continue;
+    struct wallrect rectv[WALLRECT_LIMIT];
+    int rectc=cover_mask(rectv,mask);
+    wallc+=rectc;
+    // Payload length is one byte, so split into chunks of 63 rectangles.
+    for (i=0;i<rectc;) {
+      int chunkc=rectc-i;
+      if (chunkc>63) chunkc=63;
+      dst[dstc++]=MAPCMD_walls;
+      dst[dstc++]=1+chunkc*4;
+      dst[dstc++]=ph;
+      for (;chunkc-->0;i++) {
+        dst[dstc++]=rectv[i].x;
+        dst[dstc++]=rectv[i].y;
+        dst[dstc++]=rectv[i].w;
+        dst[dstc++]=rectv[i].h;
+      }
+    }
+  }
+  if (cmdc+dstc>sizeof(map->commands)) {
+    fprintf(stderr,"%s:WARNING: No room for %d walls (%d bytes), runtime will have to generate them.\n",builder.srcpath,wallc,dstc);
+    return cmdc;
+  }
+  memcpy(map->commands+cmdc,dst,dstc);
+  return cmdc+dstc;
+}
+
+/* Read the imageid from a sprite's source, ie its "image" command.
+ * Returns >0 if found, 0 if the sprite or its image is missing, or <0 on errors.
+ */
+ 
+static int read_sprite_imageid(int spriteid) {
+  struct find_resource_context ctx={.rid=spriteid};
+  if (dir_read("src/data/sprite",find_resource_cb,&ctx)<=0) return 0;
+  char *src=0;
+  int srcc=file_read(&src,ctx.path);
+  if (srcc<0) {
+    fprintf(stderr,"%s: Failed to read file.\n",ctx.path);
+    return -2;
+  }
+  struct sr_decoder decoder={.v=src,.c=srcc};
+  const char *line;
+  int linec,imageid=0;
+  while ((linec=sr_decode_line(&line,&decoder))>0) {
+    int i=0; for (;i<linec;i++) if (line[i]=='#') linec=i;
+    while ((linec>0)&&((unsigned char)line[linec-1]<=0x20)) linec--;
+    while ((linec>0)&&((unsigned char)line[0]<=0x20)) { linec--; line++; }
+    if ((linec<6)||memcmp(line,"image",5)||((unsigned char)line[5]>0x20)) continue;
+    const char *token=line+5;
+    int tokenc=linec-5;
+    while (tokenc&&((unsigned char)token[0]<=0x20)) { tokenc--; token++; }
+    if ((tokenc>6)&&!memcmp(token,"image:",6)) {
+      imageid=builder_rid_eval(EGG_RESTYPE_image,token+6,tokenc-6);
+    } else if ((sr_int_eval(&imageid,token,tokenc)<1)||(imageid<0)||(imageid>0xffff)) {
+      imageid=0;
+    }
+    if (!imageid) {
+      fprintf(stderr,"%s: Failed to evaluate image '%.*s'\n",ctx.path,tokenc,token);
+      free(src);
+      return -2;
+    }
+    break;
+  }
+  free(src);
+  return imageid;
+}
+
+/* Append a MAPCMD_sprimages command listing every image referred to by this map's sprites' sprdefs.
+ * Runtime uses it to load their textures before the map is entered.
+ * Also a good place to warn if a map can't render without thrashing texcache.
+ */
+ 
+static int generate_sprimages(struct map *map,int cmdc) {
+  int imagev[TEXCACHE_SIZE*4];
+  int imagec=0,p=0;
+  while (p<cmdc) {
+    int len=measure_command(map->commands+p,cmdc-p);
+    if (len<1) break;
+    if (map->commands[p]==MAPCMD_sprimages) return cmdc;
+    if ((map->commands[p]==MAPCMD_sprite)&&(len==9)) {
+      int spriteid=(map->commands[p+3]<<8)|map->commands[p+4];
+      int imageid=read_sprite_imageid(spriteid);
+      if (imageid<0) return imageid;
+      if (imageid) {
+        int i=imagec,have=0;
+        while (i-->0) if (imagev[i]==imageid) { have=1; break; }
+        if (!have&&(imagec<sizeof(imagev)/sizeof(int))) imagev[imagec++]=imageid;
+      }
+    }
+    p+=len;
+  }
+  if (!imagec) return cmdc;
+  int heroc=1,i=imagec;
+  while (i-->0) if (imagev[i]==RID_image_hero) { heroc=0; break; }
+  if (imagec+heroc>TEXCACHE_SIZE) {
+    fprintf(stderr,
+      "%s:WARNING: Sprites use %d images, plus hero, but TEXCACHE_SIZE is %d. Expect texture evictions every frame.\n",
+      builder.srcpath,imagec,TEXCACHE_SIZE
+    );
+  }
+  int dstc=2+imagec*2;
+  if (cmdc+dstc>sizeof(map->commands)) {
+    fprintf(stderr,"%s:WARNING: No room for sprimages (%d bytes), runtime will load sprite textures on first use.\n",builder.srcpath,dstc);
+    return cmdc;
+  }
+  uint8_t *dst=map->commands+cmdc;
+  *(dst++)=MAPCMD_sprimages;
+  *(dst++)=imagec*2;
+  for (i=0;i<imagec;i++) {
+    *(dst++)=imagev[i]>>8;
+    *(dst++)=imagev[i];
+  }
+  return cmdc+dstc;
+}
+
 /* Compile map, main entry point.
  */
  
@@ -278,6 +594,10 @@ int builder_compile_map() {
     }
     cmdc+=err;
   }
+  if ((err=generate_walls(&map,cmdc))<0) return err;
+  cmdc=err;
+  if ((err=generate_sprimages(&map,cmdc))<0) return err;
+  cmdc=err;
   // At runtime, we read maps directly off the resource.
   // They are not dependent on byte order.
   // So... easy peasy!
@@ -92,6 +92,12 @@ static int compile_sprctl_stobus_inner(struct sr_encoder *sprctl,struct sr_encod
       "if (id>=c) return 0;\n"
       "return sprctl_by_idv[id];\n"
     "}\n"
+    "int sprctl_id(const struct sprctl *sprctl) {\n"
+      "if (!sprctl) return 0;\n"
+      "int id=sizeof(sprctl_by_idv)/sizeof(void*);\n"
+      "while (id-->1) if (sprctl_by_idv[id]==sprctl) return id;\n"
+      "return 0;\n"
+    "}\n"
   ,-1)<0) return -1;
   if (sr_encode_raw(stobus,
     "  return 0;\n"
@@ -101,7 +107,7 @@ static int compile_sprctl_stobus_inner(struct sr_encoder *sprctl,struct sr_encod
   return 0;
 }
 
-/* Generate sprctl_by_id() from arrautza.h.
+/* Generate sprctl_by_id() and sprctl_id() from arrautza.h.
  * Also generate define_stobus_fields(), same idea.
  */
  
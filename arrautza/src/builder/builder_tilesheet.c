@@ -7,11 +7,11 @@ static inline int hexdigit_eval(char src) {
   return -1;
 }
 
-/* Compile tilesheet, main entry point.
+/* Decode tilesheet text, extracting just the physics table.
  */
  
-int builder_compile_tilesheet() {
-  struct sr_decoder decoder={.v=builder.src,.c=builder.srcc};
+int builder_decode_tilesheet_physics(uint8_t *physics,const char *src,int srcc,const char *path) {
+  struct sr_decoder decoder={.v=src,.c=srcc};
   const char *line;
   int linec,lineno=1;
   char name[32];
@@ -33,7 +33,7 @@ int builder_compile_tilesheet() {
         int hi=hexdigit_eval(line[linep++]);
         int lo=hexdigit_eval(line[linep++]);
         if ((hi<0)||(lo<0)) {
-          fprintf(stderr,"%s:%d: Invalid hex byte '%.2s'.\n",builder.srcpath,lineno,line+linep-2);
+          fprintf(stderr,"%s:%d: Invalid hex byte '%.2s'.\n",path,lineno,line+linep-2);
           return -2;
         }
         bin[binc++]=(hi<<4)|lo;
@@ -41,7 +41,7 @@ int builder_compile_tilesheet() {
       if (binc>=256) { // Table complete.
       
         if ((namec==7)&&!memcmp(name,"physics",7)) {
-          if (sr_encode_raw(&builder.dst,bin,binc)<0) return -1;
+          memcpy(physics,bin,binc);
         } // Ignore all other tables.
       
         binc=0;
@@ -52,7 +52,7 @@ int builder_compile_tilesheet() {
       // Blank lines are permitted between tables.
     } else {
       if (linec>=sizeof(name)) {
-        fprintf(stderr,"%s:%d: Invalid table name, must be under %d bytes.\n",builder.srcpath,lineno,(int)sizeof(name));
+        fprintf(stderr,"%s:%d: Invalid table name, must be under %d bytes.\n",path,lineno,(int)sizeof(name));
         return -2;
       }
       memcpy(name,line,linec);
@@ -62,7 +62,7 @@ int builder_compile_tilesheet() {
       // Ensure no duplicate tables, among ones we emit.
       if ((namec==7)&&!memcmp(name,"physics",7)) {
         if (have_physics) {
-          fprintf(stderr,"%s:%d: Duplicate physics table.\n",builder.srcpath,lineno);
+          fprintf(stderr,"%s:%d: Duplicate physics table.\n",path,lineno);
           return -2;
         }
         have_physics=1;
@@ -70,8 +70,21 @@ int builder_compile_tilesheet() {
     }
   }
   if (namec) {
-    fprintf(stderr,"%s: Incomplete table at end.\n",builder.srcpath);
+    fprintf(stderr,"%s: Incomplete table at end.\n",path);
     return -2;
   }
+  return have_physics;
+}
+
+/* Compile tilesheet, main entry point.
+ */
+ 
+int builder_compile_tilesheet() {
+  uint8_t physics[256];
+  int err=builder_decode_tilesheet_physics(physics,builder.src,builder.srcc,builder.srcpath);
+  if (err<0) return err;
+  if (err) {
+    if (sr_encode_raw(&builder.dst,physics,sizeof(physics))<0) return -1;
+  }
   return 0;
 }
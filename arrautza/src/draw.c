@@ -0,0 +1,143 @@
+#include "arrautza.h"
+
+/* Draw call accounting.
+ * Everything in arrautza that draws goes through these instead of egg_draw_* and egg_render_* directly.
+ * util/tile_renderer.c too, by way of draw_hooks.h (TILE_RENDERER_HOOKS in the Makefile).
+ * Each call passes straight through and bumps a counter. The counters reset at drawstats_frame_begin().
+ *
+ * We count a tile as one vertex, and a decal or rect as four.
+ * A "bind" is a draw whose source texture differs from the previous draw's, and a "target" the same for output.
+ * Tint and alpha count only when they actually change; setting the current value again counts as redundant.
+ * inkeep draws for itself, and the profiler overlay draws after the frame closes, so neither is counted.
+ * (profiler.c also calls egg_draw_* directly, to keep its own draws out of the stats).
+ */
+
+static struct drawstats drawstats_current={0};
+static struct drawstats drawstats_last={0};
+static struct drawstats drawstats_sum={0};
+static struct drawstats drawstats_max={0};
+static int drawstats_framec=0;
+static int drawstats_srctexid=0,drawstats_dsttexid=0;
+static uint32_t drawstats_tint=0;
+static uint8_t drawstats_alpha=0xff;
+
+/* Bookkeeping common to every draw.
+ */
+
+static void drawstats_texture(int dsttexid,int srctexid,int vtxc) {
+  drawstats_current.vtxc+=vtxc;
+  if (dsttexid!=drawstats_dsttexid) {
+    drawstats_current.targetc++;
+    drawstats_dsttexid=dsttexid;
+  }
+  if (srctexid&&(srctexid!=drawstats_srctexid)) {
+    drawstats_current.bindc++;
+    drawstats_srctexid=srctexid;
+  }
+}
+
+/* Wrappers.
+ */
+
+void draw_tile(int dsttexid,int srctexid,const struct egg_draw_tile *v,int c) {
+  drawstats_current.tilecallc++;
+  drawstats_current.tilec+=c;
+  drawstats_texture(dsttexid,srctexid,c);
+  egg_draw_tile(dsttexid,srctexid,v,c);
+}
+
+void draw_decal(int dsttexid,int srctexid,int dstx,int dsty,int srcx,int srcy,int w,int h,int xform) {
+  drawstats_current.decalc++;
+  drawstats_texture(dsttexid,srctexid,4);
+  egg_draw_decal(dsttexid,srctexid,dstx,dsty,srcx,srcy,w,h,xform);
+}
+
+void draw_decal_mode7(int dsttexid,int srctexid,int dstx,int dsty,int srcx,int srcy,int w,int h,int rotate,int xscale,int yscale) {
+  drawstats_current.decalc++;
+  drawstats_texture(dsttexid,srctexid,4);
+  egg_draw_decal_mode7(dsttexid,srctexid,dstx,dsty,srcx,srcy,w,h,rotate,xscale,yscale);
+}
+
+void draw_rect(int dsttexid,int x,int y,int w,int h,uint32_t rgba) {
+  drawstats_current.rectc++;
+  drawstats_texture(dsttexid,0,4);
+  egg_draw_rect(dsttexid,x,y,w,h,rgba);
+}
+
+void draw_clear(int texid) {
+  drawstats_current.clearc++;
+  egg_texture_clear(texid);
+}
+
+void draw_tint(uint32_t rgba) {
+  if (rgba==drawstats_tint) drawstats_current.redundantc++;
+  else {
+    drawstats_current.tintc++;
+    drawstats_tint=rgba;
+  }
+  egg_render_tint(rgba);
+}
+
+void draw_alpha(uint8_t alpha) {
+  if (alpha==drawstats_alpha) drawstats_current.redundantc++;
+  else {
+    drawstats_current.alphac++;
+    drawstats_alpha=alpha;
+  }
+  egg_render_alpha(alpha);
+}
+
+/* Frames.
+ * struct drawstats is all ints, so sum and max can walk it as an array.
+ */
+
+void drawstats_frame_begin() {
+  memset(&drawstats_current,0,sizeof(struct drawstats));
+  // The platform may rebind between frames, so call the first draw of each frame a change.
+  drawstats_srctexid=drawstats_dsttexid=0;
+}
+
+void drawstats_frame_end() {
+  drawstats_last=drawstats_current;
+  const int *src=(int*)&drawstats_current;
+  int *sum=(int*)&drawstats_sum;
+  int *max=(int*)&drawstats_max;
+  int i=sizeof(struct drawstats)/sizeof(int);
+  for (;i-->0;src++,sum++,max++) {
+    (*sum)+=*src;
+    if (*src>*max) *max=*src;
+  }
+  drawstats_framec++;
+}
+
+const struct drawstats *drawstats_get_last() {
+  return &drawstats_last;
+}
+
+int drawstats_get_totals(struct drawstats *sum,struct drawstats *max) {
+  if (sum) *sum=drawstats_sum;
+  if (max) *max=drawstats_max;
+  return drawstats_framec;
+}
+
+/* Report.
+ */
+
+void drawstats_report() {
+  if (drawstats_framec<1) return;
+  double framec=drawstats_framec;
+  egg_log("Draws per frame over %d frames, avg/max:",drawstats_framec);
+  #define _(tag,name) egg_log("  %s: %.1f %d",name,drawstats_sum.tag/framec,drawstats_max.tag);
+  _(tilecallc,"egg_draw_tile")
+  _(tilec,"tiles")
+  _(decalc,"decals")
+  _(rectc,"rects")
+  _(clearc,"clears")
+  _(vtxc,"vertices")
+  _(bindc,"texture binds")
+  _(targetc,"target changes")
+  _(tintc,"tint changes")
+  _(alphac,"alpha changes")
+  _(redundantc,"redundant tint/alpha")
+  #undef _
+}
@@ -0,0 +1,21 @@
+/* draw_hooks.h
+ * util/tile_renderer.c includes this when built with -DTILE_RENDERER_HOOKS='"draw_hooks.h"'.
+ * Its draws and render state changes then go through draw.c and get counted, like ours.
+ */
+
+#ifndef DRAW_HOOKS_H
+#define DRAW_HOOKS_H
+
+#include <stdint.h>
+#include <egg/egg_video.h>
+
+void draw_tile(int dsttexid,int srctexid,const struct egg_draw_tile *v,int c);
+void draw_tint(uint32_t rgba);
+void draw_alpha(uint8_t alpha);
+
+// Function-like, so "struct egg_draw_tile" is left alone.
+#define egg_draw_tile(dsttexid,srctexid,v,c) draw_tile(dsttexid,srctexid,v,c)
+#define egg_render_tint(rgba) draw_tint(rgba)
+#define egg_render_alpha(alpha) draw_alpha(alpha)
+
+#endif
@@ -51,6 +51,94 @@ int map_command_measure(const uint8_t *src,int srcc) {
   return -1;
 }
 
+/* Build index.
+ */
+ 
+void map_index_build(struct map_index *index,const struct map *map) {
+  memset(index->opp,0,sizeof(index->opp));
+  memset(index->cellp,0,sizeof(index->cellp));
+  
+  // Count each opcode, and POIs at each cell. Counts land one slot ahead, to become start positions.
+  int p=0;
+  while (p<MAP_COMMANDS_LIMIT) {
+    const uint8_t *cmd=map->commands+p;
+    int len=map_command_measure(cmd,MAP_COMMANDS_LIMIT-p);
+    if (len<1) break;
+    index->opp[cmd[0]+1]++;
+    if (MAPCMD_IS_POI(cmd[0])&&(len>=3)&&(cmd[1]<COLC)&&(cmd[2]<ROWC)) {
+      index->cellp[cmd[2]*COLC+cmd[1]+1]++;
+    }
+    p+=len;
+  }
+  int i;
+  for (i=1;i<257;i++) index->opp[i]+=index->opp[i-1];
+  for (i=1;i<=COLC*ROWC;i++) index->cellp[i]+=index->cellp[i-1];
+  
+  // Fill, using the starts as insertion points. They end up shifted by one.
+  p=0;
+  while (p<MAP_COMMANDS_LIMIT) {
+    const uint8_t *cmd=map->commands+p;
+    int len=map_command_measure(cmd,MAP_COMMANDS_LIMIT-p);
+    if (len<1) break;
+    index->opv[index->opp[cmd[0]]++]=p;
+    if (MAPCMD_IS_POI(cmd[0])&&(len>=3)&&(cmd[1]<COLC)&&(cmd[2]<ROWC)) {
+      index->cellv[index->cellp[cmd[2]*COLC+cmd[1]]++]=p;
+    }
+    p+=len;
+  }
+  memmove(index->opp+1,index->opp,sizeof(uint16_t)*256);
+  index->opp[0]=0;
+  memmove(index->cellp+1,index->cellp,sizeof(uint16_t)*COLC*ROWC);
+  index->cellp[0]=0;
+}
+
+/* Indexed lookups.
+ */
+ 
+int map_index_get_command(const struct map_index *index,const struct map *map,uint8_t opcode) {
+  if (opcode>=0x60) return 0;
+  if (index->opp[opcode+1]<=index->opp[opcode]) return 0;
+  const uint8_t *b=map->commands+index->opv[index->opp[opcode]]+1;
+  switch (opcode&0xe0) {
+    case 0x00: return 1;
+    case 0x20: return (b[0]<<8)|b[1];
+    case 0x40: return (b[0]<<24)|(b[1]<<16)|(b[2]<<8)|b[3];
+  }
+  return 0;
+}
+
+static int map_for_each_offset(
+  const struct map *map,const uint16_t *v,int c,
+  int (*cb)(const uint8_t *cmd,int cmdc,void *userdata),void *userdata
+) {
+  int err;
+  for (;c-->0;v++) {
+    const uint8_t *cmd=map->commands+*v;
+    int cmdc=map_command_measure(cmd,MAP_COMMANDS_LIMIT-*v);
+    if (cmdc<1) continue;
+    if (err=cb(cmd,cmdc,userdata)) return err;
+  }
+  return 0;
+}
+
+int map_for_each_command_of(
+  const struct map *map,const struct map_index *index,uint8_t opcode,
+  int (*cb)(const uint8_t *cmd,int cmdc,void *userdata),void *userdata
+) {
+  int p=index->opp[opcode];
+  return map_for_each_offset(map,index->opv+p,index->opp[opcode+1]-p,cb,userdata);
+}
+
+int map_for_each_command_at(
+  const struct map *map,const struct map_index *index,int col,int row,
+  int (*cb)(const uint8_t *cmd,int cmdc,void *userdata),void *userdata
+) {
+  if ((col<0)||(row<0)||(col>=COLC)||(row>=ROWC)) return 0;
+  int cellp=row*COLC+col;
+  int p=index->cellp[cellp];
+  return map_for_each_offset(map,index->cellv+p,index->cellp[cellp+1]-p,cb,userdata);
+}
+
 /* Get first occurrence of scalar command.
  */
  
@@ -20,6 +20,16 @@ struct map {
   uint8_t commands[MAP_COMMANDS_LIMIT];
 };
 
+/* Decoded "tilesheet" resource, keyed by the image it goes with.
+ * tilesheet_get() decodes on first use and keeps it forever, so just hold the pointer.
+ * (physics) is MAP_PHYSICS_* for each tileid.
+ */
+struct tilesheet {
+  int imageid;
+  uint8_t physics[256];
+};
+const struct tilesheet *tilesheet_get(int imageid);
+
 /* Populate map from a resource.
  * In this fixed-size regime, it's literally just `egg_res_get(map,sizeof(*map),EGG_RESTYPE_map,qual,rid)`.
  * But you might need dynamic decoding in the future.
@@ -56,4 +66,45 @@ int map_command_measure(const uint8_t *src,int srcc);
  */
 int map_get_command(const struct map *map,uint8_t opcode);
 
+/* Index of a map's commands, built once at load, so nobody has to rescan the stream.
+ * (opp,opv): Offsets of all commands with opcode (n) are opv[opp[n]..opp[n+1]), in stream order.
+ * (cellp,cellv): Same idea, for POI commands (per MAPCMD_IS_POI) at cell (n), LRTB.
+ * All offsets are into (map->commands).
+ * The index is only valid for the map it was built from, and only as long as that map is unchanged.
+ */
+#define MAP_INDEX_POI_LIMIT (MAP_COMMANDS_LIMIT/3) /* POI commands begin with a position, so they're at least 3 bytes. */
+struct map_index {
+  uint16_t opp[257];
+  uint16_t opv[MAP_COMMANDS_LIMIT];
+  uint16_t cellp[COLC*ROWC+1];
+  uint16_t cellv[MAP_INDEX_POI_LIMIT];
+};
+
+void map_index_build(struct map_index *index,const struct map *map);
+
+// Same as map_get_command(), but constant time.
+int map_index_get_command(const struct map_index *index,const struct map *map,uint8_t opcode);
+
+static inline int map_index_count(const struct map_index *index,uint8_t opcode) {
+  return index->opp[opcode+1]-index->opp[opcode];
+}
+
+// Nonzero if any POI command is at (col,row).
+static inline int map_index_has_poi(const struct map_index *index,int col,int row) {
+  if ((col<0)||(row<0)||(col>=COLC)||(row>=ROWC)) return 0;
+  int p=row*COLC+col;
+  return (index->cellp[p+1]>index->cellp[p]);
+}
+
+/* Same as map_for_each_command(), but only commands with one opcode, or POI commands at one cell.
+ */
+int map_for_each_command_of(
+  const struct map *map,const struct map_index *index,uint8_t opcode,
+  int (*cb)(const uint8_t *cmd,int cmdc,void *userdata),void *userdata
+);
+int map_for_each_command_at(
+  const struct map *map,const struct map_index *index,int col,int row,
+  int (*cb)(const uint8_t *cmd,int cmdc,void *userdata),void *userdata
+);
+
 #endif
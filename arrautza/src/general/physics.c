@@ -5,42 +5,197 @@
 /* Globals.
  */
  
-static struct wall {
+struct wall {
   struct aabb aabb;
   int physics; // 1<<tilesheet.physics
-} physics_wallv[COLC*ROWC];
-static int physics_wallc=0;
+};
+
+/* The wall index is a grid of map cells, plus a one-cell border all around that catches anything offscreen.
+ * The sprite broadphase has its own grid, sized to suit the sprites.
+ */
+#define PHYSICS_GRIDW (COLC+2)
+#define PHYSICS_GRIDH (ROWC+2)
+
+/* One map's static walls and their index.
+ * Walls touching each grid cell are listed in ascending order, packed:
+ * Cell (n) lists indices into (wallv), from cellwallv[cellwallp[n]] to cellwallv[cellwallp[n+1]].
+ */
+struct physics_walls {
+  struct wall wallv[COLC*ROWC];
+  int wallc;
+  int cellwallp[PHYSICS_GRIDW*PHYSICS_GRIDH+1];
+  int *cellwallv;
+  int cellwalla;
+};
+
+// physics_rebuild_map() builds here. Whatever (physics_walls) points to is what we collide against.
+static struct physics_walls physics_walls_default={0};
+static struct physics_walls *physics_walls=&physics_walls_default;
+
+// Scratch for wall queries, one bit per index in (wallv).
+static uint32_t physics_wallbits[(COLC*ROWC+31)>>5];
 
 #define COLLISION_LIMIT 32
+#define PHYSICS_PASS_LIMIT 8 /* Per sprite, for the static resolver. Concave corners can need a few. */
+#define PHYSICS_SWEEP_MARGIN 0.000001 /* Shrink swept boxes by so much, so rounding error at a resting contact doesn't read as overlap. */
 static struct collision {
   struct sprite *a,*b;
   uint8_t dir; // DIR_N,W,E,W, which edge of (a) is colliding
   int physics; // Multiple 1<<tilesheet.physics, if (b) null
 } physics_collisionv[COLLISION_LIMIT];
 static int physics_collisionc=0;
+
+static int physics_wakeall=0; // Walls changed; nobody gets to sleep through the next update.
+static int physics_awakec=0,physics_asleepc=0;
  
-/* Rebuild statics.
+/* Grid coordinates for a position in tiles.
+ * "lower" is the cell containing (v), and "upper" is the last cell an edge at (v) reaches into from below.
+ * They're the same thing, except when (v) is an integer: then "upper" is the cell before.
+ * Grid coordinates are offset by one for the border, and clamp into it.
  */
  
-void physics_rebuild_map() {
-  physics_wallc=0;
-  uint8_t tilesheet[256]={0};
-  int tilesheetc=egg_res_get(tilesheet,sizeof(tilesheet),EGG_RESTYPE_tilesheet,0,g.imageid_tilesheet);
-  if ((tilesheetc<1)||(tilesheetc>sizeof(tilesheet))) {
-    egg_log("WARNING: No tilesheet for image:0:%d",g.imageid_tilesheet);
-    return;
+static int physics_grid_coord(double v,int limit) {
+  if (!(v>=-1.0)) return 0;
+  if (v>=limit) return limit+1;
+  return (int)(v+1.0);
+}
+
+static int physics_grid_coord_upper(double v,int limit) {
+  if (!(v>=-1.0)) return 0;
+  if (v>limit) return limit+1;
+  int c=(int)(v+1.0);
+  if (c==v+1.0) c--;
+  return (c<0)?0:c;
+}
+
+/* Rebuild the per-cell wall index from (walls->wallv).
+ * A wall covers cells from lower(l) to upper(r). Walls are disjoint so there's usually just one per cell.
+ */
+ 
+static void physics_index_walls(struct physics_walls *walls) {
+  memset(walls->cellwallp,0,sizeof(walls->cellwallp));
+  const struct wall *wall=walls->wallv;
+  int i=0; for (;i<walls->wallc;i++,wall++) {
+    int x0=physics_grid_coord(wall->aabb.l,COLC);
+    int y0=physics_grid_coord(wall->aabb.t,ROWC);
+    int x1=physics_grid_coord_upper(wall->aabb.r,COLC);
+    int y1=physics_grid_coord_upper(wall->aabb.b,ROWC);
+    int y=y0; for (;y<=y1;y++) {
+      int x=x0; for (;x<=x1;x++) walls->cellwallp[y*PHYSICS_GRIDW+x+1]++;
+    }
+  }
+  int cellc=PHYSICS_GRIDW*PHYSICS_GRIDH;
+  for (i=1;i<=cellc;i++) walls->cellwallp[i]+=walls->cellwallp[i-1];
+  if (walls->cellwallp[cellc]>walls->cellwalla) {
+    int na=(walls->cellwallp[cellc]+256)&~255;
+    void *nv=realloc(walls->cellwallv,sizeof(int)*na);
+    if (!nv) {
+      egg_log("ERROR: Failed to allocate wall index, %d entries.",walls->cellwallp[cellc]);
+      walls->wallc=0;
+      memset(walls->cellwallp,0,sizeof(walls->cellwallp));
+      return;
+    }
+    walls->cellwallv=nv;
+    walls->cellwalla=na;
+  }
+  // Fill in wall order, and use (cellwallp[n]) as the insertion point; it ends up shifted by one.
+  for (wall=walls->wallv,i=0;i<walls->wallc;i++,wall++) {
+    int x0=physics_grid_coord(wall->aabb.l,COLC);
+    int y0=physics_grid_coord(wall->aabb.t,ROWC);
+    int x1=physics_grid_coord_upper(wall->aabb.r,COLC);
+    int y1=physics_grid_coord_upper(wall->aabb.b,ROWC);
+    int y=y0; for (;y<=y1;y++) {
+      int x=x0; for (;x<=x1;x++) walls->cellwallv[walls->cellwallp[y*PHYSICS_GRIDW+x]++]=i;
+    }
   }
-  const uint8_t *cell=g.map.v;
+  memmove(walls->cellwallp+1,walls->cellwallp,sizeof(int)*cellc);
+  walls->cellwallp[0]=0;
+}
+
+/* Mark in (physics_wallbits) every wall touching (aabb), including walls that only touch at an edge.
+ * Then physics_wall_next() walks them in index order, same as a linear scan would.
+ */
+ 
+static void physics_wall_query(const struct aabb *aabb) {
+  memset(physics_wallbits,0,sizeof(physics_wallbits));
+  int x0=physics_grid_coord_upper(aabb->l,COLC);
+  int y0=physics_grid_coord_upper(aabb->t,ROWC);
+  int x1=physics_grid_coord(aabb->r,COLC);
+  int y1=physics_grid_coord(aabb->b,ROWC);
+  int y=y0; for (;y<=y1;y++) {
+    const int *cellp=physics_walls->cellwallp+y*PHYSICS_GRIDW+x0;
+    int x=x0; for (;x<=x1;x++,cellp++) {
+      int p=cellp[0],c=cellp[1];
+      for (;p<c;p++) {
+        int wi=physics_walls->cellwallv[p];
+        physics_wallbits[wi>>5]|=1u<<(wi&31);
+      }
+    }
+  }
+}
+
+static int physics_wall_next(int wi) {
+  wi++;
+  int wordp=wi>>5;
+  const int wordc=sizeof(physics_wallbits)/sizeof(uint32_t);
+  if (wordp>=wordc) return -1;
+  uint32_t word=physics_wallbits[wordp]&(0xffffffffu<<(wi&31));
+  for (;;) {
+    if (word) return (wordp<<5)+__builtin_ctz(word);
+    if (++wordp>=wordc) return -1;
+    word=physics_wallbits[wordp];
+  }
+}
+
+/* Copy walls from the map's MAPCMD_walls commands, if it has any.
+ * Builder generates these with a tighter cover than physics_merge_cells() can manage.
+ */
+ 
+struct physics_copy_walls_context {
+  struct physics_walls *walls;
+  int cmdc;
+};
+ 
+static int physics_copy_walls_cb(const uint8_t *cmd,int cmdc,void *userdata) {
+  if (cmd[0]!=MAPCMD_walls) return 0;
+  struct physics_copy_walls_context *ctx=userdata;
+  struct physics_walls *walls=ctx->walls;
+  ctx->cmdc++;
+  if (cmdc<3) return 0;
+  if (cmd[2]>=32) return 0;
+  int ph=1<<cmd[2];
+  const uint8_t *src=cmd+3;
+  int srcc=cmdc-3;
+  for (;srcc>=4;src+=4,srcc-=4) {
+    if ((src[2]<1)||(src[3]<1)||(src[0]+src[2]>COLC)||(src[1]+src[3]>ROWC)) continue;
+    if (walls->wallc>=COLC*ROWC) return 1;
+    struct wall *wall=walls->wallv+walls->wallc++;
+    wall->aabb.l=src[0];
+    wall->aabb.t=src[1];
+    wall->aabb.r=src[0]+src[2];
+    wall->aabb.b=src[1]+src[3];
+    wall->physics=ph;
+  }
+  return 0;
+}
+
+/* No walls baked into the map, so generate them from the cells.
+ */
+ 
+static int physics_merge_cells(struct physics_walls *walls,const struct map *map,int imageid) {
+  const struct tilesheet *tilesheet=tilesheet_get(imageid);
+  if (!tilesheet) return -1;
+  const uint8_t *cell=map->v;
   int row=0; for (;row<ROWC;row++) {
     int col=0; for (;col<COLC;col++,cell++) {
-      int ph=tilesheet[*cell];
-      if (!ph) continue;
+      int ph=tilesheet->physics[*cell];
+      if (!ph||(ph>=32)) continue;
       ph=1<<ph;
       // Combine with an existing wall if possible.
       // This can dramatically reduce the amount of collision testing we need once running.
       // We're advancing LRTB, so an existing wall can only be up or left of us.
-      struct wall *wall=physics_wallv;
-      int i=physics_wallc;
+      struct wall *wall=walls->wallv;
+      int i=walls->wallc;
       for (;i-->0;wall++) {
         if ((wall->aabb.l==col)&&(wall->aabb.r==col+1.0)&&(wall->aabb.b==row)&&(wall->physics==ph)) {
           wall->aabb.b+=1.0;
@@ -51,7 +206,7 @@ void physics_rebuild_map() {
           goto _done_adding_wall_;
         }
       }
-      wall=physics_wallv+physics_wallc++;
+      wall=walls->wallv+walls->wallc++;
       wall->aabb.l=col;
       wall->aabb.t=row;
       wall->aabb.r=col+1.0;
@@ -60,16 +215,64 @@ void physics_rebuild_map() {
      _done_adding_wall_:;
     }
   }
+  return 0;
+}
+
+/* Build walls for an arbitrary map.
+ */
+ 
+static void physics_build_walls(struct physics_walls *walls,const struct map *map,int imageid) {
+  walls->wallc=0;
+  struct physics_copy_walls_context ctx={.walls=walls};
+  map_for_each_command(map,physics_copy_walls_cb,&ctx);
+  if (!ctx.cmdc) {
+    if (physics_merge_cells(walls,map,imageid)<0) {
+      physics_index_walls(walls);
+      return;
+    }
+  }
   // Any wall touching the screen's edge, extend 100 meters offscreen to be safe.
   const double right=COLC-0.5,bottom=ROWC-0.5;
-  struct wall *wall=physics_wallv;
-  int i=physics_wallc;
+  struct wall *wall=walls->wallv;
+  int i=walls->wallc;
   for (;i-->0;wall++) {
     if (wall->aabb.l<0.5) wall->aabb.l-=100.0;
     if (wall->aabb.t<0.5) wall->aabb.t-=100.0;
     if (wall->aabb.r>right) wall->aabb.r+=100.0;
     if (wall->aabb.b>bottom) wall->aabb.b+=100.0;
   }
+  physics_index_walls(walls);
+}
+
+/* Rebuild statics.
+ */
+ 
+void physics_rebuild_map() {
+  physics_build_walls(&physics_walls_default,&g.map,g.imageid_tilesheet);
+  physics_use_walls(0);
+}
+
+/* Prebuilt walls.
+ */
+ 
+struct physics_walls *physics_walls_new(const struct map *map,int imageid) {
+  struct physics_walls *walls=calloc(1,sizeof(struct physics_walls));
+  if (!walls) return 0;
+  physics_build_walls(walls,map,imageid);
+  return walls;
+}
+
+void physics_walls_del(struct physics_walls *walls) {
+  if (!walls||(walls==&physics_walls_default)) return;
+  if (walls==physics_walls) physics_use_walls(0);
+  if (walls->cellwallv) free(walls->cellwallv);
+  free(walls);
+}
+
+void physics_use_walls(struct physics_walls *walls) {
+  if (!walls) walls=&physics_walls_default;
+  physics_walls=walls;
+  physics_wakeall=1;
 }
 
 /* Refresh (sprite->aabb). Must do this whenever we change (x,y), and also at the very start.
@@ -86,6 +289,12 @@ void physics_refresh_aabb(struct sprite *sprite) {
  */
  
 static void physics_add_collision(struct sprite *a,struct sprite *b,uint8_t dir,int physics) {
+  a->phcollided=1;
+  a->phasleep=0;
+  if (b) {
+    b->phcollided=1;
+    b->phasleep=0;
+  }
   if (physics_collisionc>=COLLISION_LIMIT) return;
   struct collision *collision=physics_collisionv+physics_collisionc++;
   collision->a=a;
@@ -94,18 +303,120 @@ static void physics_add_collision(struct sprite *a,struct sprite *b,uint8_t dir,
   collision->physics=physics;
 }
 
+/* Time of impact for box (a) moving by (dx,dy) against static box (w).
+ * Returns a time in 0..1 and sets (*axis) to 0 for horizontal or 1 for vertical, if they collide along the way.
+ * Otherwise >1. That includes walls we're already overlapping at the start; those are someone else's problem.
+ * Touching edges don't count, same as the static resolver.
+ */
+ 
+static double physics_sweep_wall(int *axis,const struct aabb *a,double dx,double dy,const struct aabb *w) {
+  double entx,extx,enty,exty;
+  if (dx>0.0) { entx=(w->l-a->r)/dx; extx=(w->r-a->l)/dx; }
+  else if (dx<0.0) { entx=(w->r-a->l)/dx; extx=(w->l-a->r)/dx; }
+  else if ((a->r<=w->l)||(a->l>=w->r)) return 2.0;
+  else { entx=-2.0; extx=2.0; }
+  if (dy>0.0) { enty=(w->t-a->b)/dy; exty=(w->b-a->t)/dy; }
+  else if (dy<0.0) { enty=(w->b-a->t)/dy; exty=(w->t-a->b)/dy; }
+  else if ((a->b<=w->t)||(a->t>=w->b)) return 2.0;
+  else { enty=-2.0; exty=2.0; }
+  double ent=(entx>enty)?entx:enty;
+  double ext=(extx<exty)?extx:exty;
+  if (ent>=ext) return 2.0;
+  if ((ent<0.0)||(ent>=1.0)) return 2.0;
+  *axis=(entx>enty)?0:1;
+  return ent;
+}
+
+/* Continuous collision for sprites with (ccd): Sweep from (pvx,pvy) to (x,y) and stop at the first wall.
+ * If we hit one, clamp to contact on that axis, then sweep the remaining motion on the other axis.
+ * So at most two wall queries, and the overlap resolver afterward should find us exactly touching.
+ */
+ 
+static void physics_sweep(struct sprite *sprite) {
+  double x=sprite->pvx,y=sprite->pvy;
+  double dx=sprite->x-x,dy=sprite->y-y;
+  int pass=0;
+  for (;pass<2;pass++) {
+    if ((dx==0.0)&&(dy==0.0)) break;
+    struct aabb a={
+      x-sprite->hbl+PHYSICS_SWEEP_MARGIN,
+      x+sprite->hbr-PHYSICS_SWEEP_MARGIN,
+      y-sprite->hbu+PHYSICS_SWEEP_MARGIN,
+      y+sprite->hbd-PHYSICS_SWEEP_MARGIN,
+    };
+    struct aabb span=a;
+    if (dx<0.0) span.l+=dx; else span.r+=dx;
+    if (dy<0.0) span.t+=dy; else span.b+=dy;
+    physics_wall_query(&span);
+    double toi=1.0;
+    int axis=-1,physics=0,wi=-1;
+    const struct aabb *hit=0;
+    while ((wi=physics_wall_next(wi))>=0) {
+      const struct wall *wall=physics_walls->wallv+wi;
+      if (!(sprite->mapsolids&wall->physics)) continue;
+      int waxis;
+      double t=physics_sweep_wall(&waxis,&a,dx,dy,&wall->aabb);
+      if (t<toi) {
+        toi=t;
+        axis=waxis;
+        physics=wall->physics;
+        hit=&wall->aabb;
+      } else if ((t==toi)&&(waxis==axis)) {
+        physics|=wall->physics;
+      }
+    }
+    if (!hit) {
+      x+=dx;
+      y+=dy;
+      break;
+    }
+    uint8_t dir;
+    if (axis==0) {
+      if (dx>0.0) { x=hit->l-sprite->hbr; dir=DIR_E; }
+      else { x=hit->r+sprite->hbl; dir=DIR_W; }
+      y+=dy*toi;
+      dx=0.0;
+      dy*=1.0-toi;
+    } else {
+      if (dy>0.0) { y=hit->t-sprite->hbd; dir=DIR_S; }
+      else { y=hit->b+sprite->hbu; dir=DIR_N; }
+      x+=dx*toi;
+      dy=0.0;
+      dx*=1.0-toi;
+    }
+    sprite->phconstrain|=dir;
+    physics_add_collision(sprite,0,dir,physics);
+  }
+  sprite->x=x;
+  sprite->y=y;
+}
+
 /* Resolve any collisions against static bodies and reset all (phconstrain).
  */
  
 static void physics_resolve_static(struct sprgrp *sprgrp) {
   physics_collisionc=0;
+  physics_awakec=physics_asleepc=0;
   struct sprite **p=sprgrp->sprv;
   int i=sprgrp->sprc;
   for (;i-->0;p++) {
     struct sprite *sprite=*p;
     
+    // Sleepers that haven't moved would come out exactly as they went in, (phconstrain) included.
+    if (sprite->phasleep) {
+      if (!physics_wakeall&&(sprite->x==sprite->pvx)&&(sprite->y==sprite->pvy)) {
+        physics_refresh_aabb(sprite);
+        physics_asleepc++;
+        continue;
+      }
+      sprite->phasleep=0;
+    }
+    physics_awakec++;
+    
     // Reset sprite's physics fields.
     sprite->phconstrain=0;
+    if (sprite->ccd&&sprite->mapsolids) physics_sweep(sprite);
+    int passc=0;
    _start_over_:;
     physics_refresh_aabb(sprite);
     if (!sprite->mapsolids) continue;
@@ -114,10 +425,10 @@ static void physics_resolve_static(struct sprgrp *sprgrp) {
     // Sprites should generally be smaller than cells, so there shouldn't be more than 4 walls.
     // But allow more just in case.
     struct aabb wallv[16];
-    int wallc=0,physics=0;
-    const struct wall *wall=physics_wallv;
-    int wi=physics_wallc;
-    for (;wi-->0;wall++) {
+    int wallc=0,physics=0,wi=-1;
+    physics_wall_query(&sprite->aabb);
+    while ((wi=physics_wall_next(wi))>=0) {
+      const struct wall *wall=physics_walls->wallv+wi;
       // "Greater or less": Not touching at all, skip this wall.
       if (wall->aabb.l>sprite->aabb.r) continue;
       if (wall->aabb.r<sprite->aabb.l) continue;
@@ -214,96 +525,380 @@ static void physics_resolve_static(struct sprgrp *sprgrp) {
           physics_add_collision(sprite,0,DIR_N,physics);
         }
         physics_refresh_aabb(sprite);
+        // Each pass should eject us from one wall, but it's possible to bounce between two forever.
+        // If that happens, give up and put it back where it was last frame.
+        if (++passc>=PHYSICS_PASS_LIMIT) {
+          sprite->x=sprite->pvx;
+          sprite->y=sprite->pvy;
+          physics_refresh_aabb(sprite);
+          continue;
+        }
         goto _start_over_;
       }
     }
   }
 }
 
+/* Broadphase grid for sprite-on-sprite collisions.
+ * Rebuilt each update, covering the group's extent, with cells about the size of the average hitbox.
+ * Anything that wanders outside the extent mid-resolve clamps into the edge cells.
+ * Buckets are linked lists of indices into the SOLID group.
+ * Sprites get added to buckets as they move, but never removed, so a bucket may also list sprites that have since left it.
+ * That's fine, narrowphase sorts it out. What matters is every sprite is listed in every cell it currently touches.
+ */
+ 
+#define PHYSICS_CELL_MIN 0.125 /* Broadphase cell size in tiles, lower limit. */
+#define PHYSICS_CELLS_PER_SPRITE 4 /* Cap on broadphase cell count, relative to sprite count. Coarsen cells to stay under it. */
+#define PHYSICS_GRID_REACH 1000.0 /* Broadphase grid extends no further than this from the origin, in tiles. */
+ 
+static int *physics_gridv=0; // Index in physics_bucketv, or -1.
+static int *physics_cellstampv=0; // Index of the last (a) that read this cell.
+static int physics_grida=0;
+static int physics_gridw=0,physics_gridh=0;
+static double physics_gridx=0.0,physics_gridy=0.0; // Top-left corner in tiles.
+static double physics_gridscale=1.0; // Cells per tile.
+
+static struct bucket {
+  int spri;
+  int next; // Index in physics_bucketv, or -1.
+} *physics_bucketv=0;
+static int physics_bucketc=0,physics_bucketa=0;
+
+static struct broadphase {
+  int x0,y0,x1,y1; // Grid cells we were last registered in, inclusive.
+} *physics_bpv=0;
+static int physics_bpa=0;
+
+/* Candidate (b) for the current (a), one bit per index in the SOLID group.
+ * A bitmap lets us visit them in descending order without sorting, and adding one mid-scan is trivial.
+ */
+static uint32_t *physics_candv=0;
+static int physics_canda=0; // In words.
+static int physics_candlo=0; // Lowest candidate index set since the last reset.
+
+/* Which grid cells does this sprite's hitbox touch?
+ * Inclusive, and may report a cell that is merely adjacent. Broadphase only needs a superset.
+ */
+ 
+static int physics_bp_coord(double v,double origin,int limit) {
+  v=(v-origin)*physics_gridscale;
+  if (!(v>=0.0)) return 0;
+  if (v>=limit) return limit-1;
+  return (int)v;
+}
+ 
+static void physics_grid_range(int *x0,int *y0,int *x1,int *y1,const struct sprite *sprite) {
+  *x0=physics_bp_coord(sprite->aabb.l,physics_gridx,physics_gridw);
+  *y0=physics_bp_coord(sprite->aabb.t,physics_gridy,physics_gridh);
+  *x1=physics_bp_coord(sprite->aabb.r,physics_gridx,physics_gridw);
+  *y1=physics_bp_coord(sprite->aabb.b,physics_gridy,physics_gridh);
+}
+
+/* Choose the grid's extent and cell size for this group, and allocate it.
+ * Cells scale with the sprites, so crowds of small sprites don't pile up in a few big cells,
+ * and the extent follows the sprites, so the ones offscreen don't all land in one border cell.
+ */
+ 
+static int physics_grid_size(struct sprgrp *sprgrp) {
+  double l=0.0,t=0.0,r=0.0,b=0.0,extent=0.0;
+  int i=0; for (;i<sprgrp->sprc;i++) {
+    const struct aabb *aabb=&sprgrp->sprv[i]->aabb;
+    if (!i||(aabb->l<l)) l=aabb->l;
+    if (!i||(aabb->t<t)) t=aabb->t;
+    if (!i||(aabb->r>r)) r=aabb->r;
+    if (!i||(aabb->b>b)) b=aabb->b;
+    extent+=(aabb->r-aabb->l)+(aabb->b-aabb->t);
+  }
+  // Sprites way out in the weeds shouldn't blow up the grid. Anything past this clamps into the edge cells.
+  if (!(l>=-PHYSICS_GRID_REACH)) l=-PHYSICS_GRID_REACH;
+  if (!(r<=PHYSICS_GRID_REACH)) r=PHYSICS_GRID_REACH;
+  if (!(t>=-PHYSICS_GRID_REACH)) t=-PHYSICS_GRID_REACH;
+  if (!(b<=PHYSICS_GRID_REACH)) b=PHYSICS_GRID_REACH;
+  if (!(r>l)) r=l+1.0;
+  if (!(b>t)) b=t+1.0;
+  double cellsize=extent/(sprgrp->sprc*2); // Average of width and height.
+  if (!(cellsize>=PHYSICS_CELL_MIN)) cellsize=PHYSICS_CELL_MIN;
+  int limit=sprgrp->sprc*PHYSICS_CELLS_PER_SPRITE;
+  double w,h;
+  for (;;) {
+    w=(r-l)/cellsize+1.0;
+    h=(b-t)/cellsize+1.0;
+    if (w*h<=limit) break;
+    cellsize*=1.5;
+  }
+  physics_gridx=l;
+  physics_gridy=t;
+  physics_gridscale=1.0/cellsize;
+  physics_gridw=(int)w;
+  physics_gridh=(int)h;
+  int cellc=physics_gridw*physics_gridh;
+  if (cellc>physics_grida) {
+    int na=(cellc+256)&~255;
+    if (na>INT_MAX/sizeof(int)) return -1;
+    void *nv=realloc(physics_gridv,sizeof(int)*na);
+    if (!nv) return -1;
+    physics_gridv=nv;
+    if (!(nv=realloc(physics_cellstampv,sizeof(int)*na))) return -1;
+    physics_cellstampv=nv;
+    physics_grida=na;
+  }
+  memset(physics_gridv,0xff,sizeof(int)*cellc);
+  memset(physics_cellstampv,0xff,sizeof(int)*cellc);
+  return 0;
+}
+
+/* Add a sprite to every cell in its current range that it wasn't in last time.
+ * Duplicates are possible if it returns to a cell it already visited, and that's harmless.
+ */
+ 
+static int physics_grid_register(int spri,struct sprite *sprite) {
+  struct broadphase *bp=physics_bpv+spri;
+  int x0,y0,x1,y1;
+  physics_grid_range(&x0,&y0,&x1,&y1,sprite);
+  if ((x0==bp->x0)&&(y0==bp->y0)&&(x1==bp->x1)&&(y1==bp->y1)) return 0;
+  int y=y0; for (;y<=y1;y++) {
+    int x=x0; for (;x<=x1;x++) {
+      if ((x>=bp->x0)&&(x<=bp->x1)&&(y>=bp->y0)&&(y<=bp->y1)) continue;
+      if (physics_bucketc>=physics_bucketa) {
+        int na=physics_bucketa+1024;
+        if (na>INT_MAX/sizeof(struct bucket)) return -1;
+        void *nv=realloc(physics_bucketv,sizeof(struct bucket)*na);
+        if (!nv) return -1;
+        physics_bucketv=nv;
+        physics_bucketa=na;
+      }
+      int *head=physics_gridv+y*physics_gridw+x;
+      struct bucket *bucket=physics_bucketv+physics_bucketc;
+      bucket->spri=spri;
+      bucket->next=*head;
+      *head=physics_bucketc++;
+    }
+  }
+  bp->x0=x0;
+  bp->y0=y0;
+  bp->x1=x1;
+  bp->y1=y1;
+  return 0;
+}
+
+/* Reset the grid and register every sprite in the group.
+ */
+ 
+static int physics_grid_build(struct sprgrp *sprgrp) {
+  if (sprgrp->sprc>physics_bpa) {
+    int na=(sprgrp->sprc+256)&~255;
+    if (na>INT_MAX/sizeof(struct broadphase)) return -1;
+    void *nv=realloc(physics_bpv,sizeof(struct broadphase)*na);
+    if (!nv) return -1;
+    physics_bpv=nv;
+    physics_bpa=na;
+  }
+  int wordc=(sprgrp->sprc+31)>>5;
+  if (wordc>physics_canda) {
+    int na=(wordc+8)&~7;
+    void *nv=realloc(physics_candv,sizeof(uint32_t)*na);
+    if (!nv) return -1;
+    physics_candv=nv;
+    physics_canda=na;
+  }
+  memset(physics_candv,0,sizeof(uint32_t)*wordc);
+  if (physics_grid_size(sprgrp)<0) return -1;
+  physics_bucketc=0;
+  int i=0; for (;i<sprgrp->sprc;i++) {
+    struct broadphase *bp=physics_bpv+i;
+    bp->x0=bp->y0=0;
+    bp->x1=bp->y1=-1;
+    if (physics_grid_register(i,sprgrp->sprv[i])<0) return -1;
+  }
+  return 0;
+}
+
+/* Mark as candidates every sprite in the given cells with index below (limit).
+ * Cells that (ai) already read are skipped: Nothing new can land in them except sprites we already have.
+ */
+ 
+static void physics_gather_candidates(int ai,int limit,int x0,int y0,int x1,int y1) {
+  int y=y0; for (;y<=y1;y++) {
+    int x=x0; for (;x<=x1;x++) {
+      int cellp=y*physics_gridw+x;
+      if (physics_cellstampv[cellp]==ai) continue;
+      physics_cellstampv[cellp]=ai;
+      int bucketp=physics_gridv[cellp];
+      while (bucketp>=0) {
+        const struct bucket *bucket=physics_bucketv+bucketp;
+        bucketp=bucket->next;
+        int bi=bucket->spri;
+        if (bi>=limit) continue;
+        physics_candv[bi>>5]|=1u<<(bi&31);
+        if (bi<physics_candlo) physics_candlo=bi;
+      }
+    }
+  }
+}
+
+/* Highest candidate index below (limit), and clear it. <0 if none remain.
+ */
+ 
+static int physics_next_candidate(int limit) {
+  if (limit<=physics_candlo) return -1;
+  int wordp=(limit-1)>>5;
+  uint32_t word=physics_candv[wordp];
+  if ((limit&31)) word&=(1u<<(limit&31))-1;
+  for (;;) {
+    if (word) {
+      int bi=(wordp<<5)+31-__builtin_clz(word);
+      physics_candv[wordp]&=~(1u<<(bi&31));
+      return bi;
+    }
+    physics_candv[wordp]=0;
+    if ((wordp<<5)<=physics_candlo) return -1;
+    word=physics_candv[--wordp];
+  }
+}
+
+/* Resolve one pair of sprites if they collide.
+ */
+ 
+static void physics_resolve_pair(struct sprite *a,struct sprite *b) {
+  
+  // If both sprites have infinite mass, we can't move either, so no sense even checking.
+  if (!a->invmass&&!b->invmass) return;
+  
+  // Two sleepers didn't collide last time, and neither has moved since.
+  if (a->phasleep&&b->phasleep) return;
+  
+  /* Detect collision and measure escapement (labelled by the direction (a) would move).
+   */
+  double escl=a->aabb.r-b->aabb.l; if (escl<=0.0) return;
+  double escr=b->aabb.r-a->aabb.l; if (escr<=0.0) return;
+  double esct=a->aabb.b-b->aabb.t; if (esct<=0.0) return;
+  double escb=b->aabb.b-a->aabb.t; if (escb<=0.0) return;
+  
+  /* If both sprites are constrained in opposite directions, poison the escapements for that axis.
+   * This is an unusual case, think two fat guys passing in a narrow corridor.
+   * One would expect it to pick the opposite axis anyway, just being extra careful.
+   */
+  if ((a->phconstrain&DIR_W)&&(b->phconstrain&DIR_E)) escl=escr=999.0;
+  if ((a->phconstrain&DIR_E)&&(b->phconstrain&DIR_W)) escl=escr=999.0;
+  if ((a->phconstrain&DIR_N)&&(b->phconstrain&DIR_S)) esct=escb=999.0;
+  if ((a->phconstrain&DIR_S)&&(b->phconstrain&DIR_N)) esct=escb=999.0;
+  
+  /* Select the shortest escapement, and initially allocate all of it to (a).
+   */
+  int abit,bbit;
+  double adx=0.0,ady=0.0;
+  if ((escl<=escr)&&(escl<=esct)&&(escl<=escb)) { adx=-escl; abit=DIR_W; bbit=DIR_E; }
+  else if ((escr<=esct)&&(escr<=escb)) { adx=escr; abit=DIR_E; bbit=DIR_W; }
+  else if (esct<=escb) { ady=-esct; abit=DIR_N; bbit=DIR_S; }
+  else { ady=escb; abit=DIR_S; bbit=DIR_N; }
+  
+  /* Record the collision for reporting later.
+   * Note that (abit,bbit) are the direction of travel, and we're recording (a)'s direction of impact -- use (bbit).
+   */
+  physics_add_collision(a,b,bbit,0);
+  
+  /* If either sprite is constrained, have the other do the full escape.
+   * Otherwise, allocate proportionately to inverse mass.
+   */
+  double bdx=0.0,bdy=0.0;
+  if (a->phconstrain&abit) {
+    if (b->phconstrain&bbit) return; // oh no! We selected a constrained axis despite the poisoning. Don't touch this mess.
+    bdx=-adx; adx=0.0;
+    bdy=-ady; ady=0.0;
+  } else if (b->phconstrain&bbit) {
+    // (b) constrained. We've already allocated the full escape to (a), great.
+  } else if (!a->invmass) {
+    bdx=-adx; adx=0.0;
+    bdy=-ady; ady=0.0;
+  } else if (!b->invmass) {
+    // Keep all in (a).
+  } else {
+    double total=a->invmass+b->invmass;
+    double aprop=a->invmass/total;
+    double bprop=-(b->invmass/total);
+    bdx=bprop*adx; adx*=aprop;
+    bdy=bprop*ady; ady*=aprop;
+  }
+  a->x+=adx;
+  a->y+=ady;
+  b->x+=bdx;
+  b->y+=bdy;
+  physics_refresh_aabb(a);
+  physics_refresh_aabb(b);
+}
+
 /* Detect and resolve sprite-on-sprite collisions.
  * We only resolve individual collisions. It is possible for the overall set to remain in a conflicted state.
  * But we do take pains to avoid static collisions, that's what (sprite->phconstrain) is for.
+ *
+ * Pairs are visited in exactly the order of a brute-force scan: (a) descending, then (b) descending below it.
+ * The grid only lets us skip pairs that can't possibly touch.
+ * When (a) moves mid-scan, we pick up candidates from whatever new cells it reaches.
+ * When (b) moves, it registers in its new cells, for the benefit of subsequent (a).
+ */
+ 
+/* Brute force, picking up the scan after pair (ai,bi).
+ * For when the grid fails, should only happen if we're out of memory.
+ * Pairs the grid would have skipped don't touch, so they're noops, and the outcome is the same either way.
  */
  
+static void physics_resolve_brute(struct sprgrp *sprgrp,int ai,int bi) {
+  for (;ai>0;ai--,bi=ai) {
+    struct sprite *a=sprgrp->sprv[ai];
+    while (bi-->0) physics_resolve_pair(a,sprgrp->sprv[bi]);
+  }
+}
+ 
 static void physics_resolve_sprites(struct sprgrp *sprgrp) {
+  if (sprgrp->sprc<2) return;
+  
+  if (physics_grid_build(sprgrp)<0) {
+    physics_resolve_brute(sprgrp,sprgrp->sprc-1,sprgrp->sprc-1);
+    return;
+  }
+  
+  // A sleeper only needs checking against awake sprites below it.
+  int lowawake=0;
+  while ((lowawake<sprgrp->sprc)&&sprgrp->sprv[lowawake]->phasleep) lowawake++;
+  
   int ai=sprgrp->sprc; while (ai-->1) {
     struct sprite *a=sprgrp->sprv[ai];
-    int bi=ai; while (bi-->0) {
+    if (a->phasleep&&(lowawake>=ai)) continue;
+    int x0,y0,x1,y1;
+    physics_grid_range(&x0,&y0,&x1,&y1,a);
+    physics_candlo=ai;
+    physics_gather_candidates(ai,ai,x0,y0,x1,y1);
+    int bi=ai;
+    while ((bi=physics_next_candidate(bi))>=0) {
       struct sprite *b=sprgrp->sprv[bi];
-      
-      // If both sprites have infinite mass, we can't move either, so no sense even checking.
-      if (!a->invmass&&!b->invmass) continue;
-      
-      /* Detect collision and measure escapement (labelled by the direction (a) would move).
-       */
-      double escl=a->aabb.r-b->aabb.l; if (escl<=0.0) continue;
-      double escr=b->aabb.r-a->aabb.l; if (escr<=0.0) continue;
-      double esct=a->aabb.b-b->aabb.t; if (esct<=0.0) continue;
-      double escb=b->aabb.b-a->aabb.t; if (escb<=0.0) continue;
-      
-      /* If both sprites are constrained in opposite directions, poison the escapements for that axis.
-       * This is an unusual case, think two fat guys passing in a narrow corridor.
-       * One would expect it to pick the opposite axis anyway, just being extra careful.
-       */
-      if ((a->phconstrain&DIR_W)&&(b->phconstrain&DIR_E)) escl=escr=999.0;
-      if ((a->phconstrain&DIR_E)&&(b->phconstrain&DIR_W)) escl=escr=999.0;
-      if ((a->phconstrain&DIR_N)&&(b->phconstrain&DIR_S)) esct=escb=999.0;
-      if ((a->phconstrain&DIR_S)&&(b->phconstrain&DIR_N)) esct=escb=999.0;
-      
-      /* Select the shortest escapement, and initially allocate all of it to (a).
-       */
-      int abit,bbit;
-      double adx=0.0,ady=0.0;
-      if ((escl<=escr)&&(escl<=esct)&&(escl<=escb)) { adx=-escl; abit=DIR_W; bbit=DIR_E; }
-      else if ((escr<=esct)&&(escr<=escb)) { adx=escr; abit=DIR_E; bbit=DIR_W; }
-      else if (esct<=escb) { ady=-esct; abit=DIR_N; bbit=DIR_S; }
-      else { ady=escb; abit=DIR_S; bbit=DIR_N; }
-      
-      /* Record the collision for reporting later.
-       * Note that (abit,bbit) are the direction of travel, and we're recording (a)'s direction of impact -- use (bbit).
-       */
-      physics_add_collision(a,b,bbit,0);
-      
-      /* If either sprite is constrained, have the other do the full escape.
-       * Otherwise, allocate proportionately to inverse mass.
-       */
-      double bdx=0.0,bdy=0.0;
-      if (a->phconstrain&abit) {
-        if (b->phconstrain&bbit) continue; // oh no! We selected a constrained axis despite the poisoning. Don't touch this mess.
-        bdx=-adx; adx=0.0;
-        bdy=-ady; ady=0.0;
-      } else if (b->phconstrain&bbit) {
-        // (b) constrained. We've already allocated the full escape to (a), great.
-      } else if (!a->invmass) {
-        bdx=-adx; adx=0.0;
-        bdy=-ady; ady=0.0;
-      } else if (!b->invmass) {
-        // Keep all in (a).
-      } else {
-        double total=a->invmass+b->invmass;
-        double aprop=a->invmass/total;
-        double bprop=-(b->invmass/total);
-        bdx=bprop*adx; adx*=aprop;
-        bdy=bprop*ady; ady*=aprop;
+      double ax=a->x,ay=a->y,bx=b->x,by=b->y;
+      physics_resolve_pair(a,b);
+      if ((bi<lowawake)&&!b->phasleep) lowawake=bi;
+      if ((bx!=b->x)||(by!=b->y)) {
+        if (physics_grid_register(bi,b)<0) {
+          physics_resolve_brute(sprgrp,ai,bi);
+          return;
+        }
+      }
+      if ((ax!=a->x)||(ay!=a->y)) {
+        physics_grid_range(&x0,&y0,&x1,&y1,a);
+        physics_gather_candidates(ai,bi,x0,y0,x1,y1);
       }
-      a->x+=adx;
-      a->y+=ady;
-      b->x+=bdx;
-      b->y+=bdy;
-      physics_refresh_aabb(a);
-      physics_refresh_aabb(b);
     }
   }
 }
 
-/* Wrap up: Set previous position to current, trigger collision callbacks.
+/* Wrap up: Put sprites to sleep, set previous position to current, trigger collision callbacks.
  */
  
 static void physics_finalize(struct sprgrp *sprgrp) {
+  physics_wakeall=0;
   struct sprite **p=sprgrp->sprv;
   int i=sprgrp->sprc;
   for (;i-->0;p++) {
     struct sprite *sprite=*p;
+    sprite->phasleep=((sprite->x==sprite->pvx)&&(sprite->y==sprite->pvy)&&!sprite->phcollided)?1:0;
+    sprite->phcollided=0;
     sprite->pvx=sprite->x;
     sprite->pvy=sprite->y;
   }
@@ -324,26 +919,28 @@ static void physics_finalize(struct sprgrp *sprgrp) {
 void physics_update(struct sprgrp *sprgrp,double elapsed) {
   physics_resolve_static(sprgrp);
   physics_resolve_sprites(sprgrp);
+  sprgrp_index_invalidate(0);
   physics_finalize(sprgrp);
 }
 
+/* Sleep stats.
+ */
+ 
+void physics_get_sleep_counts(int *awakec,int *asleepc) {
+  if (awakec) *awakec=physics_awakec;
+  if (asleepc) *asleepc=physics_asleepc;
+}
+
 /* One-off sprite collision test.
  */
  
 int sprite_collides_with_group(struct sprite *sprite,struct sprgrp *sprgrp) {
   if (!sprite||!sprgrp) return 0;
   physics_refresh_aabb(sprite);
-  int i=sprgrp->sprc;
-  while (i-->0) {
-    struct sprite *other=sprgrp->sprv[i];
-    if (other==sprite) continue;
-    physics_refresh_aabb(other);
-    if (sprite->aabb.r<=other->aabb.l) continue;
-    if (sprite->aabb.l>=other->aabb.r) continue;
-    if (sprite->aabb.b<=other->aabb.t) continue;
-    if (sprite->aabb.t>=other->aabb.b) continue;
-    return 1;
-  }
+  struct sprite *otherv[2];
+  int otherc=sprgrp_query_aabb(otherv,2,sprgrp,sprite->aabb.l,sprite->aabb.t,sprite->aabb.r,sprite->aabb.b);
+  if (otherc>=2) return 1;
+  if ((otherc==1)&&(otherv[0]!=sprite)) return 1;
   return 0;
 }
 
@@ -354,10 +951,27 @@ int sprite_collides_with_map(struct sprite *sprite,int physics) {
   if (!sprite) return 0;
   physics=1<<physics;
   physics_refresh_aabb(sprite);
-  const struct wall *wall=physics_wallv;
-  int i=physics_wallc;
-  for (;i-->0;wall++) {
+  double dx=0.0,dy=0.0;
+  struct aabb span=sprite->aabb,from;
+  if (sprite->ccd) {
+    dx=sprite->x-sprite->pvx;
+    dy=sprite->y-sprite->pvy;
+    from.l=sprite->aabb.l-dx+PHYSICS_SWEEP_MARGIN;
+    from.r=sprite->aabb.r-dx-PHYSICS_SWEEP_MARGIN;
+    from.t=sprite->aabb.t-dy+PHYSICS_SWEEP_MARGIN;
+    from.b=sprite->aabb.b-dy-PHYSICS_SWEEP_MARGIN;
+    if (dx<0.0) span.r-=dx; else span.l-=dx;
+    if (dy<0.0) span.b-=dy; else span.t-=dy;
+  }
+  physics_wall_query(&span);
+  int wi=-1;
+  while ((wi=physics_wall_next(wi))>=0) {
+    const struct wall *wall=physics_walls->wallv+wi;
     if (!(wall->physics&physics)) continue;
+    if ((dx!=0.0)||(dy!=0.0)) {
+      int axis;
+      if (physics_sweep_wall(&axis,&from,dx,dy,&wall->aabb)<1.0) return 1;
+    }
     if (sprite->aabb.r<=wall->aabb.l) continue;
     if (sprite->aabb.l>=wall->aabb.r) continue;
     if (sprite->aabb.b<=wall->aabb.t) continue;
@@ -1,39 +1,108 @@
 #include "../arrautza.h"
 #include "sprite.h"
+#include "sprpool.h"
 #include "map.h" /* We borrow map_command_measure(); map and sprite commands are structured the same way. */
 
+/* Handle table.
+ * Slots are reused, and each reuse bumps the slot's generation, so old handles stop matching.
+ */
+ 
+#define SPRITE_HANDLE_INDEX_BITS 16
+#define SPRITE_HANDLE_INDEX_MASK 0xffff
+#define SPRITE_CULL_MARGIN TILESIZE /* Pixels beyond the screen edge where sprites still render. */
+ 
+static struct sprite_slot {
+  struct sprite *sprite; // Null if vacant.
+  uint16_t generation; // Never zero.
+  int nextfree; // If vacant, index of the next vacant slot, or -1.
+} *sprite_slotv=0;
+static int sprite_slotc=0,sprite_slota=0;
+static int sprite_slotfree=-1;
+
+uint32_t sprite_handle(struct sprite *sprite) {
+  if (!sprite) return 0;
+  if (sprite->handle) return sprite->handle;
+  int ix;
+  struct sprite_slot *slot;
+  if (sprite_slotfree>=0) {
+    ix=sprite_slotfree;
+    slot=sprite_slotv+ix;
+    sprite_slotfree=slot->nextfree;
+  } else {
+    if (sprite_slotc>SPRITE_HANDLE_INDEX_MASK) return 0;
+    if (sprite_slotc>=sprite_slota) {
+      int na=sprite_slota+64;
+      void *nv=realloc(sprite_slotv,sizeof(struct sprite_slot)*na);
+      if (!nv) return 0;
+      sprite_slotv=nv;
+      sprite_slota=na;
+    }
+    ix=sprite_slotc++;
+    slot=sprite_slotv+ix;
+    slot->generation=1;
+  }
+  slot->sprite=sprite;
+  slot->nextfree=-1;
+  sprite->handle=((uint32_t)slot->generation<<SPRITE_HANDLE_INDEX_BITS)|(uint32_t)ix;
+  return sprite->handle;
+}
+
+struct sprite *sprite_from_handle(uint32_t handle) {
+  int ix=handle&SPRITE_HANDLE_INDEX_MASK;
+  if (ix>=sprite_slotc) return 0;
+  const struct sprite_slot *slot=sprite_slotv+ix;
+  if (slot->generation!=(handle>>SPRITE_HANDLE_INDEX_BITS)) return 0;
+  return sprite_if_alive(slot->sprite);
+}
+
+static void sprite_handle_release(struct sprite *sprite) {
+  if (!sprite->handle) return;
+  int ix=sprite->handle&SPRITE_HANDLE_INDEX_MASK;
+  struct sprite_slot *slot=sprite_slotv+ix;
+  slot->sprite=0;
+  if (!++(slot->generation)) slot->generation=1;
+  slot->nextfree=sprite_slotfree;
+  sprite_slotfree=ix;
+  sprite->handle=0;
+}
+
 /* Sprite object lifecycle.
+ * Group membership doesn't count as a reference. (refc) is only the strong references held by others.
+ * We free the sprite when both are gone.
+ * Every new sprite takes the next (serial). Starts at 1. It would wrap after 4 billion spawns, far beyond any real session.
  */
+
+static uint32_t sprite_serial_next=1;
+ 
+static void sprite_free_if_orphan(struct sprite *sprite) {
+  if (sprite->refc>0) return;
+  if (sprite->grpc||sprite->grpmask) return;
+  if (sprite->sprctl&&sprite->sprctl->del) sprite->sprctl->del(sprite);
+  sprite_handle_release(sprite);
+  sprite_pool_put(sprite->grpv,sizeof(void*)*sprite->grpa);
+  sprite_pool_put(sprite,sprite->sprctl?sprite->sprctl->objlen:sizeof(struct sprite));
+}
  
 void sprite_del(struct sprite *sprite) {
   if (!sprite) return;
   if (sprite->refc-->1) return;
-  if (sprite->sprctl&&sprite->sprctl->del) sprite->sprctl->del(sprite);
-  if (sprite->grpv) {
-    if (sprite->grpc) egg_log("ERROR: Deleting sprite %p, grpc==%d. Shouldn't be possible!",sprite,sprite->grpc);
-    free(sprite->grpv);
-  }
-  free(sprite);
+  sprite_free_if_orphan(sprite);
 }
 
 int sprite_ref(struct sprite *sprite) {
   if (!sprite) return -1;
-  if (sprite->refc<1) return -1;
+  if ((sprite->refc<1)&&!sprite->grpc&&!sprite->grpmask) return -1;
   if (sprite->refc>=INT_MAX) return -1;
   sprite->refc++;
   return 0;
 }
     
 struct sprite *sprite_new(const struct sprctl *sprctl) {
-  struct sprite *sprite=0;
-  if (sprctl) {
-    sprite=calloc(1,sprctl->objlen);
-  } else {
-    sprite=calloc(1,sizeof(struct sprite));
-  }
+  struct sprite *sprite=sprite_pool_get(sprctl?sprctl->objlen:sizeof(struct sprite));
   if (!sprite) return 0;
   
   sprite->refc=1;
+  sprite->serial=sprite_serial_next++;
   sprite->sprctl=sprctl;
   sprite->col=-128;
   sprite->row=-128;
@@ -49,9 +118,9 @@ struct sprite *sprite_new(const struct sprctl *sprctl) {
     sprite_del(sprite);
     return 0;
   }
-  if (sprctl->grpmask) {
+  if (sprctl&&sprctl->grpmask) {
     int i=32; while (i-->0) {
-      if (!(sprctl->grpmask&(1<<i))) continue;
+      if (!(sprctl->grpmask&(1u<<i))) continue;
       if (sprgrp_add(sprgrpv+i,sprite)<0) {
         sprite_kill(sprite);
         sprite_del(sprite);
@@ -69,6 +138,23 @@ struct sprite *sprite_new(const struct sprctl *sprctl) {
   return sprite;
 }
 
+struct sprite *sprite_new_uninitialized(const struct sprctl *sprctl) {
+  struct sprite *sprite=sprite_pool_get(sprctl?sprctl->objlen:sizeof(struct sprite));
+  if (!sprite) return 0;
+  sprite->refc=1;
+  sprite->serial=sprite_serial_next++;
+  sprite->sprctl=sprctl;
+  return sprite;
+}
+
+uint32_t sprite_get_next_serial() {
+  return sprite_serial_next;
+}
+
+void sprite_set_next_serial(uint32_t serial) {
+  sprite_serial_next=serial;
+}
+
 /* Set hitbox.
  */
  
@@ -79,14 +165,17 @@ void sprite_set_hitbox(struct sprite *sprite,double w,double h,double offx,doubl
   sprite->hbr+=offx;
   sprite->hbu-=offy;
   sprite->hbd+=offy;
+  sprite->phasleep=0;
 }
 
 /* Update location tracking post-warp.
  */
  
 void sprite_warped(struct sprite *sprite) {
-  sprite->pvx=sprite->x;
-  sprite->pvy=sprite->y;
+  sprite->pvx=sprite->rpx=sprite->x;
+  sprite->pvy=sprite->rpy=sprite->y;
+  sprite->phasleep=0;
+  sprgrp_index_invalidate(0);
   if (sprite->x<0.0) sprite->col=-1; else if (sprite->x>=COLC) sprite->col=COLC; else sprite->col=(int8_t)sprite->x;
   if (sprite->y<0.0) sprite->row=-1; else if (sprite->y>=ROWC) sprite->row=ROWC; else sprite->row=(int8_t)sprite->y;
 }
@@ -101,6 +190,7 @@ static int sprdef_apply_cb(const uint8_t *cmd,int cmdc,void *userdata) {
     case SPRITECMD_xform: sprite->xform=cmd[1]; break;
     case SPRITECMD_invmass: sprite->invmass=cmd[1]; break;
     case SPRITECMD_layer: sprite->layer=cmd[1]; break;
+    case SPRITECMD_ccd: sprite->ccd=1; break;
   }
   return 0;
 }
@@ -109,7 +199,7 @@ static int sprdef_apply(struct sprite *sprite,const uint8_t *argv,int argc) {
   sprite->imageid=sprite->sprdef->imageid;
   if (sprite->sprdef->grpmask) {
     int i=31; while (i-->0) {
-      if (sprite->sprdef->grpmask&(1<<i)) {
+      if (sprite->sprdef->grpmask&(1u<<i)) {
         if (sprgrp_add(sprgrpv+i,sprite)<0) return -1;
       }
     }
@@ -129,8 +219,8 @@ struct sprite *sprite_spawn(
   if (!sprdef) return 0;
   struct sprite *sprite=sprite_new(sprdef->sprctl);
   if (!sprite) return 0;
-  sprite->x=sprite->pvx=x;
-  sprite->y=sprite->pvy=y;
+  sprite->x=sprite->pvx=sprite->rpx=x;
+  sprite->y=sprite->pvy=sprite->rpy=y;
   sprite->sprdef=sprdef;
   if (sprdef_apply(sprite,argv,argc)<0) {
     sprite_kill(sprite);
@@ -144,7 +234,7 @@ struct sprite *sprite_spawn(
       return 0;
     }
   }
-  if (sprite->grpc<1) {
+  if (!sprite->grpmask&&(sprite->grpc<1)) {
     sprite_del(sprite);
     return 0;
   }
@@ -163,8 +253,8 @@ struct sprite *sprite_spawn_resless(
 ) {
   struct sprite *sprite=sprite_new(sprctl);
   if (!sprite) return 0;
-  sprite->x=sprite->pvx=x;
-  sprite->y=sprite->pvy=y;
+  sprite->x=sprite->pvx=sprite->rpx=x;
+  sprite->y=sprite->pvy=sprite->rpy=y;
   sprite->imageid=imageid;
   sprite->tileid=tileid;
   if (sprctl->ready) {
@@ -174,7 +264,7 @@ struct sprite *sprite_spawn_resless(
       return 0;
     }
   }
-  if (sprite->grpc<1) {
+  if (!sprite->grpmask&&(sprite->grpc<1)) {
     sprite_del(sprite);
     return 0;
   }
@@ -319,6 +409,15 @@ struct sprgrp *sprgrp_new(int mode) {
   return sprgrp;
 }
 
+/* Global groups are tracked by a bit in (sprite->grpmask), not in (sprite->grpv).
+ * Returns 0..31 for a global group, or -1 if dynamic.
+ */
+ 
+static inline int sprgrp_global_index(const struct sprgrp *sprgrp) {
+  if ((sprgrp<sprgrpv)||(sprgrp>=sprgrpv+32)) return -1;
+  return sprgrp-sprgrpv;
+}
+
 /* Search group and sprite lists.
  */
  
@@ -342,8 +441,8 @@ static int sprgrp_sprv_search(const struct sprgrp *sprgrp,const struct sprite *s
         while (lo<hi) {
           int ck=(lo+hi)>>1;
           const struct sprite *q=sprgrp->sprv[ck];
-               if (sprite<q) hi=ck;
-          else if (sprite>q) lo=ck+1;
+               if (sprite->serial<q->serial) hi=ck;
+          else if (sprite->serial>q->serial) lo=ck+1;
           else return ck;
         }
         return -lo-1;
@@ -370,7 +469,7 @@ static int sprgrp_sprv_search(const struct sprgrp *sprgrp,const struct sprite *s
 }
 
 /* Group membership primitives, internal.
- * Use carefully! We only do the stated operation, and update reference counts.
+ * Use carefully! We only do the stated operation, and update group reference counts.
  * You must ensure that all sprite<~>sprgrp links are mutual.
  */
  
@@ -379,8 +478,10 @@ static int sprite_grpv_insert(struct sprite *sprite,int p,struct sprgrp *sprgrp)
   if (sprite->grpc>=sprite->grpa) {
     int na=sprite->grpa+8;
     if (na>INT_MAX/sizeof(void*)) return -1;
-    void *nv=realloc(sprite->grpv,sizeof(void*)*na);
+    void *nv=sprite_pool_get(sizeof(void*)*na);
     if (!nv) return -1;
+    if (sprite->grpc) memcpy(nv,sprite->grpv,sizeof(void*)*sprite->grpc);
+    sprite_pool_put(sprite->grpv,sizeof(void*)*sprite->grpa);
     sprite->grpv=nv;
     sprite->grpa=na;
   }
@@ -401,10 +502,10 @@ static int sprgrp_sprv_insert(struct sprgrp *sprgrp,int p,struct sprite *sprite)
     sprgrp->sprv=nv;
     sprgrp->spra=na;
   }
-  if (sprite_ref(sprite)<0) return -1;
   memmove(sprgrp->sprv+p+1,sprgrp->sprv+p,sizeof(void*)*(sprgrp->sprc-p));
   sprgrp->sprv[p]=sprite;
   sprgrp->sprc++;
+  sprgrp_index_invalidate(sprgrp);
   return 0;
 }
 
@@ -421,7 +522,8 @@ static void sprgrp_sprv_remove(struct sprgrp *sprgrp,int p) {
   struct sprite *sprite=sprgrp->sprv[p];
   sprgrp->sprc--;
   memmove(sprgrp->sprv+p,sprgrp->sprv+p+1,sizeof(void*)*(sprgrp->sprc-p));
-  sprite_del(sprite);
+  sprgrp_index_invalidate(sprgrp);
+  sprite_free_if_orphan(sprite);
 }
 
 /* Group membership primitives, public interface.
@@ -429,24 +531,33 @@ static void sprgrp_sprv_remove(struct sprgrp *sprgrp,int p) {
 
 int sprgrp_has(const struct sprgrp *sprgrp,const struct sprite *sprite) {
   if (!sprgrp||!sprite) return 0;
+  int gix=sprgrp_global_index(sprgrp);
+  if (gix>=0) return (sprite->grpmask&(1u<<gix))?1:0;
   // A sprite's group list is always sorted by address, and usually smaller than groups' sprite lists.
   return ((sprite_grpv_search(sprite,sprgrp)>=0)?1:0);
 }
 
 int sprgrp_add(struct sprgrp *sprgrp,struct sprite *sprite) {
   if (!sprgrp||!sprite) return -1;
-  int grpp=sprite_grpv_search(sprite,sprgrp);
-  if (grpp>=0) return 0; // Assume it's listed in the group too, if it's listed in the sprite.
-  grpp=-grpp-1;
-  if (sprite_grpv_insert(sprite,grpp,sprgrp)<0) return -1;
+  int gix=sprgrp_global_index(sprgrp),grpp=-1;
+  if (gix>=0) {
+    if (sprite->grpmask&(1u<<gix)) return 0; // Assume it's listed in the group too.
+    // Global groups are immortal, no need to retain them.
+  } else {
+    grpp=sprite_grpv_search(sprite,sprgrp);
+    if (grpp>=0) return 0; // Assume it's listed in the group too, if it's listed in the sprite.
+    grpp=-grpp-1;
+    if (sprite_grpv_insert(sprite,grpp,sprgrp)<0) return -1;
+  }
   int sprp=sprgrp_sprv_search(sprgrp,sprite);
   if (sprp<0) {
     sprp=-sprp-1;
     if (sprgrp_sprv_insert(sprgrp,sprp,sprite)<0) {
-      sprite_grpv_remove(sprite,grpp); // Remove the group we just inserted in sprite.
+      if (gix<0) sprite_grpv_remove(sprite,grpp); // Remove the group we just inserted in sprite.
       return -1;
     }
   }
+  if (gix>=0) sprite->grpmask|=1u<<gix;
   // For RENDER mode, force a full sort after adding anything.
   switch (sprgrp->mode) {
     case SPRGRP_MODE_RENDER: sprgrp->sortdir=0; break;
@@ -456,9 +567,15 @@ int sprgrp_add(struct sprgrp *sprgrp,struct sprite *sprite) {
 
 int sprgrp_remove(struct sprgrp *sprgrp,struct sprite *sprite) {
   if (!sprgrp||!sprite) return 0;
-  int grpp=sprite_grpv_search(sprite,sprgrp);
-  if (grpp<0) return 0; // Assume sprite is not listed in group too.
-  sprite_grpv_remove(sprite,grpp);
+  int gix=sprgrp_global_index(sprgrp);
+  if (gix>=0) {
+    if (!(sprite->grpmask&(1u<<gix))) return 0; // Assume sprite is not listed in group too.
+    sprite->grpmask&=~(1u<<gix);
+  } else {
+    int grpp=sprite_grpv_search(sprite,sprgrp);
+    if (grpp<0) return 0; // Assume sprite is not listed in group too.
+    sprite_grpv_remove(sprite,grpp);
+  }
   int sprp=sprgrp_sprv_search(sprgrp,sprite);
   if (sprp>=0) sprgrp_sprv_remove(sprgrp,sprp);
   return 1;
@@ -470,18 +587,24 @@ int sprgrp_remove(struct sprgrp *sprgrp,struct sprite *sprite) {
 void sprgrp_clear(struct sprgrp *sprgrp) {
   if (!sprgrp->sprc) return;
   if (sprgrp_ref(sprgrp)<0) return;
+  sprgrp_index_invalidate(sprgrp);
+  int gix=sprgrp_global_index(sprgrp);
   while (sprgrp->sprc>0) {
     sprgrp->sprc--;
     struct sprite *sprite=sprgrp->sprv[sprgrp->sprc];
-    int grpp=sprite_grpv_search(sprite,sprgrp);
-    if (grpp>=0) sprite_grpv_remove(sprite,grpp);
-    sprite_del(sprite);
+    if (gix>=0) {
+      sprite->grpmask&=~(1u<<gix);
+    } else {
+      int grpp=sprite_grpv_search(sprite,sprgrp);
+      if (grpp>=0) sprite_grpv_remove(sprite,grpp);
+    }
+    sprite_free_if_orphan(sprite);
   }
   sprgrp_del(sprgrp);
 }
 
 void sprite_kill(struct sprite *sprite) {
-  if (!sprite->grpc) return;
+  if (!sprite->grpc&&!sprite->grpmask) return;
   if (sprite_ref(sprite)<0) return;
   while (sprite->grpc>0) {
     sprite->grpc--;
@@ -490,17 +613,24 @@ void sprite_kill(struct sprite *sprite) {
     if (sprp>=0) sprgrp_sprv_remove(sprgrp,sprp);
     sprgrp_del(sprgrp);
   }
+  while (sprite->grpmask) {
+    int gix=31-__builtin_clz(sprite->grpmask);
+    sprite->grpmask&=~(1u<<gix);
+    struct sprgrp *sprgrp=sprgrpv+gix;
+    int sprp=sprgrp_sprv_search(sprgrp,sprite);
+    if (sprp>=0) sprgrp_sprv_remove(sprgrp,sprp);
+  }
   sprite_del(sprite);
 }
 
 void sprgrp_kill(struct sprgrp *sprgrp) {
   if (!sprgrp->sprc) return;
   if (sprgrp_ref(sprgrp)<0) return;
+  sprgrp_index_invalidate(sprgrp);
   while (sprgrp->sprc>0) {
     sprgrp->sprc--;
     struct sprite *sprite=sprgrp->sprv[sprgrp->sprc];
     sprite_kill(sprite);
-    sprite_del(sprite); // Our reference, that we "sprc--"'d away already.
   }
   sprgrp_del(sprgrp);
 }
@@ -519,6 +649,7 @@ void sprgrpv_init() {
  */
 
 void sprgrp_update(struct sprgrp *sprgrp,double elapsed,int bg) {
+  sprgrp_index_invalidate(0); // Everybody's about to move.
   int i=sprgrp->sprc;
   while (i-->0) {
     struct sprite *sprite=sprgrp->sprv[i];
@@ -533,147 +664,192 @@ void sprgrp_update(struct sprgrp *sprgrp,double elapsed,int bg) {
   }
 }
 
-/* Sort group in preparation of rendering.
+/* Record positions at the start of an update step, for render interpolation.
  */
  
-static int sprite_rendercmp(const struct sprite *a,const struct sprite *b) {
-  if (a->layer<b->layer) return -1;
-  if (a->layer>b->layer) return 1;
-  if (a->y<b->y) return -1;
-  if (a->y>b->y) return 1;
-  return 0;
+void sprgrp_save_positions(struct sprgrp *sprgrp) {
+  int i=sprgrp->sprc;
+  while (i-->0) {
+    struct sprite *sprite=sprgrp->sprv[i];
+    sprite->rpx=sprite->x;
+    sprite->rpy=sprite->y;
+  }
 }
+
+/* Sort group in preparation of rendering.
+ * Each sprite gets a packed integer key: Layer in the high bits, and the bottom edge of its render bounds in the low.
+ * From one frame to the next, order barely changes, so first try an insertion sort with a budget of moves.
+ * If that runs out, or the membership changed (sortdir==0), LSD radix sort instead.
+ * Either way it's O(n), and stable, so ties keep last frame's order.
+ */
  
-static void sprgrp_render_qsort(struct sprite **v,int c) {
-  if (c<2) return;
-  int eqp=c>>1,eqc=1,i;
-  struct sprite *ref=v[eqp];
-  for (i=eqp;i-->0;) {
-    struct sprite *q=v[i];
-    int cmp=sprite_rendercmp(q,ref);
-    if (cmp>0) {
-      memmove(v+i,v+i+1,sizeof(void*)*(eqp+eqc-i-1));
-      eqp--;
-      v[eqp+eqc]=q;
-    } else if (!cmp) {
-      if (i<eqp-1) {
-        memmove(v+i,v+i+1,sizeof(void*)*(eqp-i-1));
-        eqp--;
-        eqc++;
-        v[eqp]=q;
-      } else {
-        eqp--;
-        eqc++;
-      }
+struct sprite_sortent {
+  uint32_t key;
+  struct sprite *sprite;
+};
+
+static struct sprite_sortent *sortentv=0,*sortenttmp=0;
+static int sortenta=0;
+
+static uint32_t sprite_render_key(const struct sprite *sprite) {
+  int layer=sprite->layer;
+  if (layer<0) layer=0; else if (layer>0xff) layer=0xff;
+  int bottom=sprite->by+sprite->bh+0x8000;
+  if (bottom<0) bottom=0; else if (bottom>0xffff) bottom=0xffff;
+  return (layer<<16)|bottom;
+}
+
+// Returns <0 if we exceed the budget, and leaves (v) partially sorted.
+static int sprite_sortent_insertion(struct sprite_sortent *v,int c) {
+  int budget=c<<1;
+  int i=1; for (;i<c;i++) {
+    if (v[i-1].key<=v[i].key) continue;
+    struct sprite_sortent e=v[i];
+    int p=i;
+    while ((p>0)&&(v[p-1].key>e.key)) {
+      v[p]=v[p-1];
+      p--;
+      budget--;
     }
+    v[p]=e;
+    if (budget<0) return -1;
   }
-  for (i=eqp+eqc;i<c;i++) {
-    struct sprite *q=v[i];
-    int cmp=sprite_rendercmp(q,ref);
-    if (cmp<0) {
-      memmove(v+eqp+1,v+eqp,sizeof(void*)*(i-eqp));
-      v[eqp]=q;
-      eqp++;
-    } else if (!cmp) {
-      if (i>eqp+eqc) {
-        memmove(v+eqp+eqc+1,v+eqp+eqc,sizeof(void*)*(i-eqc-eqp));
-        v[eqp+eqc]=q;
-        eqc++;
-      } else {
-        eqc++;
-      }
+  return 0;
+}
+
+// Returns the buffer containing the result, either (v) or (tmp).
+static struct sprite_sortent *sprite_sortent_radix(struct sprite_sortent *v,struct sprite_sortent *tmp,int c) {
+  int countv[3][256]={0};
+  const struct sprite_sortent *src=v;
+  int i=c; for (;i-->0;src++) {
+    countv[0][src->key&0xff]++;
+    countv[1][(src->key>>8)&0xff]++;
+    countv[2][src->key>>16]++;
+  }
+  int pass=0; for (;pass<3;pass++) {
+    int shift=pass<<3;
+    int *count=countv[pass];
+    if (count[(v->key>>shift)&0xff]==c) continue; // All the same in this byte. Very common for layer.
+    int p=0; for (i=0;i<256;i++) {
+      int n=count[i];
+      count[i]=p;
+      p+=n;
     }
+    for (src=v,i=c;i-->0;src++) tmp[count[(src->key>>shift)&0xff]++]=*src;
+    struct sprite_sortent *swap=v;
+    v=tmp;
+    tmp=swap;
   }
-  sprgrp_render_qsort(v,eqp);
-  sprgrp_render_qsort(v+eqp+eqc,c-eqc-eqp);
+  return v;
 }
  
 static void sprgrp_render_sort(struct sprgrp *sprgrp) {
   if (sprgrp->sprc<2) return;
-  if (!sprgrp->sortdir) {
-    sprgrp_render_qsort(sprgrp->sprv,sprgrp->sprc);
-    sprgrp->sortdir=1;
-  } else {
-    int first,last,d,i;
-    if (sprgrp->sortdir>0) {
-      first=0;
-      last=sprgrp->sprc-1;
-      d=1;
-      sprgrp->sortdir=-1;
-    } else {
-      first=sprgrp->sprc-1;
-      last=0;
-      d=-1;
-      sprgrp->sortdir=1;
-    }
-    for (i=first;i!=last;i+=d) {
-      struct sprite *a=sprgrp->sprv[i];
-      struct sprite *b=sprgrp->sprv[i+d];
-      if (sprite_rendercmp(a,b)==d) {
-        sprgrp->sprv[i]=b;
-        sprgrp->sprv[i+d]=a;
-      }
-    }
+  if (sprgrp->sprc>sortenta) {
+    int na=(sprgrp->sprc+256)&~255;
+    if (na>INT_MAX/sizeof(struct sprite_sortent)) return;
+    void *nv=realloc(sortentv,sizeof(struct sprite_sortent)*na);
+    if (!nv) return;
+    sortentv=nv;
+    if (!(nv=realloc(sortenttmp,sizeof(struct sprite_sortent)*na))) return;
+    sortenttmp=nv;
+    sortenta=na;
+  }
+  struct sprite_sortent *ent=sortentv;
+  struct sprite **spritep=sprgrp->sprv;
+  int i=sprgrp->sprc;
+  for (;i-->0;ent++,spritep++) {
+    ent->key=sprite_render_key(*spritep);
+    ent->sprite=*spritep;
+  }
+  ent=sortentv;
+  if (!sprgrp->sortdir||(sprite_sortent_insertion(ent,sprgrp->sprc)<0)) {
+    ent=sprite_sortent_radix(sortentv,sortenttmp,sprgrp->sprc);
   }
+  for (spritep=sprgrp->sprv,i=sprgrp->sprc;i-->0;ent++,spritep++) *spritep=ent->sprite;
+  sprgrp->sortdir=1;
 }
 
 /* Render all sprites.
  */
 
+static int sprgrp_render_culledc=0;
+static int sprgrp_render_drawc=0;
+
+int sprgrp_render_get_culled_count() {
+  return sprgrp_render_culledc;
+}
+
+int sprgrp_render_get_draw_count() {
+  return sprgrp_render_drawc;
+}
+ 
 void sprgrp_render(int dsttexid,struct sprgrp *sprgrp) {
   int i;
 
-  // Calculate the output position and coverage for each sprite.
+  // Calculate the output position and coverage for each sprite, if it's changed since last time.
+  // Position is interpolated between the last two update steps, (rpx,rpy) to (x,y).
+  profiler_begin(PROFILER_PHASE_sprsort);
   for (i=sprgrp->sprc;i-->0;) {
     struct sprite *sprite=sprgrp->sprv[i];
+    double x=sprite->rpx+(sprite->x-sprite->rpx)*g.renderlerp;
+    double y=sprite->rpy+(sprite->y-sprite->rpy)*g.renderlerp;
+    if (sprite->bvalid&&(x==sprite->bpx)&&(y==sprite->bpy)) continue;
+    sprite->bvalid=1;
+    sprite->bpx=x;
+    sprite->bpy=y;
     if (sprite->sprctl&&sprite->sprctl->calculate_bounds) {
-      sprite->sprctl->calculate_bounds(sprite,TILESIZE,0,0);
+      int addx=(int)(x*TILESIZE)-(int)(sprite->x*TILESIZE);
+      int addy=(int)(y*TILESIZE)-(int)(sprite->y*TILESIZE);
+      sprite->sprctl->calculate_bounds(sprite,TILESIZE,addx,addy);
     } else {
-      int dstx=(int)(sprite->x*TILESIZE);
-      int dsty=(int)(sprite->y*TILESIZE);
+      int dstx=(int)(x*TILESIZE);
+      int dsty=(int)(y*TILESIZE);
       sprite->bw=TILESIZE;
       sprite->bh=TILESIZE;
       sprite->bx=dstx-(TILESIZE>>1);
       sprite->by=dsty-(TILESIZE>>1);
     }
-    sprite->bx+=g.renderx;
-    sprite->by+=g.rendery;
   }
   
   // Advance the sort.
   sprgrp_render_sort(sprgrp);
+  profiler_end(PROFILER_PHASE_sprsort);
   
-  // Render all in order.
-  g.tile_renderer.dsttexid=dsttexid;
+  // Queue all in order, skipping any well outside the screen. The queue regroups by texture where it can.
+  // Custom renderers may reach a little beyond their bounds (eg hero's head and sword), so allow a margin.
+  // Our output targets, (g.texid_worldv), are screen-sized.
+  profiler_begin(PROFILER_PHASE_sprdraw);
+  const int cull_l=-SPRITE_CULL_MARGIN,cull_t=-SPRITE_CULL_MARGIN;
+  const int cull_r=SCREENW+SPRITE_CULL_MARGIN,cull_b=SCREENH+SPRITE_CULL_MARGIN;
+  sprgrp_render_culledc=0;
   int imageid=0;
-  #define FLUSH_TILES if (imageid) { \
-    tile_renderer_end(&g.tile_renderer); \
-    imageid=0; \
-  }
   for (i=0;i<sprgrp->sprc;i++) {
     struct sprite *sprite=sprgrp->sprv[i];
-    if (sprite->sprctl&&sprite->sprctl->render) {
-      FLUSH_TILES
+    if (
+      (sprite->bx>=cull_r)||(sprite->by>=cull_b)||
+      (sprite->bx+sprite->bw<=cull_l)||(sprite->by+sprite->bh<=cull_t)
+    ) {
+      sprgrp_render_culledc++;
+    } else if (sprite->sprctl&&sprite->sprctl->render) {
       sprite->sprctl->render(dsttexid,sprite);
+      imageid=0;
     } else if (!sprite->imageid) {
       // Skip it.
     } else {
       if (sprite->imageid!=imageid) {
-        FLUSH_TILES
         int texid=texcache_get(&g.texcache,sprite->imageid);
         if (texid<1) continue;
         imageid=sprite->imageid;
-        tile_renderer_begin(&g.tile_renderer,texid,0,0xff);
+        sprite_render_begin(texid,0,0xff);
       }
       int dstx=sprite->bx+(TILESIZE>>1);
       int dsty=sprite->by+(TILESIZE>>1);
-      tile_renderer_tile(&g.tile_renderer,dstx,dsty,sprite->tileid,sprite->xform);
+      sprite_render_tile(dstx,dsty,sprite->tileid,sprite->xform);
     }
   }
-  FLUSH_TILES
-  #undef FLUSH_TILES
-  
-  g.tile_renderer.dsttexid=1;
+  sprgrp_render_drawc=sprite_render_flush(dsttexid);
+  profiler_end(PROFILER_PHASE_sprdraw);
   
   // Debug: highlight hitbox of physics sprites.
   if (0) {
@@ -684,7 +860,7 @@ void sprgrp_render(int dsttexid,struct sprgrp *sprgrp) {
       int y=(sprite->y-sprite->hbu)*TILESIZE;
       int w=(sprite->hbl+sprite->hbr)*TILESIZE;
       int h=(sprite->hbu+sprite->hbd)*TILESIZE;
-      egg_draw_rect(1,x,y,w,h,0xff000080);
+      draw_rect(1,x,y,w,h,0xff000080);
     }
   }
 }
@@ -18,18 +18,27 @@ struct aabb { double l,r,t,b; };
 struct sprite {
   const struct sprctl *sprctl; // OPTIONAL
   const struct sprdef *sprdef; // OPTIONAL
-  struct sprgrp **grpv;
+  struct sprgrp **grpv; // Dynamic groups only.
   int grpc,grpa;
+  uint32_t grpmask; // Global groups, (1<<SPRGRP_*). Don't touch.
   int refc; // Don't touch.
+  uint32_t handle; // Zero until somebody calls sprite_handle(). Don't touch.
+  uint32_t serial; // Creation order, unique and increasing. UNIQUE groups sort by it, so iteration never depends on the heap. Don't touch.
   double x,y; // Real position in tiles.
   double hbl,hbr,hbu,hbd; // Positive distance to each edge of hitbox, from (x,y). Controller must set if solid.
   double pvx,pvy; // Used by physics. Last known position.
+  double rpx,rpy; // Position at the start of the last update step. Renderer interpolates from here to (x,y).
   struct aabb aabb; // Used by physics, please ignore.
   int phconstrain; // Used by physics. Controller may read to see which edges are under pressure. (DIR_N,W,E,S)
   int mapsolids; // Bitfields, (1<<physics), which cells are impassible.
+  uint8_t ccd; // Nonzero to sweep from (pvx,pvy) to (x,y) against walls, so fast movers can't tunnel. Costs a bit more.
   uint8_t invmass; // 0=immobile, 1=heavy ... 255=light. For reference, let's call a man 128.
+  uint8_t phasleep; // Used by physics. Sprites that sit still without colliding stop getting checked against walls.
+  uint8_t phcollided; // Used by physics, please ignore.
   int layer; // Lower layers render first. Within a layer, we sort by bottom edge, top to bottom.
   int bx,by,bw,bh; // Render bounds in screen pixels. Generated by renderer when needed.
+  double bpx,bpy; // Interpolated position (bx,by,bw,bh) were generated for.
+  uint8_t bvalid; // Renderer sets nonzero after generating bounds. Zero it if your calculate_bounds depends on something other than position.
   int imageid; // (imageid,tileid,xform) for single-tile sprites with no custom render hook.
   uint8_t tileid;
   uint8_t xform;
@@ -45,6 +54,32 @@ void sprite_del(struct sprite *sprite);
 int sprite_ref(struct sprite *sprite);
 struct sprite *sprite_new(const struct sprctl *sprctl);
 
+/* For savestate restore only: A STRONG reference to a zeroed sprite with (sprctl) set, in no groups, and init not called.
+ * Caller fills it in, joins groups, and drops the reference.
+ */
+struct sprite *sprite_new_uninitialized(const struct sprctl *sprctl);
+
+/* Also for savestate: The (serial) the next new sprite will get.
+ * Restore puts back each sprite's serial and then this, so order among old and new sprites comes out the same.
+ */
+uint32_t sprite_get_next_serial();
+void sprite_set_next_serial(uint32_t serial);
+
+/* Handles are weak references that go stale safely, when the sprite dies or gets deleted.
+ * Prefer these over holding a raw pointer across frames.
+ * Zero is never a valid handle, and sprite_from_handle(0) is always null.
+ */
+uint32_t sprite_handle(struct sprite *sprite);
+struct sprite *sprite_from_handle(uint32_t handle);
+
+/* Sprite objects and their group lists come from a pool of free lists keyed by size.
+ * sprite_pool_reserve() to preallocate (count) free blocks for a given size, eg a sprctl's objlen.
+ * sprite_pool_report() logs usage per size class, to help with tuning.
+ * Getting and putting blocks is private to sprite.c, see sprpool.h.
+ */
+int sprite_pool_reserve(int size,int count);
+void sprite_pool_report();
+
 /* Create a sprite from a definition and add to the appropriate global groups.
  * Returns a WEAK reference.
  */
@@ -96,7 +131,8 @@ struct sprctl {
   /* Your bounds have been calculated -- render at that position and ignore (sprite->x,y).
    * If you implement this, sprite's (texid,tileid,xform) are not used (you can use them).
    * If you do not implement, the sprite renders as a single tile.
-   * If you use (g.tile_renderer), its (dsttexid) is already set correctly by the caller.
+   * Draw your tiles with sprite_render_begin() and sprite_render_tile(), not (g.tile_renderer) or egg_draw_*.
+   * If you really must draw directly, call sprite_render_flush(dsttexid) first.
    */
   void (*render)(int dsttexid,struct sprite *sprite);
   
@@ -127,9 +163,20 @@ struct sprctl {
    * (assailant) may be null.
    */
   void (*damage)(struct sprite *sprite,int qual,struct sprite *assailant);
+  
+  /* Savestate, see savestate.c.
+   * If you don't implement these, everything after the sprite header is copied verbatim.
+   * That's fine for plain data. If you hold handles, implement both, and translate with savestate_handle_save() and savestate_handle_load().
+   * (save) returns the full length even if it exceeds (dsta), and must not write beyond (dsta).
+   * (load) happens after all sprites exist, and instead of (init) and (ready).
+   */
+  int (*save)(void *dst,int dsta,struct sprite *sprite);
+  int (*load)(struct sprite *sprite,const void *src,int srcc);
 };
 
+// Generated by our build tool, from declarations in arrautza.h. (sprctl_id) returns zero for unlisted ones, including null.
 const struct sprctl *sprctl_by_id(int id);
+int sprctl_id(const struct sprctl *sprctl);
 
 /* sprdef: Resource for a sprite definition.
  * These are the things you'll refer to in a map's spawn points.
@@ -163,8 +210,8 @@ int sprdef_for_each_command(
 /* sprgrp: Mutually-linked group of sprites.
  **************************************************************/
  
-#define SPRGRP_MODE_UNIQUE   0 /* Default. Sort by sprite address. */
-#define SPRGRP_MODE_RENDER   1 /* Sort incrementally by render order. Can be out of order temporarily. */
+#define SPRGRP_MODE_UNIQUE   0 /* Default. Sort by (serial), ie creation order. */
+#define SPRGRP_MODE_RENDER   1 /* Sorted by render order at each render. Can be out of order in between. */
 #define SPRGRP_MODE_SINGLE   2 /* Adding a sprite evicts any existing one. */
 #define SPRGRP_MODE_EXPLICIT 3 /* Preserve order of addition. Not sure this is useful. */
  
@@ -173,7 +220,7 @@ struct sprgrp {
   int sprc,spra;
   int refc; // Don't touch.
   int mode;
-  int sortdir; // For RENDER mode only. -1,1 to go that direction next time or 0 for a full sort.
+  int sortdir; // For RENDER mode only. Nonzero if mostly sorted, or 0 for a full sort.
 };
 
 void sprgrp_del(struct sprgrp *sprgrp);
@@ -184,7 +231,7 @@ int sprgrp_has(const struct sprgrp *sprgrp,const struct sprite *sprite);
 int sprgrp_add(struct sprgrp *sprgrp,struct sprite *sprite); // => -1,0,1 = (error,already in,added)
 int sprgrp_remove(struct sprgrp *sprgrp,struct sprite *sprite); // ''
 
-#define sprite_in_group(sprite,grpname) sprgrp_has(sprgrpv+SPRGRP_##grpname,sprite)
+#define sprite_in_group(sprite,grpname) (((sprite)&&((sprite)->grpmask&(1u<<SPRGRP_##grpname)))?1:0)
 #define sprite_add_group(sprite,grpname) sprgrp_add(sprgrpv+SPRGRP_##grpname,sprite)
 #define sprite_remove_group(sprite,grpname) sprgrp_remove(sprgrpv+SPRGRP_##grpname,sprite)
 
@@ -219,13 +266,27 @@ extern struct sprgrp sprgrpv[32];
   _(FRAGILE)
   
 static inline struct sprite *sprite_if_alive(struct sprite *sprite) {
-  return sprgrp_has(sprgrpv+SPRGRP_KEEPALIVE,sprite)?sprite:0;
+  if (!sprite) return 0;
+  return (sprite->grpmask&(1u<<SPRGRP_KEEPALIVE))?sprite:0;
 }
 
 // Special hooks that only main.c should need.
 void sprgrpv_init();
 void sprgrp_update(struct sprgrp *sprgrp,double elapsed,int bg);
 void sprgrp_render(int dsttexid,struct sprgrp *sprgrp);
+void sprgrp_save_positions(struct sprgrp *sprgrp); // (x,y)=>(rpx,rpy) for each. Call before each update step.
+int sprgrp_render_get_culled_count(); // Sprites skipped for being offscreen, during the last sprgrp_render().
+int sprgrp_render_get_draw_count(); // egg_draw_tile calls made by the last sprgrp_render().
+
+/* Render queue, for use by sprctl->render hooks (and sprgrp_render itself).
+ * Works like tile_renderer: Begin with texture, tint, and alpha, then add tiles centered at (x,y). No "end".
+ * Nothing is drawn until sprite_render_flush(), which sprgrp_render does when it's done.
+ * Tiles batch by (texid,tint,alpha), and may jump ahead to an earlier batch if they don't overlap anything in between.
+ * Flush returns the count of egg_draw_tile calls.
+ */
+void sprite_render_begin(int texid,uint32_t tint,uint8_t alpha);
+void sprite_render_tile(int16_t x,int16_t y,uint8_t tileid,uint8_t xform);
+int sprite_render_flush(int dsttexid);
 
 /* Our approach to physics is that sprite controllers may move their sprite freely,
  * then it all gets rectified in a batch afterward.
@@ -233,10 +294,45 @@ void sprgrp_render(int dsttexid,struct sprgrp *sprgrp);
 void physics_update(struct sprgrp *sprgrp,double elapsed);
 void physics_rebuild_map();
 
+/* Walls for some map other than the current one, built ahead of time.
+ * physics_use_walls() swaps them in; null to go back to what physics_rebuild_map() built.
+ * You must keep the object alive as long as it's in use. Deleting the one in use reverts to the default.
+ * (imageid) is only consulted if the map has no baked walls, to read its tilesheet.
+ */
+struct physics_walls;
+struct physics_walls *physics_walls_new(const struct map *map,int imageid);
+void physics_walls_del(struct physics_walls *walls);
+void physics_use_walls(struct physics_walls *walls);
+
+/* A solid sprite falls asleep after a frame in which it neither moved nor collided.
+ * Sleepers skip wall resolution, and pairs where both are asleep are skipped too.
+ * Moving it, overlapping it with an awake sprite, sprite_warped(), or sprite_set_hitbox() wakes it up.
+ * If you change (hb*) or (mapsolids) directly on an established sprite, clear (phasleep) yourself.
+ * Counts are from the last physics_update.
+ */
+void physics_get_sleep_counts(int *awakec,int *asleepc);
+
 // Nonzero if a collision exists against any member of (sprgrp), except (sprite) itself.
 int sprite_collides_with_group(struct sprite *sprite,struct sprgrp *sprgrp);
 
+/* Spatial queries against a group.
+ * Fill (dst) with up to (dsta) sprites and return the total count, which may exceed (dsta).
+ * If it does, which ones you get is undefined. Results are in group order.
+ *   aabb: Hitbox overlaps the rectangle. Touching edges don't count.
+ *   radius: Position (x,y) is within (radius) of the point, inclusive. Hitbox doesn't matter.
+ *   point: Hitbox contains the point.
+ * The global groups are backed by a spatial index, so cost is in proportion to the neighborhood, not the group.
+ * Other groups work too, with a linear scan.
+ * The index rebuilds lazily when membership changes, and at the start and end of each update.
+ * Sprites that move more than a tile in between could be missed. Call sprgrp_index_invalidate() if you teleport things.
+ */
+int sprgrp_query_aabb(struct sprite **dst,int dsta,struct sprgrp *sprgrp,double l,double t,double r,double b);
+int sprgrp_query_radius(struct sprite **dst,int dsta,struct sprgrp *sprgrp,double x,double y,double radius);
+int sprgrp_query_point(struct sprite **dst,int dsta,struct sprgrp *sprgrp,double x,double y);
+void sprgrp_index_invalidate(struct sprgrp *sprgrp); // Null for all.
+
 // Nonzero if (sprite)'s hitbox overlaps any cell with (physics) type.
+// If (sprite->ccd), also if it passed through one on the way from (pvx,pvy).
 int sprite_collides_with_map(struct sprite *sprite,int physics);
 
 /* Public API for specific sprite types.
@@ -0,0 +1,137 @@
+#include "../arrautza.h"
+#include "sprite.h"
+#include "sprpool.h"
+
+/* Object pool for sprites and their group lists.
+ * Sprites churn constantly (missiles, explosions, toasts), and our first-fit heap doesn't love that.
+ * So blocks are bucketed into size classes of SPRPOOL_GRAIN bytes, and each class keeps a free list.
+ * Freed blocks go back to their class's list, never to the heap.
+ * When a list runs dry, we allocate a slab of several blocks at once, so they end up adjacent.
+ * Anything larger than the largest class goes straight to calloc and free.
+ */
+
+#define SPRPOOL_GRAIN 16
+#define SPRPOOL_CLASS_LIMIT 64 /* => Largest pooled block is 1024 bytes. */
+#define SPRPOOL_SLAB_SIZE 2048 /* Bytes per slab, approximately. Always at least one block. */
+
+struct sprpool_free {
+  struct sprpool_free *next;
+};
+
+static struct sprpool_class {
+  struct sprpool_free *freev;
+  int freec; // Blocks in (freev).
+  int livec; // Blocks handed out and not returned yet.
+  int highwater; // Highest (livec) ever.
+  int slabc; // Slabs allocated.
+  int blockc; // Blocks in all slabs, ie (freec+livec).
+  int getc; // Total calls to sprite_pool_get().
+} sprpool_classv[SPRPOOL_CLASS_LIMIT]={0};
+
+static int sprpool_oversizec=0; // Live blocks too big for any class.
+
+/* Size class from byte count.
+ * Returns <0 if too big.
+ */
+
+static int sprpool_class_index(int size) {
+  if (size<1) size=1;
+  int ix=(size-1)/SPRPOOL_GRAIN;
+  if (ix>=SPRPOOL_CLASS_LIMIT) return -1;
+  return ix;
+}
+
+/* Add a slab of blocks to a class's free list.
+ */
+
+static int sprpool_add_slab(int ix,int blockc) {
+  struct sprpool_class *class=sprpool_classv+ix;
+  int blocksize=(ix+1)*SPRPOOL_GRAIN;
+  if (blockc<1) blockc=1;
+  if (blockc>INT_MAX/blocksize) return -1;
+  char *slab=malloc(blocksize*blockc);
+  if (!slab) return -1;
+  // Thread them in reverse, so blocks come off the list in address order.
+  int i=blockc;
+  while (i-->0) {
+    struct sprpool_free *block=(struct sprpool_free*)(slab+i*blocksize);
+    block->next=class->freev;
+    class->freev=block;
+  }
+  class->freec+=blockc;
+  class->blockc+=blockc;
+  class->slabc++;
+  return 0;
+}
+
+/* Get block.
+ */
+
+void *sprite_pool_get(int size) {
+  int ix=sprpool_class_index(size);
+  if (ix<0) {
+    void *block=calloc(1,size);
+    if (block) sprpool_oversizec++;
+    return block;
+  }
+  struct sprpool_class *class=sprpool_classv+ix;
+  if (!class->freev) {
+    if (sprpool_add_slab(ix,SPRPOOL_SLAB_SIZE/((ix+1)*SPRPOOL_GRAIN))<0) return 0;
+  }
+  struct sprpool_free *block=class->freev;
+  class->freev=block->next;
+  class->freec--;
+  class->getc++;
+  if (++(class->livec)>class->highwater) class->highwater=class->livec;
+  memset(block,0,(ix+1)*SPRPOOL_GRAIN);
+  return block;
+}
+
+/* Return block.
+ */
+
+void sprite_pool_put(void *block,int size) {
+  if (!block) return;
+  int ix=sprpool_class_index(size);
+  if (ix<0) {
+    free(block);
+    sprpool_oversizec--;
+    return;
+  }
+  struct sprpool_class *class=sprpool_classv+ix;
+  struct sprpool_free *free_block=block;
+  free_block->next=class->freev;
+  class->freev=free_block;
+  class->freec++;
+  class->livec--;
+}
+
+/* Ensure free blocks are available.
+ */
+
+int sprite_pool_reserve(int size,int count) {
+  int ix=sprpool_class_index(size);
+  if (ix<0) return 0;
+  struct sprpool_class *class=sprpool_classv+ix;
+  if (class->freec>=count) return 0;
+  return sprpool_add_slab(ix,count-class->freec);
+}
+
+/* Log stats.
+ */
+
+void sprite_pool_report() {
+  egg_log("Sprite pool, by block size:");
+  const struct sprpool_class *class=sprpool_classv;
+  int ix=0,totalbytes=0;
+  for (;ix<SPRPOOL_CLASS_LIMIT;ix++,class++) {
+    if (!class->slabc) continue;
+    int blocksize=(ix+1)*SPRPOOL_GRAIN;
+    egg_log(
+      "  %4d: live=%d free=%d highwater=%d slabs=%d gets=%d",
+      blocksize,class->livec,class->freec,class->highwater,class->slabc,class->getc
+    );
+    totalbytes+=blocksize*class->blockc;
+  }
+  egg_log("  Total %d bytes pooled. %d oversize blocks live.",totalbytes,sprpool_oversizec);
+}
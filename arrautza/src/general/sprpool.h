@@ -0,0 +1,12 @@
+/* sprpool.h
+ * Private to sprite.c and sprpool.c: Take and return blocks from the sprite pool.
+ * The public side, sprite_pool_reserve() and sprite_pool_report(), is in sprite.h.
+ */
+ 
+#ifndef SPRPOOL_H
+#define SPRPOOL_H
+
+void *sprite_pool_get(int size); // Zeroed.
+void sprite_pool_put(void *block,int size);
+
+#endif
@@ -0,0 +1,209 @@
+#include "../arrautza.h"
+#include "sprite.h"
+
+/* Spatial index for the global groups.
+ * Each indexed sprite lands in one cell of a grid keyed on its position (x,y),
+ * with a one-cell border all around that catches anything offscreen.
+ * Queries expand by the largest hitbox in the group, plus a margin for sprites that moved since we built it.
+ * Cells are packed: Cell (n) is entries from (cellp[n]) to (cellp[n+1]).
+ */
+
+#define SPRQ_GRIDW (COLC+2)
+#define SPRQ_GRIDH (ROWC+2)
+#define SPRQ_MARGIN 1.0 /* How far a sprite can move between index rebuilds without being missed. */
+
+static struct sprgrp_index {
+  int valid;
+  double extl,extr,extu,extd; // Largest hitbox in the group, each edge independently.
+  int cellp[SPRQ_GRIDW*SPRQ_GRIDH+1];
+  struct sprq_entry {
+    struct sprite *sprite;
+    int sprp; // Position in the group at build time, so results come out in group order.
+  } *entryv;
+  int entrya;
+} sprgrp_indexv[32]={0};
+
+/* Invalidate.
+ */
+
+void sprgrp_index_invalidate(struct sprgrp *sprgrp) {
+  if (!sprgrp) {
+    struct sprgrp_index *index=sprgrp_indexv;
+    int i=32;
+    for (;i-->0;index++) index->valid=0;
+  } else if ((sprgrp>=sprgrpv)&&(sprgrp<sprgrpv+32)) {
+    sprgrp_indexv[sprgrp-sprgrpv].valid=0;
+  }
+}
+
+/* Grid coordinates.
+ */
+
+static int sprq_coord(double v,int limit) {
+  if (!(v>=-1.0)) return 0;
+  if (v>=limit) return limit+1;
+  return (int)(v+1.0);
+}
+
+/* Rebuild index if needed.
+ * Returns null for groups we don't index, or if it fails. Caller should fall back to a linear scan.
+ */
+
+static struct sprgrp_index *sprgrp_index_require(struct sprgrp *sprgrp) {
+  if ((sprgrp<sprgrpv)||(sprgrp>=sprgrpv+32)) return 0;
+  struct sprgrp_index *index=sprgrp_indexv+(sprgrp-sprgrpv);
+  if (index->valid) return index;
+  if (sprgrp->sprc>index->entrya) {
+    int na=(sprgrp->sprc+64)&~63;
+    if (na>INT_MAX/sizeof(struct sprq_entry)) return 0;
+    void *nv=realloc(index->entryv,sizeof(struct sprq_entry)*na);
+    if (!nv) return 0;
+    index->entryv=nv;
+    index->entrya=na;
+  }
+  memset(index->cellp,0,sizeof(index->cellp));
+  index->extl=index->extr=index->extu=index->extd=0.0;
+  int i=0; for (;i<sprgrp->sprc;i++) {
+    const struct sprite *sprite=sprgrp->sprv[i];
+    int x=sprq_coord(sprite->x,COLC);
+    int y=sprq_coord(sprite->y,ROWC);
+    index->cellp[y*SPRQ_GRIDW+x+1]++;
+    if (sprite->hbl>index->extl) index->extl=sprite->hbl;
+    if (sprite->hbr>index->extr) index->extr=sprite->hbr;
+    if (sprite->hbu>index->extu) index->extu=sprite->hbu;
+    if (sprite->hbd>index->extd) index->extd=sprite->hbd;
+  }
+  int cellc=SPRQ_GRIDW*SPRQ_GRIDH;
+  for (i=1;i<=cellc;i++) index->cellp[i]+=index->cellp[i-1];
+  for (i=0;i<sprgrp->sprc;i++) {
+    struct sprite *sprite=sprgrp->sprv[i];
+    int x=sprq_coord(sprite->x,COLC);
+    int y=sprq_coord(sprite->y,ROWC);
+    struct sprq_entry *entry=index->entryv+index->cellp[y*SPRQ_GRIDW+x]++;
+    entry->sprite=sprite;
+    entry->sprp=i;
+  }
+  // Insertion points ended up one cell ahead; shift back.
+  memmove(index->cellp+1,index->cellp,sizeof(int)*cellc);
+  index->cellp[0]=0;
+  index->valid=1;
+  return index;
+}
+
+/* Results buffer.
+ * Everything gets collected in group order, then copied out.
+ */
+
+static struct sprq_entry *sprq_resultv=0;
+static int sprq_resultc=0,sprq_resulta=0;
+
+static void sprq_result_add(struct sprite *sprite,int sprp) {
+  if (sprq_resultc>=sprq_resulta) {
+    int na=sprq_resulta+64;
+    void *nv=realloc(sprq_resultv,sizeof(struct sprq_entry)*na);
+    if (!nv) return;
+    sprq_resultv=nv;
+    sprq_resulta=na;
+  }
+  int p=sprq_resultc++;
+  while ((p>0)&&(sprq_resultv[p-1].sprp>sprp)) {
+    sprq_resultv[p]=sprq_resultv[p-1];
+    p--;
+  }
+  sprq_resultv[p].sprite=sprite;
+  sprq_resultv[p].sprp=sprp;
+}
+
+static int sprq_results_finish(struct sprite **dst,int dsta) {
+  int cpc=(sprq_resultc<dsta)?sprq_resultc:dsta;
+  int i=0; for (;i<cpc;i++) dst[i]=sprq_resultv[i].sprite;
+  return sprq_resultc;
+}
+
+/* Generic query.
+ * (l,t,r,b) is the region in which a sprite's position could be for (filter) to accept it.
+ * We expand it to cover stale positions, and (filter) makes the final call against live ones.
+ */
+
+static int sprgrp_query(
+  struct sprite **dst,int dsta,
+  struct sprgrp *sprgrp,
+  double l,double t,double r,double b,
+  int (*filter)(const struct sprite *sprite,const double *args),
+  const double *args
+) {
+  sprq_resultc=0;
+  if (!sprgrp) return 0;
+  struct sprgrp_index *index=sprgrp_index_require(sprgrp);
+  if (!index) {
+    int i=0; for (;i<sprgrp->sprc;i++) {
+      struct sprite *sprite=sprgrp->sprv[i];
+      if (filter(sprite,args)) sprq_result_add(sprite,i);
+    }
+    return sprq_results_finish(dst,dsta);
+  }
+  int x0=sprq_coord(l-SPRQ_MARGIN,COLC);
+  int y0=sprq_coord(t-SPRQ_MARGIN,ROWC);
+  int x1=sprq_coord(r+SPRQ_MARGIN,COLC);
+  int y1=sprq_coord(b+SPRQ_MARGIN,ROWC);
+  int y=y0; for (;y<=y1;y++) {
+    const int *cellp=index->cellp+y*SPRQ_GRIDW+x0;
+    int x=x0; for (;x<=x1;x++,cellp++) {
+      const struct sprq_entry *entry=index->entryv+cellp[0];
+      int i=cellp[1]-cellp[0];
+      for (;i-->0;entry++) {
+        if (filter(entry->sprite,args)) sprq_result_add(entry->sprite,entry->sprp);
+      }
+    }
+  }
+  return sprq_results_finish(dst,dsta);
+}
+
+/* Filters against live positions.
+ */
+
+static int sprq_filter_aabb(const struct sprite *sprite,const double *args) {
+  if (sprite->x+sprite->hbr<=args[0]) return 0;
+  if (sprite->x-sprite->hbl>=args[1]) return 0;
+  if (sprite->y+sprite->hbd<=args[2]) return 0;
+  if (sprite->y-sprite->hbu>=args[3]) return 0;
+  return 1;
+}
+
+static int sprq_filter_radius(const struct sprite *sprite,const double *args) {
+  double dx=sprite->x-args[0];
+  double dy=sprite->y-args[1];
+  return (dx*dx+dy*dy<=args[2]*args[2]);
+}
+
+static int sprq_filter_point(const struct sprite *sprite,const double *args) {
+  if (args[0]<sprite->x-sprite->hbl) return 0;
+  if (args[0]>=sprite->x+sprite->hbr) return 0;
+  if (args[1]<sprite->y-sprite->hbu) return 0;
+  if (args[1]>=sprite->y+sprite->hbd) return 0;
+  return 1;
+}
+
+/* Public queries.
+ */
+
+int sprgrp_query_aabb(struct sprite **dst,int dsta,struct sprgrp *sprgrp,double l,double t,double r,double b) {
+  double args[4]={l,r,t,b};
+  struct sprgrp_index *index=sprgrp_index_require(sprgrp);
+  double el=0.0,er=0.0,eu=0.0,ed=0.0;
+  if (index) { el=index->extl; er=index->extr; eu=index->extu; ed=index->extd; }
+  return sprgrp_query(dst,dsta,sprgrp,l-er,t-ed,r+el,b+eu,sprq_filter_aabb,args);
+}
+
+int sprgrp_query_radius(struct sprite **dst,int dsta,struct sprgrp *sprgrp,double x,double y,double radius) {
+  double args[3]={x,y,radius};
+  return sprgrp_query(dst,dsta,sprgrp,x-radius,y-radius,x+radius,y+radius,sprq_filter_radius,args);
+}
+
+int sprgrp_query_point(struct sprite **dst,int dsta,struct sprgrp *sprgrp,double x,double y) {
+  double args[2]={x,y};
+  struct sprgrp_index *index=sprgrp_index_require(sprgrp);
+  double el=0.0,er=0.0,eu=0.0,ed=0.0;
+  if (index) { el=index->extl; er=index->extr; eu=index->extu; ed=index->extd; }
+  return sprgrp_query(dst,dsta,sprgrp,x-er,y-ed,x+el,y+eu,sprq_filter_point,args);
+}
@@ -0,0 +1,136 @@
+#include "../arrautza.h"
+#include "sprite.h"
+
+/* Sprite render queue.
+ * Tiles arrive in painter's order, and we file each into a batch keyed by (texid,tint,alpha).
+ * A tile joins the most recent batch with its key, provided it doesn't overlap anything in the batches after that one.
+ * Otherwise it starts a new batch at the end.
+ * So order is preserved wherever it's visible, and busy scenes collapse to a handful of egg_draw_tile calls.
+ * Each batch is a linked list through the tile store, so moving tiles around is free.
+ */
+
+#define SPRRQ_LOOKBACK 16 /* How many batches back to search for a compatible one. */
+
+static struct sprrq_tile {
+  struct egg_draw_tile vtx;
+  int next; // Next tile in the same batch, or -1.
+} *sprrq_tilev=0;
+static int sprrq_tilec=0,sprrq_tilea=0;
+
+static struct sprrq_batch {
+  int texid;
+  uint32_t tint;
+  uint8_t alpha;
+  int head,tail; // Indices in (sprrq_tilev).
+  int tilec;
+  int l,t,r,b; // Union of all tiles' bounds, in output pixels.
+} *sprrq_batchv=0;
+static int sprrq_batchc=0,sprrq_batcha=0;
+
+static int sprrq_texid=0;
+static uint32_t sprrq_tint=0;
+static uint8_t sprrq_alpha=0xff;
+
+/* Begin.
+ */
+
+void sprite_render_begin(int texid,uint32_t tint,uint8_t alpha) {
+  sprrq_texid=texid;
+  sprrq_tint=tint;
+  sprrq_alpha=alpha;
+}
+
+/* Add a batch at the end.
+ */
+
+static struct sprrq_batch *sprrq_batch_add() {
+  if (sprrq_batchc>=sprrq_batcha) {
+    int na=sprrq_batcha+32;
+    if (na>INT_MAX/sizeof(struct sprrq_batch)) return 0;
+    void *nv=realloc(sprrq_batchv,sizeof(struct sprrq_batch)*na);
+    if (!nv) return 0;
+    sprrq_batchv=nv;
+    sprrq_batcha=na;
+  }
+  struct sprrq_batch *batch=sprrq_batchv+sprrq_batchc++;
+  batch->texid=sprrq_texid;
+  batch->tint=sprrq_tint;
+  batch->alpha=sprrq_alpha;
+  batch->head=batch->tail=-1;
+  batch->tilec=0;
+  batch->l=batch->t=INT_MAX;
+  batch->r=batch->b=-INT_MAX;
+  return batch;
+}
+
+/* Add tile.
+ */
+
+void sprite_render_tile(int16_t x,int16_t y,uint8_t tileid,uint8_t xform) {
+  if (sprrq_texid<1) return;
+  if (sprrq_tilec>=sprrq_tilea) {
+    int na=sprrq_tilea+128;
+    if (na>INT_MAX/sizeof(struct sprrq_tile)) return;
+    void *nv=realloc(sprrq_tilev,sizeof(struct sprrq_tile)*na);
+    if (!nv) return;
+    sprrq_tilev=nv;
+    sprrq_tilea=na;
+  }
+  int l=x-(TILESIZE>>1),t=y-(TILESIZE>>1);
+  int r=l+TILESIZE,b=t+TILESIZE;
+
+  // Walk backward to the most recent compatible batch, giving up at the first thing we overlap.
+  struct sprrq_batch *batch=0;
+  int i=sprrq_batchc,lookback=SPRRQ_LOOKBACK;
+  while ((i-->0)&&(lookback-->0)) {
+    struct sprrq_batch *q=sprrq_batchv+i;
+    if ((q->texid==sprrq_texid)&&(q->tint==sprrq_tint)&&(q->alpha==sprrq_alpha)) {
+      batch=q;
+      break;
+    }
+    if ((l<q->r)&&(r>q->l)&&(t<q->b)&&(b>q->t)) break;
+  }
+  if (!batch&&!(batch=sprrq_batch_add())) return;
+
+  int tilep=sprrq_tilec++;
+  struct sprrq_tile *tile=sprrq_tilev+tilep;
+  tile->vtx.x=x;
+  tile->vtx.y=y;
+  tile->vtx.tileid=tileid;
+  tile->vtx.xform=xform;
+  tile->next=-1;
+  if (batch->tail>=0) sprrq_tilev[batch->tail].next=tilep;
+  else batch->head=tilep;
+  batch->tail=tilep;
+  batch->tilec++;
+  if (l<batch->l) batch->l=l;
+  if (t<batch->t) batch->t=t;
+  if (r>batch->r) batch->r=r;
+  if (b>batch->b) batch->b=b;
+}
+
+/* Flush.
+ */
+
+int sprite_render_flush(int dsttexid) {
+  int drawc=0;
+  int pvdsttexid=g.tile_renderer.dsttexid;
+  g.tile_renderer.dsttexid=dsttexid;
+  const struct sprrq_batch *batch=sprrq_batchv;
+  int i=sprrq_batchc;
+  for (;i-->0;batch++) {
+    tile_renderer_begin(&g.tile_renderer,batch->texid,batch->tint,batch->alpha);
+    int tilep=batch->head;
+    while (tilep>=0) {
+      const struct sprrq_tile *tile=sprrq_tilev+tilep;
+      tile_renderer_tile(&g.tile_renderer,tile->vtx.x,tile->vtx.y,tile->vtx.tileid,tile->vtx.xform);
+      tilep=tile->next;
+    }
+    tile_renderer_end(&g.tile_renderer);
+    drawc+=(batch->tilec+TILE_RENDERER_CACHE_SIZE-1)/TILE_RENDERER_CACHE_SIZE;
+  }
+  g.tile_renderer.dsttexid=pvdsttexid;
+  sprrq_tilec=0;
+  sprrq_batchc=0;
+  return drawc;
+}
@@ -13,6 +13,7 @@ void stobus_cleanup(struct stobus *stobus) {
   }
   if (stobus->fieldv) free(stobus->fieldv);
   if (stobus->listenerv) free(stobus->listenerv);
+  if (stobus->pendingv) free(stobus->pendingv);
   memset(stobus,0,sizeof(struct stobus));
 }
 
@@ -35,15 +36,19 @@ int stobus_define(struct stobus *stobus,int id,int size_bits) {
 }
 
 /* Add listener.
+ * IDs only go up, so a new listener always lands at the end of its field's run.
  */
  
 int stobus_listen(struct stobus *stobus,int id,void (*cb)(int id,int v,void *userdata),void *userdata) {
   if ((id<1)||!cb) return -1;
-  int listenerid=1;
-  if (stobus->listenerc>0) {
-    listenerid=stobus->listenerv[stobus->listenerc-1].listenerid+1;
-    if (listenerid<1) return -1; // We'll fail after 2G listens.
+  if (stobus->listenerid_next<1) {
+    if (stobus->listenerid_next<0) return -1; // We'll fail after 2G listens.
+    stobus->listenerid_next=1;
   }
+  int listenerid=stobus->listenerid_next;
+  int p=stobus_listenerv_search_field(stobus,id,listenerid);
+  if (p>=0) return -1;
+  p=-p-1;
   if (stobus->listenerc>=stobus->listenera) {
     int na=stobus->listenera+16;
     if (na>INT_MAX/sizeof(struct stobus_listener)) return -1;
@@ -52,7 +57,10 @@ int stobus_listen(struct stobus *stobus,int id,void (*cb)(int id,int v,void *use
     stobus->listenerv=nv;
     stobus->listenera=na;
   }
-  struct stobus_listener *listener=stobus->listenerv+stobus->listenerc++;
+  struct stobus_listener *listener=stobus->listenerv+p;
+  memmove(listener+1,listener,sizeof(struct stobus_listener)*(stobus->listenerc-p));
+  stobus->listenerc++;
+  stobus->listenerid_next=(listenerid<INT_MAX)?(listenerid+1):-1;
   listener->listenerid=listenerid;
   listener->fldid=id;
   listener->cb=cb;
@@ -80,6 +88,52 @@ int stobus_get(struct stobus *stobus,int id) {
   return stobus->fieldv[p].v;
 }
 
+/* Notify listeners of one field, newest first.
+ * Callbacks are free to listen and unlisten, so we find our place again by ID after each one.
+ */
+ 
+static void stobus_notify(struct stobus *stobus,int id,int v) {
+  int listenerid=INT_MAX;
+  for (;;) {
+    int p=stobus_listenerv_search_field(stobus,id,listenerid);
+    if (p<0) p=-p-1;
+    if (--p<0) return;
+    const struct stobus_listener *listener=stobus->listenerv+p;
+    if (listener->fldid!=id) return;
+    listenerid=listener->listenerid;
+    listener->cb(id,v,listener->userdata);
+  }
+}
+
+/* Add field to the pending list, for deferred mode.
+ * A field with state gets one entry, no matter how many times it's set.
+ * Stateless fields are events, and every one gets its own entry.
+ * If the list can't grow, notify right away: Early is better than never.
+ */
+ 
+static void stobus_pend(struct stobus *stobus,struct stobus_field *field,int pvv,int v) {
+  if (field->pending) return;
+  if (stobus->pendingc>=stobus->pendinga) {
+    int na=stobus->pendinga+16;
+    void *nv=0;
+    if (na<=INT_MAX/sizeof(struct stobus_pending)) nv=realloc(stobus->pendingv,sizeof(struct stobus_pending)*na);
+    if (!nv) {
+      egg_log("stobus: Failed to defer notification for field %d. Notifying immediately.",field->id);
+      stobus_notify(stobus,field->id,v);
+      return;
+    }
+    stobus->pendingv=nv;
+    stobus->pendinga=na;
+  }
+  struct stobus_pending *pending=stobus->pendingv+stobus->pendingc++;
+  pending->id=field->id;
+  pending->v=v;
+  if (field->c) {
+    field->pending=1;
+    field->pendingv=pvv;
+  }
+}
+
 /* Set field.
  */
  
@@ -87,6 +141,7 @@ void stobus_set(struct stobus *stobus,int id,int v) {
   int p=stobus_fieldv_search(stobus,id);
   if (p<0) return;
   struct stobus_field *field=stobus->fieldv+p;
+  int pvv=field->v;
   if (field->c) { // stateless fields, we preserve the provided value for callbacks.
     if (v<0) v=0;
     unsigned int limit=(1u<<field->c)-1;
@@ -95,46 +150,101 @@ void stobus_set(struct stobus *stobus,int id,int v) {
     field->v=v;
     stobus->dirty=1;
   }
-  int i=stobus->listenerc;
-  while (i-->0) {
-    const struct stobus_listener *listener=stobus->listenerv+i;
-    if (listener->fldid!=id) continue;
-    listener->cb(id,v,listener->userdata);
+  if (stobus->deferred) stobus_pend(stobus,field,pvv,v);
+  else stobus_notify(stobus,id,v);
+}
+
+/* Deferred mode.
+ */
+ 
+void stobus_set_deferred(struct stobus *stobus,int deferred) {
+  if (deferred) {
+    stobus->deferred=1;
+  } else {
+    stobus->deferred=0;
+    stobus_flush(stobus);
+  }
+}
+
+void stobus_flush(struct stobus *stobus) {
+  /* Callbacks can set fields and queue more. We'll take those too, but in rounds, with a limit.
+   * Two fields that keep changing each other must not hang the game.
+   */
+  int round=0;
+  for (;(round<8)&&(stobus->pendingc>0);round++) {
+    int c=stobus->pendingc,i=0;
+    for (;i<c;i++) {
+      // Copy it out: Callbacks can pend more, and (pendingv) may move.
+      struct stobus_pending pending=stobus->pendingv[i];
+      int p=stobus_fieldv_search(stobus,pending.id);
+      if (p<0) continue;
+      struct stobus_field *field=stobus->fieldv+p;
+      if (field->c) {
+        field->pending=0;
+        if (field->v==field->pendingv) continue;
+        stobus_notify(stobus,field->id,field->v);
+      } else {
+        stobus_notify(stobus,field->id,pending.v);
+      }
+    }
+    stobus->pendingc-=c;
+    memmove(stobus->pendingv,stobus->pendingv+c,sizeof(struct stobus_pending)*stobus->pendingc);
   }
 }
 
+/* Drop pending notifications, when the state is replaced wholesale.
+ */
+ 
+static void stobus_drop_pending(struct stobus *stobus) {
+  struct stobus_field *field=stobus->fieldv;
+  int i=stobus->fieldc;
+  for (;i-->0;field++) field->pending=0;
+  stobus->pendingc=0;
+}
+
+/* Base64 alphabet, both directions.
+ * The decode table maps anything outside the alphabet to 0xff.
+ */
+
+static const char stobus_alphabet[64]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static uint8_t stobus_sextet_from_char[256];
+static int stobus_sextet_table_ready=0;
+
+static void stobus_require_sextet_table() {
+  if (stobus_sextet_table_ready) return;
+  memset(stobus_sextet_from_char,0xff,sizeof(stobus_sextet_from_char));
+  int i=0; for (;i<64;i++) stobus_sextet_from_char[(uint8_t)stobus_alphabet[i]]=i;
+  stobus_sextet_table_ready=1;
+}
+
 /* Encode.
  */
  
 int stobus_encode(char *dst,int dsta,const struct stobus *stobus) {
-  /* Three passes:
-   *  1. Calculate output size in bits, then bytes.
-   *  2. Pack fields little-endianly bitwise, 6 bits per output byte.
-   *  3. Apply the base64 alphabet to each byte of output.
+  /* Fields are packed little-endianly, the first field's low bit being the first sextet's low bit.
+   * Two passes: Measure, then feed whole fields into a 64-bit accumulator and emit sextets as they fill.
+   * The accumulator never holds more than 5 leftover bits plus one 31-bit field, so it can't overflow.
    */
   int bitc=0,i;
   const struct stobus_field *field=stobus->fieldv;
   for (i=stobus->fieldc;i-->0;field++) bitc+=field->c;
-  int dstc=(bitc+7)>>3;
+  int dstc=(bitc+5)/6;
   if (dstc>dsta) return dstc;
   
-  memset(dst,0,dstc);
-  int dstp=0;
-  uint8_t dstmask=1;
+  uint64_t acc=0;
+  int accc=0,dstp=0;
   for (field=stobus->fieldv,i=stobus->fieldc;i-->0;field++) {
-    int bi=field->c;
-    int vmask=1;
-    // Copy one bit at a time. This could be done more efficiently, but it would be complicated.
-    for (;bi-->0;vmask<<=1) {
-      if (field->v&vmask) dst[dstp]|=dstmask;
-      if (dstmask==0x20) { dstmask=1; dstp++; }
-      else dstmask<<=1;
+    if (!field->c) continue;
+    acc|=(uint64_t)(field->v&((1u<<field->c)-1))<<accc;
+    accc+=field->c;
+    while (accc>=6) {
+      dst[dstp++]=stobus_alphabet[acc&0x3f];
+      acc>>=6;
+      accc-=6;
     }
   }
-  
-  const char *alphabet="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  uint8_t *p=(uint8_t*)dst;
-  for (i=dstc;i-->0;p++) (*p)=alphabet[*p];
+  if (accc>0) dst[dstp++]=stobus_alphabet[acc&0x3f];
   
   if (dstc<dsta) dst[dstc]=0;
   return dstc;
@@ -144,70 +254,38 @@ int stobus_encode(char *dst,int dsta,const struct stobus *stobus) {
  */
 
 int stobus_decode(struct stobus *stobus,const char *src,int srcc) {
-  if ((srcc<0)||(srcc&!src)) return -1;
+  if ((srcc<0)||(srcc&&!src)) return -1;
   while (srcc&&(src[srcc-1]=='=')) srcc--;
+  stobus_require_sextet_table();
   
   // Take one pass over (src) just to validate format, before we touch anything.
-  int i=srcc; for (;i-->0;) {
-    if ((src[i]>='A')&&(src[i]<='Z')) continue;
-    if ((src[i]>='a')&&(src[i]<='z')) continue;
-    if ((src[i]>='0')&&(src[i]<='9')) continue;
-    if (src[i]=='+') continue;
-    if (src[i]=='/') continue;
-    return -1;
+  const uint8_t *usrc=(const uint8_t*)src;
+  int i=srcc; while (i-->0) {
+    if (stobus_sextet_from_char[usrc[i]]==0xff) return -1;
   }
   
-  // Read six bits at a time from (src), and step fields responsively.
-  if (stobus->fieldc>0) {
-    struct stobus_field *field=stobus->fieldv;
-    field->v=0;
-    int fieldi=0;
-    int fieldmask=1;
-    int fieldpending=field->c;
-    while (!fieldpending) {
-      if (++fieldi>=stobus->fieldc) break;
-      field++;
-      fieldpending=field->c;
-    }
-    if (fieldi<stobus->fieldc) {
-      for (;srcc-->0;src++) {
-        uint8_t inbyte=*src;
-             if ((inbyte>='A')&&(inbyte<='Z')) inbyte=inbyte-'A';
-        else if ((inbyte>='a')&&(inbyte<='z')) inbyte=inbyte-'a'+26;
-        else if ((inbyte>='0')&&(inbyte<='9')) inbyte=inbyte-'0'+52;
-        else if (inbyte=='+') inbyte=62;
-        else if (inbyte=='/') inbyte=63;
-        else return -1;
-        uint8_t inmask=1;
-        for (;inmask<0x40;inmask<<=1) {
-          if (inbyte&inmask) field->v|=fieldmask;
-          if (fieldpending--) {
-            fieldmask<<=1;
-          } else {
-            if (++fieldi>=stobus->fieldc) break;
-            field++;
-            field->v=0;
-            fieldmask=1;
-            fieldpending=field->c;
-            while (!fieldpending) {
-              if (++fieldi>=stobus->fieldc) break;
-              field++;
-              fieldpending=field->c;
-            }
-          }
-        }
-        if (fieldi>=stobus->fieldc) break;
-      }
+  // Pull sextets into the accumulator until it covers the next field, then take exactly that field's bits off the bottom.
+  // Fields past the end of input get zero, same as if the input were padded with 'A'.
+  uint64_t acc=0;
+  int accc=0,srcp=0;
+  struct stobus_field *field=stobus->fieldv;
+  for (i=stobus->fieldc;i-->0;field++) {
+    if (!field->c) continue;
+    while ((accc<field->c)&&(srcp<srcc)) {
+      acc|=(uint64_t)stobus_sextet_from_char[usrc[srcp++]]<<accc;
+      accc+=6;
     }
-    // Any fields we haven't reached get value zero.
-    for (;;) {
-      fieldi++;
-      if (fieldi>=stobus->fieldc) break;
-      field++;
-      field->v=0;
+    field->v=acc&((1u<<field->c)-1);
+    if (accc>field->c) {
+      acc>>=field->c;
+      accc-=field->c;
+    } else {
+      acc=0;
+      accc=0;
     }
   }
   
+  stobus_drop_pending(stobus);
   stobus->dirty=0;
   return 0;
 }
@@ -219,6 +297,8 @@ void stobus_clear_hard(struct stobus *stobus) {
   struct stobus_field *field=stobus->fieldv;
   int i=stobus->fieldc;
   for (;i-->0;field++) field->v=0;
+  stobus_drop_pending(stobus);
+  stobus->dirty=1;
 }
 
 /* Field list.
@@ -255,6 +335,8 @@ struct stobus_field *stobus_fieldv_insert(struct stobus *stobus,int p,int id) {
   field->id=id;
   field->c=0;
   field->v=0;
+  field->pending=0;
+  field->pendingv=0;
   return field;
 }
 
@@ -262,12 +344,23 @@ struct stobus_field *stobus_fieldv_insert(struct stobus *stobus,int p,int id) {
  */
 
 int stobus_listenerv_search(const struct stobus *stobus,int id) {
+  const struct stobus_listener *listener=stobus->listenerv;
+  int i=0;
+  for (;i<stobus->listenerc;i++,listener++) {
+    if (listener->listenerid==id) return i;
+  }
+  return -1;
+}
+
+int stobus_listenerv_search_field(const struct stobus *stobus,int fldid,int listenerid) {
   int lo=0,hi=stobus->listenerc;
   while (lo<hi) {
     int ck=(lo+hi)>>1;
     const struct stobus_listener *listener=stobus->listenerv+ck;
-         if (id<listener->listenerid) hi=ck;
-    else if (id>listener->listenerid) lo=ck+1;
+         if (fldid<listener->fldid) hi=ck;
+    else if (fldid>listener->fldid) lo=ck+1;
+    else if (listenerid<listener->listenerid) hi=ck;
+    else if (listenerid>listener->listenerid) lo=ck+1;
     else return ck;
   }
   return -lo-1;
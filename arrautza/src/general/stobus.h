@@ -31,10 +31,22 @@ void stobus_unlisten(struct stobus *stobus,int listenerid);
  * eg if the size is 8 bits and you set v=300, we write out v=255.
  * Setting a zero-size field to any value triggers an event.
  * For nonzero size, events are only triggered if the value changed.
+ * Listeners for a field are called newest first.
  */
 int stobus_get(struct stobus *stobus,int id);
 void stobus_set(struct stobus *stobus,int id,int v);
 
+/* In deferred mode, stobus_set() changes the value immediately but holds notifications until stobus_flush().
+ * Each field with state notifies at most once per flush, with its final value, in the order they were first set.
+ * A field with state that ended up where it started doesn't notify at all.
+ * Stateless fields are events, so every set notifies, with its own value, in order among the rest.
+ * Listeners may set more fields during flush; we'll catch those too, up to a sensible limit.
+ * If we run out of memory for the queue, that notification goes out immediately instead.
+ * Turning deferred mode off flushes.
+ */
+void stobus_set_deferred(struct stobus *stobus,int deferred);
+void stobus_flush(struct stobus *stobus);
+
 /* Serial content is base64.
  * You must define all fields first, separately. That schema is not part of the state.
  * We have a (dirty) flag that gets set when any field changes. You should clear it after encoding and saving.
@@ -44,6 +56,7 @@ int stobus_encode(char *dst,int dsta,const struct stobus *stobus);
 int stobus_decode(struct stobus *stobus,const char *src,int srcc);
 
 /* Reset all state to zero and do not fire any notifications.
+ * This does set (dirty), so the cleared state gets saved.
  */
 void stobus_clear_hard(struct stobus *stobus);
 
@@ -52,10 +65,13 @@ void stobus_clear_hard(struct stobus *stobus);
 
 struct stobus {
   int dirty;
+  int deferred;
   struct stobus_field {
     int id;
     int c; // bits
     int v;
+    int pending; // Deferred mode, fields with state only: Nonzero if in (pendingv).
+    int pendingv; // Deferred mode, fields with state only: Value before the first change.
   } *fieldv;
   int fieldc,fielda;
   struct stobus_listener {
@@ -63,13 +79,21 @@ struct stobus {
     int fldid;
     void (*cb)(int id,int v,void *userdata);
     void *userdata;
-  } *listenerv;
+  } *listenerv; // Sorted by (fldid,listenerid).
   int listenerc,listenera;
+  int listenerid_next;
+  struct stobus_pending {
+    int id;
+    int v; // Stateless fields only, the value provided. Fields with state notify with their current value.
+  } *pendingv; // Awaiting notification, in deferred mode.
+  int pendingc,pendinga;
 };
 
 int stobus_fieldv_search(const struct stobus *stobus,int id);
 struct stobus_field *stobus_fieldv_insert(struct stobus *stobus,int p,int id);
 
+// Listeners are sorted by field, so searching by ID alone is linear.
 int stobus_listenerv_search(const struct stobus *stobus,int id);
+int stobus_listenerv_search_field(const struct stobus *stobus,int fldid,int listenerid);
 
 #endif
@@ -0,0 +1,72 @@
+#include "../arrautza.h"
+#include "map.h"
+
+/* Decoded tilesheets, keyed by imageid.
+ * There's only a handful of tilesheets in the game, so like sprdefs, once decoded they stay forever.
+ */
+
+static struct tilesheet **tilesheetv=0;
+static int tilesheetc=0,tilesheeta=0;
+
+static int tilesheetv_search(int imageid) {
+  int lo=0,hi=tilesheetc;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+    const struct tilesheet *q=tilesheetv[ck];
+         if (imageid<q->imageid) hi=ck;
+    else if (imageid>q->imageid) lo=ck+1;
+    else return ck;
+  }
+  return -lo-1;
+}
+
+static int tilesheetv_insert(int p,struct tilesheet *tilesheet) {
+  if ((p<0)||(p>tilesheetc)||!tilesheet) return -1;
+  if (p&&(tilesheet->imageid<=tilesheetv[p-1]->imageid)) return -1;
+  if ((p<tilesheetc)&&(tilesheet->imageid>=tilesheetv[p]->imageid)) return -1;
+  if (tilesheetc>=tilesheeta) {
+    int na=tilesheeta+16;
+    if (na>INT_MAX/sizeof(void*)) return -1;
+    void *nv=realloc(tilesheetv,sizeof(void*)*na);
+    if (!nv) return -1;
+    tilesheetv=nv;
+    tilesheeta=na;
+  }
+  memmove(tilesheetv+p+1,tilesheetv+p,sizeof(void*)*(tilesheetc-p));
+  tilesheetv[p]=tilesheet;
+  tilesheetc++;
+  return 0;
+}
+
+/* Decode.
+ */
+
+static struct tilesheet *tilesheet_decode(int imageid) {
+  uint8_t serial[256];
+  int serialc=egg_res_get(serial,sizeof(serial),EGG_RESTYPE_tilesheet,0,imageid);
+  if ((serialc<1)||(serialc>sizeof(serial))) {
+    egg_log("WARNING: No tilesheet for image:0:%d",imageid);
+    return 0;
+  }
+  struct tilesheet *tilesheet=calloc(1,sizeof(struct tilesheet));
+  if (!tilesheet) return 0;
+  tilesheet->imageid=imageid;
+  memcpy(tilesheet->physics,serial,serialc);
+  return tilesheet;
+}
+
+/* Get tilesheet, public entry point.
+ */
+
+const struct tilesheet *tilesheet_get(int imageid) {
+  int p=tilesheetv_search(imageid);
+  if (p>=0) return tilesheetv[p];
+  p=-p-1;
+  struct tilesheet *tilesheet=tilesheet_decode(imageid);
+  if (!tilesheet) return 0;
+  if (tilesheetv_insert(p,tilesheet)<0) {
+    free(tilesheet);
+    return 0;
+  }
+  return tilesheet;
+}
@@ -1,18 +1,5 @@
 #include "arrautza.h"
 
-/* Load image for new map.
- */
- 
-static int load_map_image(uint16_t imageid) {
-  if (imageid==g.imageid_tilesheet) return 0;
-  g.imageid_tilesheet=imageid;
-  if (egg_texture_load_image(g.texid_tilesheet,0,imageid)<0) {
-    egg_log("Error loading image:%d for map:%d",imageid,g.mapid);
-    return -1;
-  }
-  return 0;
-}
-
 /* Spawn sprite in new map.
  */
  
@@ -30,6 +17,42 @@ static int load_map_sprite(const uint8_t *cmd) {
   return 0;
 }
 
+/* Before spawning a map's sprites, reserve pool space for all of them, so they come out of adjacent slabs.
+ */
+ 
+struct prewarm_context {
+  struct prewarm_size { int objlen,count; } sizev[16];
+  int sizec;
+};
+ 
+static int prewarm_sprites_cb(const uint8_t *cmd,int cmdc,void *userdata) {
+  struct prewarm_context *ctx=userdata;
+  const struct sprdef *sprdef=sprdef_get((cmd[3]<<8)|cmd[4]);
+  if (!sprdef||!sprdef->sprctl) return 0;
+  int objlen=sprdef->sprctl->objlen;
+  struct prewarm_size *size=ctx->sizev;
+  int i=ctx->sizec;
+  for (;i-->0;size++) {
+    if (size->objlen==objlen) {
+      size->count++;
+      return 0;
+    }
+  }
+  if (ctx->sizec>=16) return 0;
+  size=ctx->sizev+ctx->sizec++;
+  size->objlen=objlen;
+  size->count=1;
+  return 0;
+}
+
+static void prewarm_sprites() {
+  struct prewarm_context ctx={0};
+  map_for_each_command_of(&g.map,&g.mapindex,MAPCMD_sprite,prewarm_sprites_cb,&ctx);
+  const struct prewarm_size *size=ctx.sizev;
+  int i=ctx.sizec;
+  for (;i-->0;size++) sprite_pool_reserve(size->objlen,size->count);
+}
+
 /* Read command for newly-loaded map.
  */
  
@@ -42,30 +65,17 @@ static int load_map_cb(const uint8_t *cmd,int cmdc,void *userdata) {
   switch (cmd[0]) {
     
     // Call out commands that need some action taken at load.
-    // Other things we can ignore. One can reread the commands at any time, it's cheap.
+    // Other things we can ignore. Anyone who needs them later should look them up via (g.mapindex), not rescan the map.
+    // Image, walls, and the command index were prepared by the prefetcher.
     case MAPCMD_hero: ctx->herox=cmd[1]+0.5; ctx->heroy=cmd[2]+0.5; break;
     case MAPCMD_song: egg_audio_play_song(0,(cmd[1]<<8)|cmd[2],0,1); break;
-    case MAPCMD_image: return load_map_image((cmd[1]<<8)|cmd[2]);
     case MAPCMD_sprite: return load_map_sprite(cmd);
     case MAPCMD_ucoord: g.ucoordx=(cmd[1]<<8)|cmd[2]; g.ucoordy=(cmd[3]<<8)|cmd[4]; break;
-    
-    // All commands that begin with a position and need recorded in poibits.
-    // We're just marking the cell as "interesting", so when the hero steps here
-    // he can very quickly know whether to read all the commands again.
-    case MAPCMD_door:
-      {
-        uint8_t col=cmd[1];
-        uint8_t row=cmd[2];
-        if ((col<COLC)&&(row<ROWC)) {
-          int p=row*COLC+col;
-          g.poibits[p>>3]|=0x80>>(p&7);
-        }
-      } break;
   }
   return 0;
 }
 
-/* Should we remove hero, when rendering the "from" frame for this transition?
+/* Should we remove hero from the "from" frame for this transition?
  * I think only the PANs will want yes.
  */
  
@@ -80,6 +90,24 @@ static int transition_should_hide_hero(int transition) {
   return 0;
 }
 
+/* Paint the map layer back over a sprite in the outgoing frame.
+ * Much cheaper than rendering the whole scene again without it.
+ * We go a tile beyond its bounds, for heads and swords. Anything else in that region gets erased too; it's only for half a second.
+ * Must happen before the map layer gets redrawn for the new map.
+ */
+ 
+static void transition_erase_sprite(int texid,const struct sprite *sprite) {
+  if (!sprite->bvalid) return;
+  int x=sprite->bx-TILESIZE,y=sprite->by-TILESIZE;
+  int w=sprite->bw+(TILESIZE<<1),h=sprite->bh+(TILESIZE<<1);
+  if (x<0) { w+=x; x=0; }
+  if (y<0) { h+=y; y=0; }
+  if (x+w>SCREENW) w=SCREENW-x;
+  if (y+h>SCREENH) h=SCREENH-y;
+  if ((w<1)||(h<1)) return;
+  draw_decal(texid,g.texid_maplayer,x,y,x,y,w,h,0);
+}
+
 /* Apply navigation immediately. Private: Must be reached via check_map_change().
  */
  
@@ -94,15 +122,13 @@ static int apply_map_change(uint16_t mapid,int dstx,int dsty,int transition) {
     sprgrp_remove(sprgrpv+SPRGRP_KEEPALIVE,hero); // Don't drop his groups!
   }
   
-  // If a transition was requested, redraw the scene into a temporary texture.
+  // If a transition was requested, the frame we rendered last becomes the outgoing one, and new frames go to the other texture.
   if (transition) {
-    g.renderx=g.rendery=0;
-    render_map(g.texid_transtex);
-    if (transition_should_hide_hero(transition)) {
-      sprgrp_remove(sprgrpv+SPRGRP_RENDER,hero);
+    g.texid_transtex=g.texid_worldv[g.worldp];
+    g.worldp^=1;
+    if (hero&&transition_should_hide_hero(transition)) {
+      transition_erase_sprite(g.texid_transtex,hero);
     }
-    sprgrp_render(g.texid_transtex,sprgrpv+SPRGRP_RENDER);
-    sprgrp_add(sprgrpv+SPRGRP_RENDER,hero);
     
     /* Transition time and intermediate color (FADE_BLACK and SPOTLIGHT) are hard-coded here.
      * You can change them universally right here, or figure out a more nuanced decision process if you want them variable.
@@ -128,29 +154,24 @@ static int apply_map_change(uint16_t mapid,int dstx,int dsty,int transition) {
   // Drop all the sprites. We're holding a STRONG reference to (hero), so it's not affected.
   sprgrp_kill(sprgrpv+SPRGRP_KEEPALIVE);
   
-  // Acquire the map and run its commands.
+  // Acquire the map, with its walls and tilesheet, and run its commands.
   g.mapnext.mapid=0;
-  g.mapid=mapid;
-  memset(g.poibits,0,sizeof(g.poibits));
-  int c=egg_res_get(&g.map,sizeof(g.map),EGG_RESTYPE_map,0,mapid);
-  if ((c<COLC*ROWC)||(c>sizeof(struct map))) {
-    egg_log("Invalid size %d for map:%d. Must be in %d..%d.",c,mapid,COLC*ROWC,(int)sizeof(struct map));
+  if (prefetch_take_map(mapid)<0) {
     sprite_del(hero);
     return -1;
   }
-  memset(((char*)&g.map)+c,0,sizeof(struct map)-c);
+  map_dirty_all();
+  g.mapid=mapid;
   struct load_map_context ctx={
     .herox=COLC*0.5,
     .heroy=ROWC*0.5,
   };
+  prewarm_sprites();
   if (map_for_each_command(&g.map,load_map_cb,&ctx)<0) {
     sprite_del(hero);
     return -1;
   }
   
-  // Let physics rebuild its view of static walls.
-  physics_rebuild_map();
-  
   // Create the hero if we don't have one yet, and position it as needed.
   // The hero sprite instance stays alive across map loads.
   if (!hero) {
@@ -204,7 +225,7 @@ int load_map(uint16_t mapid,int dstx,int dsty,int transition) {
  */
  
 int load_neighbor(uint8_t mapcmd) {
-  int mapid=map_get_command(&g.map,mapcmd);
+  int mapid=map_index_get_command(&g.mapindex,&g.map,mapcmd);
   if (mapid<1) return -1;
   int transition=TRANSITION_NONE;
   switch (mapcmd) {
@@ -219,9 +240,10 @@ int load_neighbor(uint8_t mapcmd) {
 /* Reset.
  */
  
-int reset_game() {
+int reset_game(int resume) {
   sprgrp_kill(sprgrpv+SPRGRP_HERO);
   stobus_clear_hard(&g.stobus);
+  if (resume) autosave_load(); // On failure, stobus is untouched: still clear, and dirty.
   
   g.mapid=0;
   g.game_over=0;
@@ -241,17 +263,31 @@ int reset_game() {
   return 0;
 }
 
-/* Render map.
+/* Invalidate the map layer.
  */
  
-void render_map(int dsttexid) {
+void map_dirty_cell(int col,int row) {
+  if ((col<0)||(row<0)||(col>=COLC)||(row>=ROWC)) return;
+  g.maplayer_dirty=1;
+}
+
+void map_dirty_all() {
+  g.maplayer_dirty=1;
+}
+
+/* Redraw the map layer from scratch.
+ * Tiles might not be opaque, so we can't just paint over one cell. It's a single draw call anyway.
+ */
+ 
+static void map_layer_refresh() {
+  g.maplayer_dirty=0;
   struct egg_draw_tile vtxv[COLC*ROWC];
   struct egg_draw_tile *vtx=vtxv;
-  int y=(TILESIZE>>1)+g.rendery;
+  int y=TILESIZE>>1;
   int yi=ROWC;
   const uint8_t *src=g.map.v;
   for (;yi-->0;y+=TILESIZE) {
-    int x=(TILESIZE>>1)+g.renderx;
+    int x=TILESIZE>>1;
     int xi=COLC;
     for (;xi-->0;x+=TILESIZE,vtx++,src++) {
       vtx->x=x;
@@ -260,7 +296,16 @@ void render_map(int dsttexid) {
       vtx->xform=0;
     }
   }
-  egg_draw_tile(dsttexid,g.texid_tilesheet,vtxv,COLC*ROWC);
+  draw_clear(g.texid_maplayer);
+  draw_tile(g.texid_maplayer,g.texid_tilesheet,vtxv,COLC*ROWC);
+}
+
+/* Render map.
+ */
+ 
+void render_map(int dsttexid) {
+  if (g.maplayer_dirty) map_layer_refresh();
+  draw_decal(dsttexid,g.texid_maplayer,0,0,0,0,SCREENW,SCREENH,0);
 }
 
 /* Update footing for sprites in group.
@@ -287,21 +332,26 @@ void check_sprites_footing(struct sprgrp *sprgrp) {
 void check_sprites_heronotify(struct sprgrp *observers,struct sprgrp *heroes) {
   if ((observers->sprc<1)||(heroes->sprc<1)) return;
   int hi=heroes->sprc;
-  while (hi-->0) physics_refresh_aabb(heroes->sprv[hi]);
-  int oi=observers->sprc;
-  while (oi-->0) {
-    struct sprite *observer=observers->sprv[oi];
-    if (!observer->sprctl||!observer->sprctl->heronotify) continue; // why did you join this group...
-    physics_refresh_aabb(observer);
-    hi=heroes->sprc;
-    while (hi-->0) {
-      struct sprite *hero=heroes->sprv[hi];
-      if (observer->aabb.l>=hero->aabb.r) continue;
-      if (observer->aabb.r<=hero->aabb.l) continue;
-      if (observer->aabb.t>=hero->aabb.b) continue;
-      if (observer->aabb.b<=hero->aabb.t) continue;
+  while (hi-->0) {
+    struct sprite *hero=heroes->sprv[hi];
+    physics_refresh_aabb(hero);
+    struct sprite *observerv_local[16];
+    struct sprite **observerv=observerv_local;
+    int observerc=sprgrp_query_aabb(observerv,16,observers,hero->aabb.l,hero->aabb.t,hero->aabb.r,hero->aabb.b);
+    if (observerc>16) {
+      if (!(observerv=malloc(sizeof(void*)*observerc))) return;
+      int observera=observerc;
+      observerc=sprgrp_query_aabb(observerv,observera,observers,hero->aabb.l,hero->aabb.t,hero->aabb.r,hero->aabb.b);
+      if (observerc>observera) observerc=observera;
+    }
+    int oi=observerc;
+    while (oi-->0) {
+      struct sprite *observer=observerv[oi];
+      if (!observer->sprctl||!observer->sprctl->heronotify) continue; // why did you join this group...
+      physics_refresh_aabb(observer);
       observer->sprctl->heronotify(observer,hero);
     }
+    if (observerv!=observerv_local) free(observerv);
   }
 }
 
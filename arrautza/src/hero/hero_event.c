@@ -32,10 +32,9 @@ void hero_footing(struct sprite *sprite,int8_t pvcol,int8_t pvrow) {
   if (sprite->row<0)     { load_neighbor(MAPCMD_neighborn); return; }
   if (sprite->row>=ROWC) { load_neighbor(MAPCMD_neighbors); return; }
   
-  // Anything else we do at footing, the cell must be marked in poibits, and it's driven by a map command.
-  int p=sprite->row*COLC+sprite->col;
-  if (!(g.poibits[p>>3]&(0x80>>(p&7)))) return;
-  map_for_each_command(&g.map,hero_footing_cb,sprite);
+  // Anything else we do at footing is driven by a POI command at this cell.
+  if (!map_index_has_poi(&g.mapindex,sprite->col,sprite->row)) return;
+  map_for_each_command_at(&g.map,&g.mapindex,sprite->col,sprite->row,hero_footing_cb,sprite);
 }
 
 /* Collision.
@@ -45,10 +44,11 @@ void hero_collision(struct sprite *sprite,struct sprite *other,uint8_t dir,int p
   if (dir==SPRITE->facedir) {
     if (other) { // It's a sprite, so always enter the "push" face.
       SPRITE->pushing=1;
-      if (other==SPRITE->pushsprite) {
+      uint32_t handle=sprite_handle(other);
+      if (handle==SPRITE->pushsprite) {
         SPRITE->pushsprite_again=1;
       } else if (!SPRITE->pushsprite) {
-        SPRITE->pushsprite=other;
+        SPRITE->pushsprite=handle;
         SPRITE->pushsprite_time=0;
         SPRITE->pushsprite_again=1;
       }
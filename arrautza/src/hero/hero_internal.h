@@ -17,7 +17,7 @@ struct sprite_hero {
   int animframe;
   int pushing; // Clear on update, then it gets set during physics resolution.
   double motion_blackout; // Motion is suppressed until this counts down.
-  struct sprite *pushsprite; // WEAK, for identification only. DO NOT DEREFERENCE.
+  uint32_t pushsprite; // Handle.
   double pushsprite_time; // How long has (pushsprite) been colliding?
   int pushsprite_again; // Set by hero_collision() if (pushsprite) is still in a state of collision.
   uint8_t aitem,bitem; // Nonzero only if an action is in progress.
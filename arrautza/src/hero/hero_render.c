@@ -24,11 +24,11 @@ static void hero_render_twotile(
   else heady-=8;
   // Head first when facing north, otherwise body first.
   if (headfirst) {
-    tile_renderer_tile(&g.tile_renderer,x,heady,headtileid,headxform);
-    tile_renderer_tile(&g.tile_renderer,x,y,bodytileid,bodyxform);
+    sprite_render_tile(x,heady,headtileid,headxform);
+    sprite_render_tile(x,y,bodytileid,bodyxform);
   } else {
-    tile_renderer_tile(&g.tile_renderer,x,y,bodytileid,bodyxform);
-    tile_renderer_tile(&g.tile_renderer,x,heady,headtileid,headxform);
+    sprite_render_tile(x,y,bodytileid,bodyxform);
+    sprite_render_tile(x,heady,headtileid,headxform);
   }
 }
 
@@ -48,13 +48,13 @@ static void hero_render_sword(struct sprite *sprite) {
     case DIR_W: swordx-=12; swordy-=2; headtileid=0x12; bodytileid=0x22; swordxform=EGG_XFORM_SWAP|EGG_XFORM_YREV; break;
     case DIR_E: swordx+=12; swordy-=2; headtileid=0x12; bodytileid=0x22; xform=EGG_XFORM_XREV; swordxform=EGG_XFORM_SWAP|EGG_XFORM_XREV; break;
   }
-  tile_renderer_tile(&g.tile_renderer,swordx,swordy,0x30,swordxform);
+  sprite_render_tile(swordx,swordy,0x30,swordxform);
   if (SPRITE->facedir==DIR_N) {
-    tile_renderer_tile(&g.tile_renderer,x,heady,headtileid,xform);
-    tile_renderer_tile(&g.tile_renderer,x,y,bodytileid,xform);
+    sprite_render_tile(x,heady,headtileid,xform);
+    sprite_render_tile(x,y,bodytileid,xform);
   } else {
-    tile_renderer_tile(&g.tile_renderer,x,y,bodytileid,xform);
-    tile_renderer_tile(&g.tile_renderer,x,heady,headtileid,xform);
+    sprite_render_tile(x,y,bodytileid,xform);
+    sprite_render_tile(x,heady,headtileid,xform);
   }
   // 4-frame swash to create an illusion of having been swung from the right.
   int swashframe=(int)((SPRITE->swordtime*4.0)/0.120);
@@ -66,7 +66,7 @@ static void hero_render_sword(struct sprite *sprite) {
       case DIR_W: swashy-=10; swashx+=4; break;
       case DIR_E: swashy+=10; swashx-=4; break;
     }
-    tile_renderer_tile(&g.tile_renderer,swashx,swashy,0x31+swashframe,swordxform);
+    sprite_render_tile(swashx,swashy,0x31+swashframe,swordxform);
   }
 }
 
@@ -85,8 +85,8 @@ static void hero_render_shield(struct sprite *sprite) {
     case DIR_W: headtileid=0x02; bodytileid=0x42; break;
     case DIR_E: headtileid=0x02; bodytileid=0x42; xform=EGG_XFORM_XREV; break;
   }
-  tile_renderer_tile(&g.tile_renderer,x,y,bodytileid,xform);
-  tile_renderer_tile(&g.tile_renderer,x,heady,headtileid,xform);
+  sprite_render_tile(x,y,bodytileid,xform);
+  sprite_render_tile(x,heady,headtileid,xform);
 }
 
 /* Render.
@@ -104,7 +104,7 @@ void hero_render(int dsttexid,struct sprite *sprite) {
     if (frame&1) tint=0xff000080;
     else tint=0xffffff80;
   }
-  tile_renderer_begin(&g.tile_renderer,texid,tint,alpha);
+  sprite_render_begin(texid,tint,alpha);
   
   // Sword is highly significant so it gets priority.
   if (hero_item_in_use(sprite,ITEM_SWORD)) {
@@ -126,7 +126,6 @@ void hero_render(int dsttexid,struct sprite *sprite) {
       case DIR_E: hero_render_twotile(sprite,0x05,EGG_XFORM_XREV,0x02,EGG_XFORM_XREV,0); break;
     }
   }
-  tile_renderer_end(&g.tile_renderer);
 }
 
 /* Calculate visible bounds.
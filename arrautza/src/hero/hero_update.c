@@ -61,7 +61,7 @@ void hero_update(struct sprite *sprite,double elapsed) {
     SPRITE->pushsprite_time+=elapsed;
     if (SPRITE->pushsprite_time>=HERO_PUSH_ACTIVATION_TIME) {
       SPRITE->pushsprite_time-=HERO_PUSH_ACTIVATION_TIME;
-      if (sprite_pushtrigger_activate(sprite_if_alive(SPRITE->pushsprite),sprite,SPRITE->facedir)) {
+      if (sprite_pushtrigger_activate(sprite_from_handle(SPRITE->pushsprite),sprite,SPRITE->facedir)) {
         SPRITE->indx=0;
         SPRITE->indy=0;
         SPRITE->animframe=0;
@@ -23,6 +23,25 @@ static int _hero_init(struct sprite *sprite) {
   return 0;
 }
 
+/* Savestate.
+ * All plain data except (pushsprite).
+ */
+ 
+static int _hero_save(void *dst,int dsta,struct sprite *sprite) {
+  struct sprite_hero tmp=*SPRITE;
+  tmp.pushsprite=savestate_handle_save(tmp.pushsprite);
+  int dstc=sizeof(tmp)-sizeof(struct sprite);
+  if (dstc<=dsta) memcpy(dst,(char*)&tmp+sizeof(struct sprite),dstc);
+  return dstc;
+}
+
+static int _hero_load(struct sprite *sprite,const void *src,int srcc) {
+  if (srcc!=sizeof(struct sprite_hero)-sizeof(struct sprite)) return -1;
+  memcpy((char*)sprite+sizeof(struct sprite),src,srcc);
+  SPRITE->pushsprite=savestate_handle_load(SPRITE->pushsprite);
+  return 0;
+}
+
 /* Type definition.
  */
  
@@ -45,4 +64,6 @@ const struct sprctl sprctl_hero={
   .footing=hero_footing,
   .collision=hero_collision,
   .damage=hero_damage,
+  .save=_hero_save,
+  .load=_hero_load,
 };
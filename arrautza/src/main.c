@@ -38,7 +38,14 @@ struct item_metadata item_metadata[1+ITEM_COUNT]={
  **************************************************************************/
 
 void egg_client_quit() {
+  replay_record_save();
   inkeep_quit();
+  if (ARRAUTZA_DEBUG) {
+    sprite_pool_report();
+    prefetch_report();
+    profiler_report();
+    drawstats_report();
+  }
 }
 
 /* Input callbacks.
@@ -56,14 +63,71 @@ static void toggle_pause() {
   }
 }
 
+static void on_joy(int btnid,int value,int state) {
+  g.instate=state;
+  switch (btnid) {
+    case INKEEP_BTNID_AUX1: if (value) toggle_pause(); break;
+    case INKEEP_BTNID_RP: case INKEEP_BTNID_R2: if (value) egg_request_termination(); break;
+  }
+}
+
+// During replay, real input is ignored. replay_step() calls on_joy() instead.
 static void cb_joy(int plrid,int btnid,int value,int state,void *userdata) {
   //egg_log("%s %d.0x%04x=%d [0x%04x]",__func__,plrid,btnid,value,state);
-  if (!plrid) {
-    g.instate=state;
-    switch (btnid) {
-      case INKEEP_BTNID_AUX1: if (value) toggle_pause(); break;
-      case INKEEP_BTNID_RP: case INKEEP_BTNID_R2: if (value) egg_request_termination(); break;
-    }
+  if (!plrid&&!replay_playing()) {
+    replay_record_state(state);
+    on_joy(btnid,value,state);
+  }
+}
+
+/* Quick-save and quick-load, with F5 and F9.
+ * Only during uninterrupted play. The snapshot lives in memory, one slot.
+ */
+static void *quicksave=0;
+static int quicksavec=0;
+
+static int quicksave_permitted() {
+  if (g.menuc||g.game_over||g.mapnext.mapid||!g.mapid) return 0;
+  return 1;
+}
+
+static void quicksave_save() {
+  if (!quicksave_permitted()) return;
+  const void *src=0;
+  int srcc=savestate_encode(&src);
+  if (srcc<0) {
+    egg_log("Failed to encode savestate.");
+    return;
+  }
+  void *nv=malloc(srcc?srcc:1);
+  if (!nv) return;
+  memcpy(nv,src,srcc);
+  if (quicksave) free(quicksave);
+  quicksave=nv;
+  quicksavec=srcc;
+  egg_log("Saved state, %d bytes.",srcc);
+}
+
+static void quicksave_load() {
+  if (!quicksave||!quicksave_permitted()) return;
+  int err=savestate_decode(quicksave,quicksavec);
+  if (err==-2) {
+    egg_log("Savestate rejected. Continuing as before.");
+    return;
+  }
+  if (err<0) {
+    egg_log("Failed to restore savestate. Resetting game.");
+    reset_game(0);
+    return;
+  }
+  g.renderlerp=1.0;
+}
+
+// Keys that change game state must go through here, so they get recorded.
+static void on_key(int keycode) {
+  switch (keycode) {
+    case KEY_F5: quicksave_save(); break;
+    case KEY_F9: quicksave_load(); break;
   }
 }
 
@@ -71,10 +135,44 @@ static void cb_raw(const union egg_event *event,void *userdata) {
   switch (event->type) {
     case EGG_EVENT_KEY: if (event->key.value) switch (event->key.keycode) {
         case KEY_ESCAPE: egg_request_termination(); break;
+        case KEY_F7: replay_record_save(); break;
+        case KEY_F3: case KEY_F4: profiler_key(event->key.keycode); break;
+        case KEY_F5: case KEY_F9: if (!replay_playing()) {
+            replay_record_key(event->key.keycode);
+            on_key(event->key.keycode);
+          } break;
       } break;
   }
 }
 
+/* Apply one frame of the replay: Take its (elapsed), and feed its events to on_joy() and on_key().
+ * Recorded states usually differ from the last by one bit, but if not, we report each bit separately, like inkeep would.
+ * When the replay runs out, we terminate.
+ */
+static void replay_step(double *elapsed) {
+  struct replay_event eventv[32];
+  int eventc=replay_play_frame(elapsed,eventv,sizeof(eventv)/sizeof(eventv[0]));
+  if (eventc<0) {
+    egg_log("Replay finished after %d frames.",replay_get_frame_count());
+    egg_request_termination();
+    *elapsed=0.0;
+    return;
+  }
+  const struct replay_event *event=eventv;
+  for (;eventc-->0;event++) {
+    if (event->type=='k') {
+      on_key(event->v);
+    } else {
+      int state=g.instate,btnid=1;
+      for (;btnid<=0x8000;btnid<<=1) {
+        if (!((state^event->v)&btnid)) continue;
+        state^=btnid;
+        on_joy(btnid,(state&btnid)?1:0,state);
+      }
+    }
+  }
+}
+
 static void cb_state(int id,int v,void *userdata) {//XXX troubleshooting only
   egg_log("%s:%d:%s: %d=%d",__FILE__,__LINE__,__func__,id,v);
 }
@@ -106,8 +204,10 @@ int egg_client_init() {
   inkeep_listen_joy(cb_joy,0);
   inkeep_listen_raw(cb_raw,0);
   
-  if ((g.texid_tilesheet=egg_texture_new())<0) return -1;
-  if (egg_texture_upload(g.texid_transtex=egg_texture_new(),SCREENW,SCREENH,SCREENW<<2,EGG_TEX_FMT_RGBA,0,0)<0) return -1;
+  if (egg_texture_upload(g.texid_worldv[0]=egg_texture_new(),SCREENW,SCREENH,SCREENW<<2,EGG_TEX_FMT_RGBA,0,0)<0) return -1;
+  if (egg_texture_upload(g.texid_worldv[1]=egg_texture_new(),SCREENW,SCREENH,SCREENW<<2,EGG_TEX_FMT_RGBA,0,0)<0) return -1;
+  g.texid_transtex=g.texid_worldv[1];
+  if (egg_texture_upload(g.texid_maplayer=egg_texture_new(),SCREENW,SCREENH,SCREENW<<2,EGG_TEX_FMT_RGBA,0,0)<0) return -1;
   if (egg_texture_load_image(g.texid_spotlight=egg_texture_new(),0,RID_image_spotlight)<0) return -1;
   if (egg_texture_load_image(g.texid_font_tiles=egg_texture_new(),0,RID_image_font_tiles)<0) return -1;
   if (!(g.font=font_new(9))) return -1;
@@ -116,13 +216,24 @@ int egg_client_init() {
   font_add_page(g.font,RID_image_font_9h_400,0x0400);
   
   sprgrpv_init();
-  srand_auto();
+  
+  // Choose a seed and record it, or take it from the replay.
+  if (replay_playing()) {
+    srand(replay_get_seed());
+  } else {
+    srand_auto();
+    int seed=rand();
+    if (!seed) seed=1;
+    srand(seed);
+    replay_record_begin(seed);
+  }
   
   if (define_stobus_fields()<0) return -1;
   stobus_listen(&g.stobus,FLD_dialogue,cb_dialogue,0);
+  stobus_set_deferred(&g.stobus,1); // Notifications go out at well-defined points in egg_client_update().
   
   if (0) { // XXX During development I prefer to skip the main menu.
-    if (reset_game()<0) {
+    if (reset_game(0)<0) {
       egg_log("reset_game failed!");
       return -1;
     }
@@ -139,10 +250,58 @@ int egg_client_init() {
 }
 
 /* Update.
+ * The game proper advances in fixed steps of UPDATE_STEP, however long the frames are.
+ * So physics comes out the same regardless of frame rate, and a long frame can't carry anyone past a trigger.
+ * If we fall more than UPDATE_STEP_LIMIT steps behind, drop the excess: The game slows down instead of spiraling.
+ * Menus, the compass, and input still run once per frame on the real elapsed time.
  ******************************************************************************/
 
+#define UPDATE_STEP (1.0/120.0)
+#define UPDATE_STEP_LIMIT 8
+
+static double update_pending=0.0; // Real time not yet simulated.
+
+static void update_game_step(double elapsed) {
+  if (g.transclock>0.0) {
+    if ((g.transclock-=elapsed)<=0.0) {
+      // Transition completed. Probably nothing we need to do.
+    }
+  }
+  profiler_begin(PROFILER_PHASE_sprupdate);
+  sprgrp_save_positions(sprgrpv+SPRGRP_RENDER);
+  sprgrp_update(sprgrpv+SPRGRP_UPDATE,elapsed,0);
+  profiler_end(PROFILER_PHASE_sprupdate);
+  profiler_begin(PROFILER_PHASE_physics);
+  physics_update(sprgrpv+SPRGRP_SOLID,elapsed);
+  profiler_end(PROFILER_PHASE_physics);
+  profiler_begin(PROFILER_PHASE_footing);
+  check_sprites_footing(sprgrpv+SPRGRP_FOOTING);
+  profiler_end(PROFILER_PHASE_footing);
+  profiler_begin(PROFILER_PHASE_heronotify);
+  check_sprites_heronotify(sprgrpv+SPRGRP_HERONOTIFY,sprgrpv+SPRGRP_HERO);
+  profiler_end(PROFILER_PHASE_heronotify);
+  // Any non-sprite update stuff goes here.
+  profiler_begin(PROFILER_PHASE_deathrow);
+  sprgrp_kill(sprgrpv+SPRGRP_DEATHROW);
+  profiler_end(PROFILER_PHASE_deathrow);
+  profiler_begin(PROFILER_PHASE_mapchange);
+  stobus_flush(&g.stobus);
+  check_map_change();
+  profiler_end(PROFILER_PHASE_mapchange);
+}
+
 void egg_client_update(double elapsed) {
-  inkeep_update(elapsed);
+  double starttime=egg_time_real();
+  profiler_frame_begin();
+  profiler_begin(PROFILER_PHASE_input);
+  if (replay_playing()) {
+    inkeep_update(elapsed);
+    replay_step(&elapsed);
+  } else {
+    replay_record_frame(elapsed);
+    inkeep_update(elapsed);
+  }
+  profiler_end(PROFILER_PHASE_input);
   
   // The compass is passive. It gets updated every frame if it might be visible.
   // ie, it's selected or the pause menu is open.
@@ -154,6 +313,7 @@ void egg_client_update(double elapsed) {
   
   // When a menu is open, the one on top is basically the only thing active.
   if (g.menuc) {
+    profiler_begin(PROFILER_PHASE_menu);
     struct menu *menu=g.menuv[g.menuc-1];
     if (menu->update) menu->update(menu,elapsed);
     int i=g.menuc-1;
@@ -163,6 +323,9 @@ void egg_client_update(double elapsed) {
     }
     reap_defunct_menus();
     sprgrp_update(sprgrpv+SPRGRP_UPDATE,elapsed,1);
+    update_pending=0.0;
+    g.renderlerp=1.0;
+    profiler_end(PROFILER_PHASE_menu);
     
   // If the game_over flag is set, reopen the hello menu.
   } else if (g.game_over) {
@@ -172,35 +335,57 @@ void egg_client_update(double elapsed) {
   
   // No menu, normal game update.
   } else {
-    if (g.transclock>0.0) {
-      if ((g.transclock-=elapsed)<=0.0) {
-        // Transition completed. Probably nothing we need to do.
+    // Stop stepping if a menu opens or the game ends; the rest of this frame's time is forfeit.
+    update_pending+=elapsed;
+    int stepc=0;
+    while ((update_pending>=UPDATE_STEP)&&(stepc<UPDATE_STEP_LIMIT)) {
+      update_pending-=UPDATE_STEP;
+      stepc++;
+      update_game_step(UPDATE_STEP);
+      if (g.menuc||g.game_over) {
+        update_pending=0.0;
+        break;
       }
     }
-    sprgrp_update(sprgrpv+SPRGRP_UPDATE,elapsed,0);
-    physics_update(sprgrpv+SPRGRP_SOLID,elapsed);
-    check_sprites_footing(sprgrpv+SPRGRP_FOOTING);
-    check_sprites_heronotify(sprgrpv+SPRGRP_HERONOTIFY,sprgrpv+SPRGRP_HERO);
-    // Any non-sprite update stuff goes here.
-    sprgrp_kill(sprgrpv+SPRGRP_DEATHROW);
-    check_map_change();
+    if (update_pending>=UPDATE_STEP) update_pending=0.0;
+    g.renderlerp=update_pending/UPDATE_STEP;
+    profiler_begin(PROFILER_PHASE_prefetch);
+    prefetch_update();
+    profiler_end(PROFILER_PHASE_prefetch);
   }
+  profiler_begin(PROFILER_PHASE_autosave);
+  stobus_flush(&g.stobus);
+  autosave_update(elapsed);
+  profiler_end(PROFILER_PHASE_autosave);
+  prefetch_note_frame(egg_time_real()-starttime);
 }
 
 /* Render.
  ********************************************************************************/
 
+/* Draw map and sprites into the current world texture, and return it.
+ * When a transition starts, apply_map_change() keeps this one as (g.texid_transtex) and flips us to the other.
+ * So capturing the outgoing frame costs nothing.
+ */
+static int render_world() {
+  int texid=g.texid_worldv[g.worldp];
+  profiler_begin(PROFILER_PHASE_map);
+  draw_clear(texid);
+  render_map(texid);
+  profiler_end(PROFILER_PHASE_map);
+  sprgrp_render(texid,sprgrpv+SPRGRP_RENDER);
+  return texid;
+}
+
 static void render_game_untransitioned() {
-  render_map(1);
-  sprgrp_render(1,sprgrpv+SPRGRP_RENDER);
+  draw_decal(1,render_world(),0,0,0,0,SCREENW,SCREENH,0);
 }
 
 // The old scene goes at (dstx,dsty), and the new one at (rx,ry) relative to the old.
 static void render_pan(int dstx,int dsty,int rx,int ry) {
-  egg_draw_decal(1,g.texid_transtex,dstx,dsty,0,0,SCREENW,SCREENH,0);
-  g.renderx=dstx+rx;
-  g.rendery=dsty+ry;
-  render_game_untransitioned();
+  int texid=render_world();
+  draw_decal(1,g.texid_transtex,dstx,dsty,0,0,SCREENW,SCREENH,0);
+  draw_decal(1,texid,dstx+rx,dsty+ry,0,0,SCREENW,SCREENH,0);
 }
 
 static void render_dissolve(double p) {
@@ -208,9 +393,9 @@ static void render_dissolve(double p) {
   int alpha=(1.0-p)*0xff;
   if (alpha<=0) return;
   if (alpha>0xff) alpha=0xff;
-  egg_render_alpha(alpha);
-  egg_draw_decal(1,g.texid_transtex,0,0,0,0,SCREENW,SCREENH,0);
-  egg_render_alpha(0xff);
+  draw_alpha(alpha);
+  draw_decal(1,g.texid_transtex,0,0,0,0,SCREENW,SCREENH,0);
+  draw_alpha(0xff);
 }
 
 // (which) is (0,1)=(old,new), (black) in 0..1
@@ -218,12 +403,12 @@ static void render_fade(int which,double black) {
   if (which) {
     render_game_untransitioned();
   } else {
-    egg_draw_decal(1,g.texid_transtex,0,0,0,0,SCREENW,SCREENH,0);
+    draw_decal(1,g.texid_transtex,0,0,0,0,SCREENW,SCREENH,0);
   }
   int alpha=black*0xff;
   if (alpha<=0) return;
   if (alpha>0xff) alpha=0xff;
-  egg_draw_rect(1,0,0,SCREENW,SCREENH,(g.transrgba&0xffffff00)|alpha);
+  draw_rect(1,0,0,SCREENW,SCREENH,(g.transrgba&0xffffff00)|alpha);
 }
 
 // (which) is (0,1)=(old,new), (size) is the normalized width of the spotlight.
@@ -238,7 +423,7 @@ static void render_spotlight(int which,double size) {
       fy=(int)(hero->y*TILESIZE);
     }
   } else {
-    egg_draw_decal(1,g.texid_transtex,0,0,0,0,SCREENW,SCREENH,0);
+    draw_decal(1,g.texid_transtex,0,0,0,0,SCREENW,SCREENH,0);
     fx=g.transfx;
     fy=g.transfy;
   }
@@ -260,19 +445,19 @@ static void render_spotlight(int which,double size) {
   int r=fx+(int)(rd*size);
   int b=fy+(int)(bd*size);
   // Draw four black rectangles for the bulk of the blackout region.
-  egg_draw_rect(1,0,0,l,SCREENH,g.transrgba);
-  egg_draw_rect(1,0,0,SCREENW,t,g.transrgba);
-  egg_draw_rect(1,r,0,SCREENW,SCREENH,g.transrgba);
-  egg_draw_rect(1,0,b,SCREENW,SCREENH,g.transrgba);
+  draw_rect(1,0,0,l,SCREENH,g.transrgba);
+  draw_rect(1,0,0,SCREENW,t,g.transrgba);
+  draw_rect(1,r,0,SCREENW,SCREENH,g.transrgba);
+  draw_rect(1,0,b,SCREENW,SCREENH,g.transrgba);
   //TODO circular cutout
   int srcw=0,srch=0;
   egg_texture_get_header(&srcw,&srch,0,g.texid_spotlight);
   if ((srcw>0)&&(srch>0)) {
-    egg_render_tint(g.transrgba|0xff);
+    draw_tint(g.transrgba|0xff);
     double xscale=(double)(r+1-l)/(double)srcw;
     double yscale=(double)(b+1-t)/(double)srch;
-    egg_draw_decal_mode7(1,g.texid_spotlight,(l+r)>>1,(t+b)>>1,0,0,srcw,srch,0,(int)(xscale*65536.0),(int)(yscale*65536.0));
-    egg_render_tint(0);
+    draw_decal_mode7(1,g.texid_spotlight,(l+r)>>1,(t+b)>>1,0,0,srcw,srch,0,(int)(xscale*65536.0),(int)(yscale*65536.0));
+    draw_tint(0);
   }
 }
 
@@ -323,7 +508,7 @@ void render_compass(int x,int y) {
   int32_t rotation=(int32_t)(g.compassangle*65536.0);
   int srcx=0x04*TILESIZE;
   int srcy=0x0b*TILESIZE;
-  egg_draw_decal_mode7(1,texcache_get(&g.texcache,RID_image_hero),x,y,srcx,srcy,TILESIZE,TILESIZE,rotation,0x00010000,0x00010000);
+  draw_decal_mode7(1,texcache_get(&g.texcache,RID_image_hero),x,y,srcx,srcy,TILESIZE,TILESIZE,rotation,0x00010000,0x00010000);
 }
 
 static void render_overlay() {
@@ -353,6 +538,7 @@ static void render_overlay() {
 
 void egg_client_render() {
   g.renderseq++;
+  drawstats_frame_begin();
 
   // Search for an opaque menu, determine how many layers we actually need to draw.
   int menup=0;
@@ -369,21 +555,27 @@ void egg_client_render() {
 
   // No menus, or the first one is not opaque, we need to draw the scene.
   if (!menuc||!g.menuv[menup]->opaque) {
-    g.renderx=g.rendery=0;
     if (g.transclock>0.0) {
       double p=1.0-g.transclock/g.transtotal;
       render_game_transition(g.transition,p);
     } else {
       render_game_untransitioned();
     }
+    profiler_begin(PROFILER_PHASE_hud);
     render_overlay();
+    profiler_end(PROFILER_PHASE_hud);
   }
   
   // Draw all the selected menus in order.
+  profiler_begin(PROFILER_PHASE_menurender);
   for (i=menuc;i-->0;menup++) {
     struct menu *menu=g.menuv[menup];
     if (menu->render) menu->render(menu);
   }
+  profiler_end(PROFILER_PHASE_menurender);
   
   inkeep_render();
+  drawstats_frame_end();
+  profiler_render();
+  profiler_frame_end();
 }
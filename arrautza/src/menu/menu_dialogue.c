@@ -104,7 +104,7 @@ static void _dialogue_render(struct menu *menu) {
   int texid=texcache_get(&g.texcache,RID_image_hero);
   
   dialogue_render_background(menu,x0,y0,colc,rowc,texid);
-  egg_draw_decal(1,MENU->texid_text,x0+TILESIZE,y0+TILESIZE,0,0,MENU->textw,MENU->texth,0);
+  draw_decal(1,MENU->texid_text,x0+TILESIZE,y0+TILESIZE,0,0,MENU->textw,MENU->texth,0);
 }
 
 /* New.
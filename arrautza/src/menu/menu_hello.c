@@ -24,11 +24,11 @@ static void _hello_del(struct menu *menu) {
   egg_texture_del(MENU->texid);
 }
 
-/* New game.
+/* New game, or continue from the autosave.
  */
  
-static void hello_begin_game(struct menu *menu) {
-  if (reset_game()<0) {
+static void hello_begin_game(struct menu *menu,int resume) {
+  if (reset_game(resume)<0) {
     egg_log("reset_game failed!");
     egg_request_termination();
     return;
@@ -36,13 +36,6 @@ static void hello_begin_game(struct menu *menu) {
   menu_pop_soon(menu);
 }
 
-/* Continue.
- */
- 
-static void hello_continue_game(struct menu *menu) {
-  //TODO Locate save file.
-}
-
 /* Activate.
  */
  
@@ -50,8 +43,8 @@ static void hello_activate(struct menu *menu) {
   if (MENU->logo_progress<1.0) {
     MENU->logo_progress=1.0;
   } else switch (MENU->optionp) {
-    case 0: hello_begin_game(menu); break;
-    case 1: hello_continue_game(menu); break;
+    case 0: hello_begin_game(menu,0); break;
+    case 1: hello_begin_game(menu,1); break;
     case 2: egg_request_termination(); break;
   }
 }
@@ -98,14 +91,14 @@ static void _hello_update(struct menu *menu,double elapsed) {
  */
  
 static void _hello_render(struct menu *menu) {
-  egg_draw_rect(1,0,0,SCREENW,SCREENH,0x5b1919ff);
+  draw_rect(1,0,0,SCREENW,SCREENH,0x5b1919ff);
   
   int dstx=(SCREENW>>1)-(MENU->logow>>1);
   int dsty=0;
   if (MENU->logo_progress<1.0) {
     dsty=SCREENH+(int)((dsty-SCREENH)*MENU->logo_progress);
   }
-  egg_draw_decal(1,MENU->texid,dstx,dsty,0,0,MENU->logow,MENU->logoh,0);
+  draw_decal(1,MENU->texid,dstx,dsty,0,0,MENU->logow,MENU->logoh,0);
   
   if (MENU->logo_progress>=1.0) {
     const char *src;
@@ -129,8 +122,8 @@ static void _hello_render(struct menu *menu) {
     tile_renderer_end(&g.tile_renderer);
     
     int texid=texcache_get(&g.texcache,RID_image_hero);
-    egg_draw_decal(1,texid,MENU->cursorx,MENU->cursory,0,128,32,16,0);
-    egg_draw_decal(1,texid,SCREENW-MENU->cursorx-32,MENU->cursory,0,128,32,16,EGG_XFORM_XREV);
+    draw_decal(1,texid,MENU->cursorx,MENU->cursory,0,128,32,16,0);
+    draw_decal(1,texid,SCREENW-MENU->cursorx-32,MENU->cursory,0,128,32,16,EGG_XFORM_XREV);
   }
 }
 
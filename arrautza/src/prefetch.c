@@ -0,0 +1,338 @@
+#include "arrautza.h"
+
+/* Neighbor map prefetch.
+ * Crossing an edge used to do everything on that one frame: Fetch the map, resolve its sprdefs, build walls, decode the tilesheet image.
+ * Instead, we keep a few maps decoded ahead of time: The current one, its four neighbors, and some we visited recently.
+ * prefetch_update() advances one of them by one stage per frame, while the player walks around.
+ * prefetch_take_map() finishes whatever isn't ready yet, then swaps it in.
+ * Doors go to maps we didn't anticipate. Those do all the stages at once, exactly as expensive as before.
+ *
+ * Think of the slots as a chunk cache around the camera.
+ * Maps with MAPCMD_ucoord are placed in the world grid, and we evict the ones farthest from (g.ucoordx,g.ucoordy) first.
+ * There's room for every chunk within PREFETCH_RADIUS, so walking back the way you came usually hits, diagonals included.
+ * Memory is bounded by PREFETCH_SLOT_COUNT no matter how big the world is.
+ * The world is still one screen per map. A scrolling, chunk-streamed world would be a rewrite of the game, so we stop at caching.
+ */
+
+#define PREFETCH_RADIUS 1 /* Chunks within so many ucoords of the camera are only evicted if nothing else is available. */
+#define PREFETCH_SLOT_COUNT ((PREFETCH_RADIUS*2+1)*(PREFETCH_RADIUS*2+1)) /* Every chunk within the radius, current map and neighbors included. */
+#define PREFETCH_IMAGE_COUNT (PREFETCH_SLOT_COUNT+1) /* One extra for an inherited tilesheet, see prefetch_image_get(). */
+
+#define PREFETCH_STAGE_EMPTY   0
+#define PREFETCH_STAGE_MAP     1 /* (map,index,ucoord,imageid) valid. */
+#define PREFETCH_STAGE_SPRDEFS 2 /* sprdef_get() called for each sprite, and tilesheet_get() for the image, so they're cached. */
+#define PREFETCH_STAGE_WALLS   3 /* (walls) built, if we know the image. */
+#define PREFETCH_STAGE_READY   4 /* (texid) loaded, if we know the image. Sprite textures in (g.texcache) if there was room. */
+
+static struct prefetch_slot {
+  uint16_t mapid; // Zero if unused.
+  int stage;
+  int err; // Nonzero if the map failed to load. Stays that way, so we don't retry every frame.
+  int seq;
+  struct map map;
+  struct map_index index;
+  int has_ucoord;
+  int16_t ucoordx,ucoordy; // If (has_ucoord).
+  uint16_t imageid; // Zero if the map doesn't say, then it inherits whatever was loaded before.
+  struct physics_walls *walls; // Null if (imageid) zero; we'll rebuild at take.
+  int texid;
+} prefetch_slotv[PREFETCH_SLOT_COUNT]={0};
+
+static struct prefetch_image {
+  int texid;
+  uint16_t imageid;
+  int seq;
+} prefetch_imagev[PREFETCH_IMAGE_COUNT]={0};
+
+static int prefetch_seq=0;
+
+/* Frame-time histogram.
+ * Every update reports its cost. Those within PREFETCH_HISTOGRAM_WINDOW frames after a map change are counted separately.
+ */
+
+#define PREFETCH_HISTOGRAM_WINDOW 3
+#define PREFETCH_BUCKET_COUNT 8
+
+static const double prefetch_bucket_limitv[PREFETCH_BUCKET_COUNT-1]={
+  0.0005,0.001,0.002,0.004,0.008,0.016,0.033,
+};
+
+static struct prefetch_histogram {
+  int v[PREFETCH_BUCKET_COUNT];
+  double worst;
+} prefetch_histogram_steady={0},prefetch_histogram_transition={0};
+
+static int prefetch_window=0; // Counts down frames after a map change.
+static int prefetch_hitc=0,prefetch_missc=0; // Map changes that found the map READY, or not.
+
+/* Should this map stay in the cache?
+ * The current map and its neighbors, per (g.map).
+ */
+
+static int prefetch_wanted(uint16_t mapid) {
+  if (!mapid) return 0;
+  if (mapid==g.mapid) return 1;
+  if (mapid==map_index_get_command(&g.mapindex,&g.map,MAPCMD_neighborw)) return 1;
+  if (mapid==map_index_get_command(&g.mapindex,&g.map,MAPCMD_neighbore)) return 1;
+  if (mapid==map_index_get_command(&g.mapindex,&g.map,MAPCMD_neighborn)) return 1;
+  if (mapid==map_index_get_command(&g.mapindex,&g.map,MAPCMD_neighbors)) return 1;
+  return 0;
+}
+
+/* Drop a slot's content.
+ */
+
+static void prefetch_slot_clear(struct prefetch_slot *slot) {
+  if (slot->walls) {
+    physics_walls_del(slot->walls);
+    slot->walls=0;
+  }
+  slot->mapid=0;
+  slot->stage=PREFETCH_STAGE_EMPTY;
+  slot->err=0;
+  slot->has_ucoord=0;
+  slot->imageid=0;
+  slot->texid=0;
+}
+
+/* How far is this slot from the camera?
+ * -1 for maps we're about to need. Chebyshev distance in ucoords for the rest of the world.
+ * Maps with no ucoord (interiors, typically), if not wanted, are as good as infinitely far.
+ */
+
+static int prefetch_slot_distance(const struct prefetch_slot *slot) {
+  if (prefetch_wanted(slot->mapid)) return -1;
+  if (!slot->has_ucoord) return INT_MAX;
+  int dx=slot->ucoordx-g.ucoordx; if (dx<0) dx=-dx;
+  int dy=slot->ucoordy-g.ucoordy; if (dy<0) dy=-dy;
+  return (dx>dy)?dx:dy;
+}
+
+/* Find the slot for a map, or clear one out for it.
+ * Empty slots first. Then the farthest from the camera, oldest first among equals.
+ * Within PREFETCH_RADIUS, it's only the age that counts. Wanted maps go last of all.
+ */
+
+static struct prefetch_slot *prefetch_slot_require(uint16_t mapid) {
+  struct prefetch_slot *slot=prefetch_slotv,*victim=0;
+  int victimdistance=-2;
+  int i=PREFETCH_SLOT_COUNT;
+  for (;i-->0;slot++) {
+    if (slot->mapid==mapid) return slot;
+    if (victim&&!victim->mapid) continue;
+    if (!slot->mapid) {
+      victim=slot;
+      continue;
+    }
+    int distance=prefetch_slot_distance(slot);
+    if ((distance>=0)&&(distance<=PREFETCH_RADIUS)) distance=0;
+    if (!victim||(distance>victimdistance)||((distance==victimdistance)&&(slot->seq<victim->seq))) {
+      victim=slot;
+      victimdistance=distance;
+    }
+  }
+  if (!(slot=victim)) return 0;
+  prefetch_slot_clear(slot);
+  slot->mapid=mapid;
+  slot->seq=prefetch_seq++;
+  return slot;
+}
+
+/* Get a texture with this image loaded.
+ * We won't evict the one on display, or one that any other slot is holding.
+ * There's one more texture than slots, so that's always possible.
+ */
+
+static int prefetch_image_held(const struct prefetch_image *image) {
+  if (image->imageid==g.imageid_tilesheet) return 1;
+  const struct prefetch_slot *slot=prefetch_slotv;
+  int i=PREFETCH_SLOT_COUNT;
+  for (;i-->0;slot++) if (slot->texid==image->texid) return 1;
+  return 0;
+}
+
+static int prefetch_image_get(uint16_t imageid) {
+  struct prefetch_image *image=prefetch_imagev,*victim=0;
+  int i=PREFETCH_IMAGE_COUNT;
+  for (;i-->0;image++) {
+    if (!image->texid) {
+      if (!victim||victim->texid) victim=image;
+    } else if (image->imageid==imageid) {
+      image->seq=prefetch_seq++;
+      return image->texid;
+    } else if (victim&&!victim->texid) {
+      // Already found an unused one, prefer that.
+    } else if (prefetch_image_held(image)) {
+      // Can't evict.
+    } else if (!victim||(image->seq<victim->seq)) {
+      victim=image;
+    }
+  }
+  if (!victim) return 0;
+  if (!victim->texid) {
+    if ((victim->texid=egg_texture_new())<1) {
+      victim->texid=0;
+      return 0;
+    }
+  }
+  victim->imageid=0;
+  if (egg_texture_load_image(victim->texid,0,imageid)<0) return 0;
+  victim->imageid=imageid;
+  victim->seq=prefetch_seq++;
+  return victim->texid;
+}
+
+/* Resolve sprdefs. sprdef_get() keeps them forever, so calling it is all we need.
+ */
+
+static int prefetch_sprdefs_cb(const uint8_t *cmd,int cmdc,void *userdata) {
+  sprdef_get((cmd[3]<<8)|cmd[4]);
+  return 0;
+}
+
+/* Load sprite textures into (g.texcache) ahead of their first render.
+ * Builder lists them per map in MAPCMD_sprimages.
+ * Only images that fit without evicting anything; those in use by the current map are more important.
+ */
+
+static int prefetch_sprimages_cb(const uint8_t *cmd,int cmdc,void *userdata) {
+  if (cmdc<2) return 0;
+  const uint8_t *v=cmd+2;
+  int c=(cmdc-2)>>1;
+  for (;c-->0;v+=2) {
+    int imageid=(v[0]<<8)|v[1];
+    const struct texcache_entry *entry=g.texcache.v;
+    int i=g.texcache.c,have=0;
+    for (;i-->0;entry++) if (entry->imageid==imageid) { have=1; break; }
+    if (have||(g.texcache.c>=TEXCACHE_SIZE)) continue;
+    texcache_get(&g.texcache,imageid);
+  }
+  return 0;
+}
+
+/* Advance a slot by one stage.
+ */
+
+static int prefetch_slot_step(struct prefetch_slot *slot) {
+  if (slot->err) return -1;
+  switch (slot->stage) {
+
+    case PREFETCH_STAGE_EMPTY: {
+        int c=egg_res_get(&slot->map,sizeof(struct map),EGG_RESTYPE_map,0,slot->mapid);
+        if ((c<COLC*ROWC)||(c>sizeof(struct map))) {
+          egg_log("Invalid size %d for map:%d. Must be in %d..%d.",c,slot->mapid,COLC*ROWC,(int)sizeof(struct map));
+          slot->err=1;
+          return -1;
+        }
+        memset(((char*)&slot->map)+c,0,sizeof(struct map)-c);
+        map_index_build(&slot->index,&slot->map);
+        if (map_index_count(&slot->index,MAPCMD_ucoord)) {
+          uint32_t ucoord=map_index_get_command(&slot->index,&slot->map,MAPCMD_ucoord);
+          slot->has_ucoord=1;
+          slot->ucoordx=ucoord>>16;
+          slot->ucoordy=ucoord;
+        }
+        slot->imageid=map_index_get_command(&slot->index,&slot->map,MAPCMD_image);
+      } break;
+
+    case PREFETCH_STAGE_MAP: {
+        map_for_each_command_of(&slot->map,&slot->index,MAPCMD_sprite,prefetch_sprdefs_cb,0);
+        if (slot->imageid) tilesheet_get(slot->imageid);
+      } break;
+
+    case PREFETCH_STAGE_SPRDEFS: {
+        if (slot->imageid&&!(slot->walls=physics_walls_new(&slot->map,slot->imageid))) {
+          slot->err=1;
+          return -1;
+        }
+      } break;
+
+    case PREFETCH_STAGE_WALLS: {
+        if (slot->imageid&&!(slot->texid=prefetch_image_get(slot->imageid))) {
+          egg_log("Error loading image:%d for map:%d",slot->imageid,slot->mapid);
+          slot->err=1;
+          return -1;
+        }
+        map_for_each_command_of(&slot->map,&slot->index,MAPCMD_sprimages,prefetch_sprimages_cb,0);
+      } break;
+
+    default: return 0;
+  }
+  slot->stage++;
+  return 0;
+}
+
+/* Update, once per frame.
+ */
+
+void prefetch_update() {
+  if (!g.mapid) return;
+  if (g.transclock>0.0) return; // Transition frames render the old scene too. Let them be.
+  const uint8_t opcodev[]={MAPCMD_neighborw,MAPCMD_neighbore,MAPCMD_neighborn,MAPCMD_neighbors};
+  int i=0; for (;i<sizeof(opcodev);i++) {
+    int mapid=map_index_get_command(&g.mapindex,&g.map,opcodev[i]);
+    if (mapid<1) continue;
+    struct prefetch_slot *slot=prefetch_slot_require(mapid);
+    if (!slot||slot->err||(slot->stage>=PREFETCH_STAGE_READY)) continue;
+    prefetch_slot_step(slot);
+    return;
+  }
+}
+
+/* Swap in a map.
+ */
+
+int prefetch_take_map(uint16_t mapid) {
+  struct prefetch_slot *slot=prefetch_slot_require(mapid);
+  if (!slot) return -1;
+  slot->seq=prefetch_seq++;
+  if (slot->stage>=PREFETCH_STAGE_READY) prefetch_hitc++;
+  else prefetch_missc++;
+  while (slot->stage<PREFETCH_STAGE_READY) {
+    if (prefetch_slot_step(slot)<0) return -1;
+  }
+  if (slot->err) return -1;
+  memcpy(&g.map,&slot->map,sizeof(struct map));
+  memcpy(&g.mapindex,&slot->index,sizeof(struct map_index));
+  if (slot->imageid) {
+    g.imageid_tilesheet=slot->imageid;
+    g.texid_tilesheet=slot->texid;
+  }
+  if (slot->walls) physics_use_walls(slot->walls);
+  else physics_rebuild_map();
+  prefetch_window=PREFETCH_HISTOGRAM_WINDOW;
+  return 0;
+}
+
+/* Frame-time histogram.
+ */
+
+static void prefetch_histogram_add(struct prefetch_histogram *histogram,double s) {
+  int i=0;
+  while ((i<PREFETCH_BUCKET_COUNT-1)&&(s>=prefetch_bucket_limitv[i])) i++;
+  histogram->v[i]++;
+  if (s>histogram->worst) histogram->worst=s;
+}
+
+void prefetch_note_frame(double s) {
+  if (prefetch_window>0) {
+    prefetch_window--;
+    prefetch_histogram_add(&prefetch_histogram_transition,s);
+  } else {
+    prefetch_histogram_add(&prefetch_histogram_steady,s);
+  }
+}
+
+static void prefetch_histogram_log(const char *name,const struct prefetch_histogram *histogram) {
+  egg_log(
+    "  %s: <0.5ms:%d <1ms:%d <2ms:%d <4ms:%d <8ms:%d <16ms:%d <33ms:%d more:%d, worst %.3f ms",
+    name,histogram->v[0],histogram->v[1],histogram->v[2],histogram->v[3],
+    histogram->v[4],histogram->v[5],histogram->v[6],histogram->v[7],histogram->worst*1000.0
+  );
+}
+
+void prefetch_report() {
+  egg_log("Map prefetch: %d changes ready, %d loaded on demand. Update cost per frame:",prefetch_hitc,prefetch_missc);
+  prefetch_histogram_log("steady",&prefetch_histogram_steady);
+  prefetch_histogram_log("after map change",&prefetch_histogram_transition);
+}
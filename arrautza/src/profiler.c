@@ -0,0 +1,329 @@
+#include "arrautza.h"
+#include <egg/hid_keycode.h>
+
+/* Frame phase profiler.
+ * main.c (and sprgrp_render) fence each phase of the frame with profiler_begin() and profiler_end().
+ * Each fence adds to this frame's per-phase total, and logs an event (phase,start,duration) in a ring.
+ * profiler_frame_end() commits the frame's totals to another ring, along with the whole frame's wall time.
+ * The gap between the two is "other": Anything we didn't fence, eg transitions and inkeep.
+ *
+ * F3 toggles an overlay: Stacked frame times for the last PROFILER_FRAME_LIMIT frames, and a legend with the averages.
+ * F4 dumps the event ring as Chrome trace-event JSON, one event per egg_log.
+ * Strip any log prefix, save it, and load in chrome://tracing or Perfetto.
+ * profiler_report() at quit logs the averages and worst per phase.
+ *
+ * Unless ARRAUTZA_DEBUG, every call is a noop.
+ */
+
+#define PROFILER_ENABLE ARRAUTZA_DEBUG
+#define PROFILER_FRAME_LIMIT 128 /* Also the graph's width in pixels. */
+#define PROFILER_EVENT_LIMIT 8192
+#define PROFILER_GRAPH_H 48
+#define PROFILER_GRAPH_SCALE 2000.0 /* pixels per second, ie 0.5 ms per pixel */
+#define PROFILER_BUDGET (1.0/60.0)
+
+static const char *profiler_phase_namev[PROFILER_PHASE_COUNT]={
+  #define _(tag) [PROFILER_PHASE_##tag]=#tag,
+  PROFILER_PHASE_FOR_EACH
+  #undef _
+};
+
+static const uint32_t profiler_phase_colorv[PROFILER_PHASE_COUNT]={
+  [PROFILER_PHASE_input]=     0x808080ff,
+  [PROFILER_PHASE_menu]=      0xc0a0ffff,
+  [PROFILER_PHASE_sprupdate]= 0x4060ffff,
+  [PROFILER_PHASE_physics]=   0xff4040ff,
+  [PROFILER_PHASE_footing]=   0xffa040ff,
+  [PROFILER_PHASE_heronotify]=0xffff40ff,
+  [PROFILER_PHASE_deathrow]=  0x804020ff,
+  [PROFILER_PHASE_mapchange]= 0x40ffffff,
+  [PROFILER_PHASE_prefetch]=  0x00a0a0ff,
+  [PROFILER_PHASE_autosave]=  0xa000a0ff,
+  [PROFILER_PHASE_map]=       0x40ff40ff,
+  [PROFILER_PHASE_sprsort]=   0xff80c0ff,
+  [PROFILER_PHASE_sprdraw]=   0x008000ff,
+  [PROFILER_PHASE_hud]=       0xc0c000ff,
+  [PROFILER_PHASE_menurender]=0x6040a0ff,
+};
+#define PROFILER_OTHER_COLOR 0x404040ff
+#define PROFILER_BUDGET_COLOR 0xffffffff
+
+static struct profiler_frame {
+  double start;
+  float total;
+  float phasev[PROFILER_PHASE_COUNT];
+} profiler_framev[PROFILER_FRAME_LIMIT];
+static int profiler_framep=0; // Next to write.
+static int profiler_framec=0; // Valid frames, up to PROFILER_FRAME_LIMIT.
+
+static struct profiler_event {
+  double start;
+  float dur;
+  int phase;
+} profiler_eventv[PROFILER_EVENT_LIMIT];
+static int profiler_eventp=0;
+static int profiler_eventc=0;
+
+static struct profiler_frame profiler_current={0};
+static int profiler_in_frame=0;
+static double profiler_startv[PROFILER_PHASE_COUNT]={0};
+
+static int profiler_overlay=0;
+static int profiler_texid=0;
+static uint32_t *profiler_pixels=0;
+
+/* Fences.
+ */
+
+void profiler_begin(int phase) {
+  if (!PROFILER_ENABLE) return;
+  profiler_startv[phase]=egg_time_real();
+}
+
+void profiler_end(int phase) {
+  if (!PROFILER_ENABLE) return;
+  double start=profiler_startv[phase];
+  double dur=egg_time_real()-start;
+  profiler_current.phasev[phase]+=dur;
+  struct profiler_event *event=profiler_eventv+profiler_eventp++;
+  if (profiler_eventp>=PROFILER_EVENT_LIMIT) profiler_eventp=0;
+  if (profiler_eventc<PROFILER_EVENT_LIMIT) profiler_eventc++;
+  event->start=start;
+  event->dur=dur;
+  event->phase=phase;
+}
+
+/* Frame bounds.
+ */
+
+void profiler_frame_begin() {
+  if (!PROFILER_ENABLE) return;
+  if (profiler_in_frame) profiler_frame_end(); // Render got skipped, whatever.
+  memset(&profiler_current,0,sizeof(profiler_current));
+  profiler_current.start=egg_time_real();
+  profiler_in_frame=1;
+}
+
+void profiler_frame_end() {
+  if (!PROFILER_ENABLE) return;
+  if (!profiler_in_frame) return;
+  profiler_in_frame=0;
+  profiler_current.total=egg_time_real()-profiler_current.start;
+  profiler_framev[profiler_framep++]=profiler_current;
+  if (profiler_framep>=PROFILER_FRAME_LIMIT) profiler_framep=0;
+  if (profiler_framec<PROFILER_FRAME_LIMIT) profiler_framec++;
+}
+
+/* Averages and worst over the frame ring.
+ * Each has PROFILER_PHASE_COUNT+1 members; the last is the total.
+ */
+
+static void profiler_summarize(double *avgv,double *worstv) {
+  memset(avgv,0,sizeof(double)*(PROFILER_PHASE_COUNT+1));
+  memset(worstv,0,sizeof(double)*(PROFILER_PHASE_COUNT+1));
+  if (!profiler_framec) return;
+  const struct profiler_frame *frame=profiler_framev;
+  int i=profiler_framec;
+  for (;i-->0;frame++) {
+    int phase=0; for (;phase<PROFILER_PHASE_COUNT;phase++) {
+      avgv[phase]+=frame->phasev[phase];
+      if (frame->phasev[phase]>worstv[phase]) worstv[phase]=frame->phasev[phase];
+    }
+    avgv[PROFILER_PHASE_COUNT]+=frame->total;
+    if (frame->total>worstv[PROFILER_PHASE_COUNT]) worstv[PROFILER_PHASE_COUNT]=frame->total;
+  }
+  for (i=0;i<=PROFILER_PHASE_COUNT;i++) avgv[i]/=profiler_framec;
+}
+
+/* Log report.
+ */
+
+void profiler_report() {
+  if (!PROFILER_ENABLE) return;
+  double avgv[PROFILER_PHASE_COUNT+1],worstv[PROFILER_PHASE_COUNT+1];
+  profiler_summarize(avgv,worstv);
+  egg_log("Frame phases, last %d frames, avg/worst in ms:",profiler_framec);
+  int phase=0; for (;phase<PROFILER_PHASE_COUNT;phase++) {
+    egg_log("  %s: %.3f %.3f",profiler_phase_namev[phase],avgv[phase]*1000.0,worstv[phase]*1000.0);
+  }
+  egg_log("  frame: %.3f %.3f",avgv[PROFILER_PHASE_COUNT]*1000.0,worstv[PROFILER_PHASE_COUNT]*1000.0);
+}
+
+/* Dump trace.
+ * Timestamps are microseconds from the oldest event.
+ * Frames go on their own track, tid 1, and phases on tid 2.
+ */
+
+static void profiler_dump_trace() {
+  if (!profiler_eventc) return;
+  int eventp=profiler_eventp-profiler_eventc;
+  if (eventp<0) eventp+=PROFILER_EVENT_LIMIT;
+  double t0=profiler_eventv[eventp].start;
+  egg_log("{\"traceEvents\":[");
+  int framep=profiler_framep-profiler_framec;
+  if (framep<0) framep+=PROFILER_FRAME_LIMIT;
+  int i=profiler_framec;
+  for (;i-->0;) {
+    const struct profiler_frame *frame=profiler_framev+framep;
+    if (++framep>=PROFILER_FRAME_LIMIT) framep=0;
+    if (frame->start<t0) continue;
+    egg_log(
+      "{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f},",
+      (frame->start-t0)*1000000.0,frame->total*1000000.0
+    );
+  }
+  for (i=profiler_eventc;i-->0;) {
+    const struct profiler_event *event=profiler_eventv+eventp;
+    if (++eventp>=PROFILER_EVENT_LIMIT) eventp=0;
+    egg_log(
+      "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.3f,\"dur\":%.3f},",
+      profiler_phase_namev[event->phase],(event->start-t0)*1000000.0,event->dur*1000000.0
+    );
+  }
+  egg_log("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"phases\"}}]}");
+  egg_log("Dumped %d profiler events and %d frames.",profiler_eventc,profiler_framec);
+}
+
+/* Keys.
+ */
+
+int profiler_key(int keycode) {
+  if (!PROFILER_ENABLE) return 0;
+  switch (keycode) {
+    case KEY_F3: profiler_overlay=profiler_overlay?0:1; return 1;
+    case KEY_F4: profiler_dump_trace(); return 1;
+  }
+  return 0;
+}
+
+/* Draw the graph into (profiler_pixels) and upload it.
+ * Oldest frame on the left, one column per frame. Phases stack from the bottom, and "other" goes on top.
+ */
+
+static int profiler_render_graph() {
+  if (!profiler_texid) {
+    if ((profiler_texid=egg_texture_new())<1) return -1;
+  }
+  if (!profiler_pixels) {
+    if (!(profiler_pixels=malloc(PROFILER_FRAME_LIMIT*PROFILER_GRAPH_H*4))) return -1;
+  }
+  memset(profiler_pixels,0,PROFILER_FRAME_LIMIT*PROFILER_GRAPH_H*4);
+  int x=PROFILER_FRAME_LIMIT-profiler_framec;
+  int framep=profiler_framep-profiler_framec;
+  if (framep<0) framep+=PROFILER_FRAME_LIMIT;
+  for (;x<PROFILER_FRAME_LIMIT;x++) {
+    const struct profiler_frame *frame=profiler_framev+framep;
+    if (++framep>=PROFILER_FRAME_LIMIT) framep=0;
+    uint32_t *column=profiler_pixels+(PROFILER_GRAPH_H-1)*PROFILER_FRAME_LIMIT+x;
+    int y=0;
+    double sum=0.0;
+    int phase=0; for (;phase<=PROFILER_PHASE_COUNT;phase++) {
+      uint32_t rgba;
+      if (phase<PROFILER_PHASE_COUNT) {
+        sum+=frame->phasev[phase];
+        rgba=profiler_phase_colorv[phase];
+      } else {
+        sum=frame->total;
+        rgba=PROFILER_OTHER_COLOR;
+      }
+      // Pixels are RGBA in memory order.
+      uint32_t pixel=(rgba>>24)|((rgba>>8)&0xff00)|((rgba<<8)&0xff0000)|(rgba<<24);
+      int ylimit=(int)(sum*PROFILER_GRAPH_SCALE+0.5);
+      if (ylimit>PROFILER_GRAPH_H) ylimit=PROFILER_GRAPH_H;
+      for (;y<ylimit;y++) column[-y*PROFILER_FRAME_LIMIT]=pixel;
+    }
+  }
+  int budgety=PROFILER_GRAPH_H-1-(int)(PROFILER_BUDGET*PROFILER_GRAPH_SCALE);
+  if (budgety>=0) {
+    uint32_t *row=profiler_pixels+budgety*PROFILER_FRAME_LIMIT;
+    for (x=0;x<PROFILER_FRAME_LIMIT;x+=2) row[x]=PROFILER_BUDGET_COLOR;
+  }
+  return egg_texture_upload(profiler_texid,PROFILER_FRAME_LIMIT,PROFILER_GRAPH_H,PROFILER_FRAME_LIMIT<<2,EGG_TEX_FMT_RGBA,profiler_pixels,PROFILER_FRAME_LIMIT*PROFILER_GRAPH_H*4);
+}
+
+/* Milliseconds as "12.34", always 5 characters. Clamps at 99.99.
+ */
+
+static void profiler_repr_ms(char *dst,double s) {
+  int v=(int)(s*100000.0+0.5);
+  if (v>9999) v=9999;
+  dst[0]=(v>=1000)?('0'+v/1000):' ';
+  dst[1]='0'+(v/100)%10;
+  dst[2]='.';
+  dst[3]='0'+(v/10)%10;
+  dst[4]='0'+v%10;
+}
+
+/* Integer as 5 characters, right-aligned. Clamps at 99999.
+ */
+
+static void profiler_repr_int(char *dst,int v) {
+  if (v<0) v=0;
+  else if (v>99999) v=99999;
+  int i=5;
+  do { dst[--i]='0'+v%10; v/=10; } while (v&&i);
+  while (i>0) dst[--i]=' ';
+}
+
+/* Render overlay.
+ * Legend on the left, one row per phase: Color swatch, name, average ms. Then the graph.
+ * Above the graph, draw call counts from the last frame, see draw.c, and some sprite counts.
+ */
+
+void profiler_render() {
+  if (!PROFILER_ENABLE||!profiler_overlay) return;
+  if (profiler_render_graph()<0) return;
+  int fontw=0;
+  egg_texture_get_header(&fontw,0,0,g.texid_font_tiles);
+  int rowh=fontw>>4;
+  if (rowh<1) return;
+  int legendw=rowh*(1+10+1+5)+4;
+  const int statc=11; // Lines of counts above the graph, below.
+  int h=rowh*(PROFILER_PHASE_COUNT+1)+4;
+  if (h<rowh*statc+PROFILER_GRAPH_H+4) h=rowh*statc+PROFILER_GRAPH_H+4;
+  int t=SCREENH-h;
+  egg_draw_rect(1,0,t,legendw+PROFILER_FRAME_LIMIT+4,h,0x000000c0);
+  egg_draw_decal(1,profiler_texid,legendw,SCREENH-PROFILER_GRAPH_H-2,0,0,PROFILER_FRAME_LIMIT,PROFILER_GRAPH_H,0);
+
+  double avgv[PROFILER_PHASE_COUNT+1],worstv[PROFILER_PHASE_COUNT+1];
+  profiler_summarize(avgv,worstv);
+  int phase=0,y=t+2;
+  for (;phase<PROFILER_PHASE_COUNT;phase++,y+=rowh) {
+    egg_draw_rect(1,2,y+1,rowh-2,rowh-2,profiler_phase_colorv[phase]);
+  }
+  tile_renderer_begin(&g.tile_renderer,g.texid_font_tiles,0xffffffff,0xff);
+  char line[16];
+  for (phase=0,y=t+2+(rowh>>1);phase<=PROFILER_PHASE_COUNT;phase++,y+=rowh) {
+    const char *name=(phase<PROFILER_PHASE_COUNT)?profiler_phase_namev[phase]:"frame";
+    int linec=0;
+    for (;name[linec]&&(linec<10);linec++) line[linec]=name[linec];
+    for (;linec<11;linec++) line[linec]=' ';
+    profiler_repr_ms(line+linec,avgv[phase]);
+    linec+=5;
+    tile_renderer_string(&g.tile_renderer,2+rowh+(rowh>>1),y,line,linec);
+  }
+  const struct drawstats *drawstats=drawstats_get_last();
+  y=t+2+(rowh>>1);
+  #define _(label,v) { \
+    int labelc=sizeof(label)-1; \
+    memcpy(line,label,labelc); \
+    profiler_repr_int(line+labelc,v); \
+    tile_renderer_string(&g.tile_renderer,legendw+(rowh>>1),y,line,labelc+5); \
+    y+=rowh; \
+  }
+  _("draws   ",drawstats->tilecallc+drawstats->decalc+drawstats->rectc)
+  _("tiles   ",drawstats->tilec)
+  _("verts   ",drawstats->vtxc)
+  _("binds   ",drawstats->bindc)
+  _("targets ",drawstats->targetc)
+  _("tint/a  ",drawstats->tintc+drawstats->alphac)
+  _("redund  ",drawstats->redundantc)
+  int awakec=0,asleepc=0;
+  physics_get_sleep_counts(&awakec,&asleepc);
+  _("awake   ",awakec)
+  _("asleep  ",asleepc)
+  _("culled  ",sprgrp_render_get_culled_count())
+  _("sprdraw ",sprgrp_render_get_draw_count())
+  #undef _
+  tile_renderer_end(&g.tile_renderer);
+}
@@ -0,0 +1,358 @@
+#include "arrautza.h"
+
+/* Input recording and replay.
+ * A recording is the rand() seed, plus each frame's (elapsed), plus player one's input state whenever it changes.
+ * That's all it takes to reproduce a session exactly, since everything else is deterministic.
+ * Text, so it can live in the store and be copied around by hand:
+ *
+ *   arrautza-replay 1 SEED
+ *   ELAPSED [sSTATE|kKEYCODE...]
+ *   *REPEAT
+ *
+ * SEED, STATE, and KEYCODE are hexadecimal. ELAPSED is the 64 bits of a double, 16 hex digits, so it's exact.
+ * A frame line lists the input events received during that frame, in order:
+ *   sSTATE: Player one's state after a cb_joy.
+ *   kKEYCODE: A raw key that changes game state outside of inkeep, eg quick-save.
+ * "*REPEAT" means the previous frame line happens REPEAT more times.
+ *
+ * Set REPLAY_RECORD_ENABLE to record every session, from init until the buffer fills.
+ * The recording goes to the store as "replay" at quit, and whenever you press F7.
+ * Playing back is for the headless build; see etc/headless/headless.c.
+ */
+
+#define REPLAY_RECORD_ENABLE 0
+#define REPLAY_RECORD_LIMIT (1<<20) /* bytes */
+#define REPLAY_VERSION 1
+#define REPLAY_EVENT_LIMIT 32 /* Per frame. Beyond that we drop events, they're just joystick states after all. */
+#define REPLAY_LINE_LIMIT 512 /* Longest possible frame line, with all its events. */
+
+static struct {
+  int recording;
+  char *v;
+  int c,a;
+  int linep; // Start of the current frame line in (v), or -1 if none open.
+  int prevp,prevc; // Previous complete frame line, for run-length compression.
+  int repeatc; // How many times (prev) has repeated so far, not yet written.
+  int eventc; // In the current frame.
+} replay_rec={0};
+
+static struct {
+  int playing;
+  int seed;
+  const char *src;
+  int srcc,srcp;
+  const char *line; // Last frame line we played, for repeats.
+  int linec;
+  int repeatc; // Remaining repeats of (line).
+  int framec; // Frames played so far.
+} replay_play={0};
+
+/* Hex primitives.
+ */
+
+static int replay_hexdigit(char ch) {
+  if ((ch>='0')&&(ch<='9')) return ch-'0';
+  if ((ch>='a')&&(ch<='f')) return ch-'a'+10;
+  if ((ch>='A')&&(ch<='F')) return ch-'A'+10;
+  return -1;
+}
+
+// Read unsigned hex at (src), stop at the first non-digit. Returns length consumed.
+static int replay_read_hex(uint64_t *dst,const char *src,int srcc) {
+  int srcp=0;
+  *dst=0;
+  while ((srcp<srcc)&&(srcp<16)) {
+    int digit=replay_hexdigit(src[srcp]);
+    if (digit<0) break;
+    (*dst)=((*dst)<<4)|digit;
+    srcp++;
+  }
+  return srcp;
+}
+
+/* Recorder output primitives.
+ */
+
+static int replay_rec_require(int addc) {
+  if (replay_rec.c>REPLAY_RECORD_LIMIT-addc) {
+    egg_log("Replay recording is full at %d bytes. Stopping.",replay_rec.c);
+    replay_rec.recording=0;
+    return -1;
+  }
+  int na=replay_rec.c+addc;
+  if (na<=replay_rec.a) return 0;
+  na=(na+4096)&~4095;
+  void *nv=realloc(replay_rec.v,na);
+  if (!nv) {
+    replay_rec.recording=0;
+    return -1;
+  }
+  replay_rec.v=nv;
+  replay_rec.a=na;
+  return 0;
+}
+
+static int replay_rec_hex(uint64_t v,int digitc) {
+  if (replay_rec_require(digitc)<0) return -1;
+  int i=digitc; while (i-->0) {
+    replay_rec.v[replay_rec.c+i]="0123456789abcdef"[v&15];
+    v>>=4;
+  }
+  replay_rec.c+=digitc;
+  return 0;
+}
+
+// Hex with no leading zeroes, for states and keycodes.
+static int replay_rec_hex_short(uint32_t v) {
+  int digitc=1;
+  uint32_t q=v>>4;
+  for (;q;q>>=4) digitc++;
+  return replay_rec_hex(v,digitc);
+}
+
+static int replay_rec_char(char ch) {
+  if (replay_rec_require(1)<0) return -1;
+  replay_rec.v[replay_rec.c++]=ch;
+  return 0;
+}
+
+static int replay_rec_decimal(int v) {
+  char tmp[16];
+  int tmpc=0;
+  do { tmp[tmpc++]='0'+v%10; v/=10; } while (v&&(tmpc<sizeof(tmp)));
+  if (replay_rec_require(tmpc)<0) return -1;
+  while (tmpc-->0) replay_rec.v[replay_rec.c++]=tmp[tmpc];
+  return 0;
+}
+
+/* Write out any pending repeat count.
+ */
+
+static void replay_rec_flush_repeat() {
+  if (replay_rec.repeatc<1) return;
+  int repeatc=replay_rec.repeatc;
+  replay_rec.repeatc=0;
+  if (replay_rec_char('*')<0) return;
+  if (replay_rec_decimal(repeatc)<0) return;
+  replay_rec_char('\n');
+}
+
+/* Close the current frame line.
+ * If it's identical to the previous one, take it back out and count a repeat instead.
+ */
+
+static void replay_rec_close_line() {
+  if (replay_rec.linep<0) return;
+  if (replay_rec_char('\n')<0) return;
+  int linep=replay_rec.linep,linec=replay_rec.c-linep;
+  replay_rec.linep=-1;
+  if ((linec==replay_rec.prevc)&&!memcmp(replay_rec.v+linep,replay_rec.v+replay_rec.prevp,linec)) {
+    replay_rec.c=linep;
+    replay_rec.repeatc++;
+    return;
+  }
+  if (replay_rec.repeatc) {
+    // Pull the new line off, write the repeat, then put it back.
+    char tmp[REPLAY_LINE_LIMIT];
+    if (linec>sizeof(tmp)) linec=sizeof(tmp);
+    memcpy(tmp,replay_rec.v+linep,linec);
+    replay_rec.c=linep;
+    replay_rec_flush_repeat();
+    linep=replay_rec.c;
+    if (replay_rec_require(linec)<0) return;
+    memcpy(replay_rec.v+linep,tmp,linec);
+    replay_rec.c+=linec;
+  }
+  replay_rec.prevp=linep;
+  replay_rec.prevc=linec;
+}
+
+/* Recorder, public.
+ */
+
+void replay_record_begin(int seed) {
+  if (!REPLAY_RECORD_ENABLE) return;
+  if (replay_play.playing) return;
+  replay_rec.c=0;
+  replay_rec.linep=-1;
+  replay_rec.prevp=replay_rec.prevc=0;
+  replay_rec.repeatc=0;
+  replay_rec.recording=1;
+  const char header[]="arrautza-replay ";
+  if (replay_rec_require(sizeof(header)-1)<0) return;
+  memcpy(replay_rec.v,header,sizeof(header)-1);
+  replay_rec.c=sizeof(header)-1;
+  replay_rec_hex_short(REPLAY_VERSION);
+  replay_rec_char(' ');
+  replay_rec_hex_short(seed);
+  replay_rec_char('\n');
+}
+
+void replay_record_frame(double elapsed) {
+  if (!replay_rec.recording) return;
+  replay_rec_close_line();
+  if (!replay_rec.recording) return;
+  uint64_t bits;
+  memcpy(&bits,&elapsed,sizeof(bits));
+  replay_rec.linep=replay_rec.c;
+  replay_rec.eventc=0;
+  replay_rec_hex(bits,16);
+}
+
+static void replay_record_event(char type,uint32_t v) {
+  if (!replay_rec.recording) return;
+  if (replay_rec.linep<0) return;
+  if (replay_rec.eventc>=REPLAY_EVENT_LIMIT) return;
+  replay_rec.eventc++;
+  if (replay_rec_char(' ')<0) return;
+  if (replay_rec_char(type)<0) return;
+  replay_rec_hex_short(v);
+}
+
+void replay_record_state(int state) {
+  replay_record_event('s',state);
+}
+
+void replay_record_key(int keycode) {
+  replay_record_event('k',keycode);
+}
+
+int replay_record_save() {
+  if (!replay_rec.v) return 0;
+  // Close the open line and any repeat, but then put the open line back, so recording can continue.
+  int linep=replay_rec.linep;
+  char tmp[REPLAY_LINE_LIMIT];
+  int tmpc=0;
+  if (linep>=0) {
+    tmpc=replay_rec.c-linep;
+    if (tmpc>sizeof(tmp)) tmpc=sizeof(tmp);
+    memcpy(tmp,replay_rec.v+linep,tmpc);
+    replay_rec.c=linep;
+    replay_rec.linep=-1;
+  }
+  replay_rec_flush_repeat();
+  int err=egg_store_set("replay",6,replay_rec.v,replay_rec.c);
+  if (err<0) egg_log("Failed to save %d-byte replay.",replay_rec.c);
+  else egg_log("Saved replay, %d bytes.",replay_rec.c);
+  replay_rec.prevc=0; // Next line can't be a repeat; we just wrote the count.
+  if (tmpc&&(replay_rec_require(tmpc)>=0)) {
+    replay_rec.linep=replay_rec.c;
+    memcpy(replay_rec.v+replay_rec.c,tmp,tmpc);
+    replay_rec.c+=tmpc;
+  }
+  return err;
+}
+
+/* Playback.
+ */
+
+int replay_play_begin(const char *src,int srcc) {
+  if (!src||(srcc<0)) return -1;
+  const char header[]="arrautza-replay ";
+  int headerc=sizeof(header)-1;
+  if ((srcc<headerc)||memcmp(src,header,headerc)) return -1;
+  int srcp=headerc;
+  uint64_t version=0,seed=0;
+  int err;
+  if (!(err=replay_read_hex(&version,src+srcp,srcc-srcp))||(version!=REPLAY_VERSION)) return -1;
+  srcp+=err;
+  if ((srcp>=srcc)||(src[srcp++]!=' ')) return -1;
+  if (!(err=replay_read_hex(&seed,src+srcp,srcc-srcp))) return -1;
+  srcp+=err;
+  while ((srcp<srcc)&&(src[srcp]!='\n')) srcp++;
+  memset(&replay_play,0,sizeof(replay_play));
+  replay_play.playing=1;
+  replay_play.seed=seed;
+  replay_play.src=src;
+  replay_play.srcc=srcc;
+  replay_play.srcp=srcp;
+  return 0;
+}
+
+int replay_playing() {
+  return replay_play.playing;
+}
+
+int replay_get_seed() {
+  return replay_play.seed;
+}
+
+int replay_get_frame_count() {
+  return replay_play.framec;
+}
+
+/* Decode one frame line.
+ */
+
+static int replay_decode_line(double *elapsed,struct replay_event *eventv,int eventa,const char *src,int srcc) {
+  uint64_t bits;
+  int srcp=replay_read_hex(&bits,src,srcc);
+  if (srcp!=16) return -1;
+  memcpy(elapsed,&bits,sizeof(bits));
+  int eventc=0;
+  while (srcp<srcc) {
+    if (src[srcp]==' ') { srcp++; continue; }
+    char type=src[srcp++];
+    if ((type!='s')&&(type!='k')) return -1;
+    uint64_t v;
+    int err=replay_read_hex(&v,src+srcp,srcc-srcp);
+    if (err<1) return -1;
+    srcp+=err;
+    if (eventc<eventa) {
+      eventv[eventc].type=type;
+      eventv[eventc].v=v;
+    }
+    eventc++;
+  }
+  if (eventc>eventa) eventc=eventa;
+  return eventc;
+}
+
+int replay_play_frame(double *elapsed,struct replay_event *eventv,int eventa) {
+  if (!replay_play.playing) return -1;
+
+  // Repeat the last line, or read the next one.
+  if (replay_play.repeatc>0) {
+    replay_play.repeatc--;
+  } else for (;;) {
+    const char *line=replay_play.src+replay_play.srcp;
+    int linec=0;
+    while ((replay_play.srcp<replay_play.srcc)&&(replay_play.src[replay_play.srcp]!='\n')) {
+      replay_play.srcp++;
+      linec++;
+    }
+    if (replay_play.srcp<replay_play.srcc) replay_play.srcp++;
+    while (linec&&((unsigned char)line[linec-1]<=0x20)) linec--;
+    if (!linec) {
+      if (replay_play.srcp>=replay_play.srcc) {
+        replay_play.playing=0;
+        return -1;
+      }
+      continue;
+    }
+    if (line[0]=='*') {
+      int repeatc=0,i=1;
+      for (;(i<linec)&&(line[i]>='0')&&(line[i]<='9');i++) repeatc=repeatc*10+line[i]-'0';
+      if ((repeatc<1)||!replay_play.line) {
+        egg_log("Replay: Invalid repeat near byte %d",replay_play.srcp);
+        replay_play.playing=0;
+        return -1;
+      }
+      replay_play.repeatc=repeatc-1;
+      break;
+    }
+    replay_play.line=line;
+    replay_play.linec=linec;
+    break;
+  }
+
+  // Events in repeated lines are repeated too. Usually repeated lines have none.
+  int eventc=replay_decode_line(elapsed,eventv,eventa,replay_play.line,replay_play.linec);
+  if (eventc<0) {
+    egg_log("Replay: Malformed frame near byte %d",replay_play.srcp);
+    replay_play.playing=0;
+    return -1;
+  }
+  replay_play.framec++;
+  return eventc;
+}
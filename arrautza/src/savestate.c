@@ -0,0 +1,496 @@
+#include "arrautza.h"
+
+/* Savestate.
+ * A binary snapshot of everything needed to resume play exactly: Globals, map, stobus, and every live sprite.
+ * All integers are little-endian. Doubles are copied verbatim, so a snapshot is only good on the same build.
+ *
+ *   4 Signature: "\0ASv"
+ *   1 Version: SAVESTATE_VERSION
+ *   2 mapid
+ *   4 ucoordx,ucoordy
+ *   1 aitem
+ *   1 bitem
+ *   1 hp
+ *   1 hpmax
+ *   1 menu_pause_selection
+ *   8 compassangle
+ *   4 next sprite serial
+ *   ... inventory[INVENTORY_SIZE]
+ *   ... itemqual[1+ITEM_COUNT]
+ *   ... map.v[COLC*ROWC]
+ *   2 stobus length
+ *   ... stobus, from stobus_encode()
+ *   2 sprite count
+ *   ... sprites:
+ *     2 sprctl id, zero for none
+ *     2 sprdef rid, zero for none
+ *     4 grpmask, global groups only
+ *     4 serial, which orders every group the sprite is in
+ *     8 x
+ *     8 y
+ *     32 hbl,hbr,hbu,hbd
+ *     4 mapsolids
+ *     4 layer
+ *     2 imageid
+ *     1 tileid
+ *     1 xform
+ *     1 invmass
+ *     1 ccd
+ *     1 col
+ *     1 row
+ *     2 extra length
+ *     ... extra: sprctl->save(), or everything after the header verbatim.
+ *
+ * Dynamic group memberships are not recorded.
+ * Transitions in progress are dropped; we restore to the settled new map.
+ */
+
+#define SAVESTATE_VERSION 2
+#define SAVESTATE_SPRITE_LIMIT 0xffff
+
+static struct savestate_buffer {
+  uint8_t *v;
+  int c,a;
+} savestate_buffer={0};
+
+/* Sprites in the snapshot, in snapshot order, which is also serial order at encode.
+ * Valid during sprctl save and load hooks only.
+ */
+static struct savestate_sprite {
+  struct sprite *sprite;
+  const uint8_t *extrav; // Decode only, points into the snapshot.
+  int extrac;
+} *savestate_spritev=0;
+static int savestate_spritec=0,savestate_spritea=0;
+
+/* Buffer primitives.
+ */
+
+static int savestate_require(struct savestate_buffer *buffer,int addc) {
+  if (addc<1) return 0;
+  if (buffer->c>INT_MAX-addc) return -1;
+  int na=buffer->c+addc;
+  if (na<=buffer->a) return 0;
+  if (na<INT_MAX-1024) na=(na+1024)&~1023;
+  void *nv=realloc(buffer->v,na);
+  if (!nv) return -1;
+  buffer->v=nv;
+  buffer->a=na;
+  return 0;
+}
+
+static int savestate_raw(struct savestate_buffer *buffer,const void *src,int srcc) {
+  if (savestate_require(buffer,srcc)<0) return -1;
+  memcpy(buffer->v+buffer->c,src,srcc);
+  buffer->c+=srcc;
+  return 0;
+}
+
+static int savestate_u8(struct savestate_buffer *buffer,int v) {
+  if (savestate_require(buffer,1)<0) return -1;
+  buffer->v[buffer->c++]=v;
+  return 0;
+}
+
+static int savestate_u16(struct savestate_buffer *buffer,int v) {
+  if (savestate_require(buffer,2)<0) return -1;
+  buffer->v[buffer->c++]=v;
+  buffer->v[buffer->c++]=v>>8;
+  return 0;
+}
+
+static int savestate_u32(struct savestate_buffer *buffer,uint32_t v) {
+  if (savestate_require(buffer,4)<0) return -1;
+  buffer->v[buffer->c++]=v;
+  buffer->v[buffer->c++]=v>>8;
+  buffer->v[buffer->c++]=v>>16;
+  buffer->v[buffer->c++]=v>>24;
+  return 0;
+}
+
+static int savestate_f64(struct savestate_buffer *buffer,double v) {
+  return savestate_raw(buffer,&v,sizeof(v));
+}
+
+/* Reader. Any failure sets (err) and reads zeroes from then on, so callers only need to check once at the end.
+ */
+
+struct savestate_reader {
+  const uint8_t *v;
+  int c,p;
+  int err;
+};
+
+static const uint8_t *savestate_read_raw(struct savestate_reader *reader,int c) {
+  if (reader->err||(c<0)||(reader->p>reader->c-c)) {
+    reader->err=1;
+    return 0;
+  }
+  const uint8_t *v=reader->v+reader->p;
+  reader->p+=c;
+  return v;
+}
+
+static int savestate_read_u8(struct savestate_reader *reader) {
+  const uint8_t *v=savestate_read_raw(reader,1);
+  return v?v[0]:0;
+}
+
+static int savestate_read_u16(struct savestate_reader *reader) {
+  const uint8_t *v=savestate_read_raw(reader,2);
+  return v?(v[0]|(v[1]<<8)):0;
+}
+
+static uint32_t savestate_read_u32(struct savestate_reader *reader) {
+  const uint8_t *v=savestate_read_raw(reader,4);
+  return v?(v[0]|(v[1]<<8)|(v[2]<<16)|((uint32_t)v[3]<<24)):0;
+}
+
+static double savestate_read_f64(struct savestate_reader *reader) {
+  double d=0.0;
+  const uint8_t *v=savestate_read_raw(reader,sizeof(d));
+  if (v) memcpy(&d,v,sizeof(d));
+  return d;
+}
+
+/* Handle translation, for sprctl hooks.
+ * In the snapshot, a handle becomes the sprite's 1-based index in the snapshot.
+ */
+
+uint32_t savestate_handle_save(uint32_t handle) {
+  struct sprite *sprite=sprite_from_handle(handle);
+  if (!sprite) return 0;
+  int lo=0,hi=savestate_spritec;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+         if (sprite->serial<savestate_spritev[ck].sprite->serial) hi=ck;
+    else if (sprite->serial>savestate_spritev[ck].sprite->serial) lo=ck+1;
+    else return ck+1;
+  }
+  return 0;
+}
+
+uint32_t savestate_handle_load(uint32_t token) {
+  if ((token<1)||(token>savestate_spritec)) return 0;
+  return sprite_handle(savestate_spritev[token-1].sprite);
+}
+
+static int savestate_spritev_require(int c) {
+  if (c<=savestate_spritea) return 0;
+  int na=(c+64)&~63;
+  void *nv=realloc(savestate_spritev,sizeof(struct savestate_sprite)*na);
+  if (!nv) return -1;
+  savestate_spritev=nv;
+  savestate_spritea=na;
+  return 0;
+}
+
+/* Encode one sprite.
+ */
+
+static int savestate_encode_sprite(struct savestate_buffer *buffer,struct sprite *sprite) {
+  if (
+    (savestate_u16(buffer,sprctl_id(sprite->sprctl))<0)||
+    (savestate_u16(buffer,sprite->sprdef?sprite->sprdef->rid:0)<0)||
+    (savestate_u32(buffer,sprite->grpmask&~(1u<<SPRGRP_DEATHROW))<0)||
+    (savestate_u32(buffer,sprite->serial)<0)||
+    (savestate_f64(buffer,sprite->x)<0)||
+    (savestate_f64(buffer,sprite->y)<0)||
+    (savestate_f64(buffer,sprite->hbl)<0)||
+    (savestate_f64(buffer,sprite->hbr)<0)||
+    (savestate_f64(buffer,sprite->hbu)<0)||
+    (savestate_f64(buffer,sprite->hbd)<0)||
+    (savestate_u32(buffer,sprite->mapsolids)<0)||
+    (savestate_u32(buffer,sprite->layer)<0)||
+    (savestate_u16(buffer,sprite->imageid)<0)||
+    (savestate_u8(buffer,sprite->tileid)<0)||
+    (savestate_u8(buffer,sprite->xform)<0)||
+    (savestate_u8(buffer,sprite->invmass)<0)||
+    (savestate_u8(buffer,sprite->ccd)<0)||
+    (savestate_u8(buffer,sprite->col)<0)||
+    (savestate_u8(buffer,sprite->row)<0)
+  ) return -1;
+
+  int lenp=buffer->c;
+  if (savestate_u16(buffer,0)<0) return -1;
+  int extrac;
+  if (sprite->sprctl&&sprite->sprctl->save) {
+    for (;;) {
+      int avail=buffer->a-buffer->c;
+      if ((extrac=sprite->sprctl->save(buffer->v+buffer->c,avail,sprite))<0) return -1;
+      if (extrac<=avail) break;
+      if (savestate_require(buffer,extrac)<0) return -1;
+    }
+    buffer->c+=extrac;
+  } else {
+    extrac=(sprite->sprctl?sprite->sprctl->objlen:sizeof(struct sprite))-sizeof(struct sprite);
+    if (savestate_raw(buffer,(char*)sprite+sizeof(struct sprite),extrac)<0) return -1;
+  }
+  if (extrac>0xffff) return -1;
+  buffer->v[lenp]=extrac;
+  buffer->v[lenp+1]=extrac>>8;
+  return 0;
+}
+
+/* Encode.
+ */
+
+int savestate_encode(const void **dstpp) {
+  struct savestate_buffer *buffer=&savestate_buffer;
+  buffer->c=0;
+
+  if (
+    (savestate_raw(buffer,"\0ASv",4)<0)||
+    (savestate_u8(buffer,SAVESTATE_VERSION)<0)||
+    (savestate_u16(buffer,g.mapid)<0)||
+    (savestate_u16(buffer,g.ucoordx)<0)||
+    (savestate_u16(buffer,g.ucoordy)<0)||
+    (savestate_u8(buffer,g.aitem)<0)||
+    (savestate_u8(buffer,g.bitem)<0)||
+    (savestate_u8(buffer,g.hp)<0)||
+    (savestate_u8(buffer,g.hpmax)<0)||
+    (savestate_u8(buffer,g.menu_pause_selection)<0)||
+    (savestate_f64(buffer,g.compassangle)<0)||
+    (savestate_u32(buffer,sprite_get_next_serial())<0)||
+    (savestate_raw(buffer,g.inventory,sizeof(g.inventory))<0)||
+    (savestate_raw(buffer,g.itemqual,sizeof(g.itemqual))<0)||
+    (savestate_raw(buffer,g.map.v,sizeof(g.map.v))<0)
+  ) return -1;
+
+  int stobusc=stobus_encode(0,0,&g.stobus);
+  if ((stobusc<0)||(stobusc>0xffff)) return -1;
+  if (savestate_u16(buffer,stobusc)<0) return -1;
+  if (savestate_require(buffer,stobusc+1)<0) return -1;
+  if (stobus_encode((char*)buffer->v+buffer->c,stobusc,&g.stobus)!=stobusc) return -1;
+  buffer->c+=stobusc;
+
+  // KEEPALIVE is sorted by serial, which is what savestate_handle_save() wants. Sprites on death row are not saved.
+  struct sprgrp *keepalive=sprgrpv+SPRGRP_KEEPALIVE;
+  if (savestate_spritev_require(keepalive->sprc)<0) return -1;
+  savestate_spritec=0;
+  int i=0; for (;i<keepalive->sprc;i++) {
+    struct sprite *sprite=keepalive->sprv[i];
+    if (sprite->grpmask&(1u<<SPRGRP_DEATHROW)) continue;
+    savestate_spritev[savestate_spritec++].sprite=sprite;
+  }
+  if (savestate_spritec>SAVESTATE_SPRITE_LIMIT) {
+    savestate_spritec=0;
+    return -1;
+  }
+  int err=savestate_u16(buffer,savestate_spritec);
+  for (i=0;(err>=0)&&(i<savestate_spritec);i++) {
+    err=savestate_encode_sprite(buffer,savestate_spritev[i].sprite);
+  }
+  savestate_spritec=0;
+  if (err<0) return -1;
+
+  *dstpp=buffer->v;
+  return buffer->c;
+}
+
+/* Check every sprite record without creating anything, so a bad snapshot fails before we touch the game.
+ * Takes its own copy of the reader. Sprites with a load hook get their extra checked only by that hook, later.
+ */
+
+static int savestate_validate_sprites(struct savestate_reader reader,int spritec,uint32_t next_serial) {
+  uint32_t pvserial=0;
+  for (;spritec-->0;) {
+    int sprctlid=savestate_read_u16(&reader);
+    int rid=savestate_read_u16(&reader);
+    savestate_read_raw(&reader,4); // grpmask
+    uint32_t serial=savestate_read_u32(&reader);
+    savestate_read_raw(&reader,6*8+4+4+2+6); // x thru row, see top of file.
+    int extrac=savestate_read_u16(&reader);
+    savestate_read_raw(&reader,extrac);
+    if (reader.err) {
+      egg_log("Savestate: Truncated sprite records.");
+      return -1;
+    }
+    // Encode writes them in serial order, and KEEPALIVE can't hold two sprites with the same one.
+    if ((serial<=pvserial)||(serial>=next_serial)) {
+      egg_log("Savestate: Sprite serial %u out of order.",serial);
+      return -1;
+    }
+    pvserial=serial;
+    const struct sprctl *sprctl=0;
+    if (sprctlid&&!(sprctl=sprctl_by_id(sprctlid))) {
+      egg_log("Savestate: Unknown sprctl %d",sprctlid);
+      return -1;
+    }
+    if (rid&&!sprdef_get(rid)) {
+      egg_log("Savestate: sprite:%d not found",rid);
+      return -1;
+    }
+    if (sprctl&&sprctl->load) continue;
+    int expect=(sprctl?sprctl->objlen:sizeof(struct sprite))-sizeof(struct sprite);
+    if (extrac!=expect) {
+      egg_log("Savestate: Expected %d extra bytes for sprctl '%s', found %d",expect,sprctl?sprctl->name:"",extrac);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Decode one sprite's fixed fields, and create it.
+ * Extra goes to the hooks after everything exists.
+ */
+
+static struct sprite *savestate_decode_sprite(struct savestate_reader *reader,const uint8_t **extrav,int *extrac) {
+  int sprctlid=savestate_read_u16(reader);
+  int rid=savestate_read_u16(reader);
+  uint32_t grpmask=savestate_read_u32(reader);
+  uint32_t serial=savestate_read_u32(reader);
+  const struct sprctl *sprctl=0;
+  const struct sprdef *sprdef=0;
+  if (sprctlid&&!(sprctl=sprctl_by_id(sprctlid))) {
+    egg_log("Savestate: Unknown sprctl %d",sprctlid);
+    return 0;
+  }
+  if (rid&&!(sprdef=sprdef_get(rid))) {
+    egg_log("Savestate: sprite:%d not found",rid);
+    return 0;
+  }
+  struct sprite *sprite=sprite_new_uninitialized(sprctl);
+  if (!sprite) return 0;
+  sprite->serial=serial;
+  sprite->sprdef=sprdef;
+  sprite->x=savestate_read_f64(reader);
+  sprite->y=savestate_read_f64(reader);
+  sprite->hbl=savestate_read_f64(reader);
+  sprite->hbr=savestate_read_f64(reader);
+  sprite->hbu=savestate_read_f64(reader);
+  sprite->hbd=savestate_read_f64(reader);
+  sprite->mapsolids=savestate_read_u32(reader);
+  sprite->layer=(int)savestate_read_u32(reader);
+  sprite->imageid=savestate_read_u16(reader);
+  sprite->tileid=savestate_read_u8(reader);
+  sprite->xform=savestate_read_u8(reader);
+  sprite->invmass=savestate_read_u8(reader);
+  sprite->ccd=savestate_read_u8(reader);
+  sprite->col=(int8_t)savestate_read_u8(reader);
+  sprite->row=(int8_t)savestate_read_u8(reader);
+  *extrac=savestate_read_u16(reader);
+  *extrav=savestate_read_raw(reader,*extrac);
+  sprite->pvx=sprite->rpx=sprite->x;
+  sprite->pvy=sprite->rpy=sprite->y;
+  if (reader->err) {
+    sprite_del(sprite);
+    return 0;
+  }
+  // KEEPALIVE first, so the sprite never floats loose while it has other groups.
+  grpmask|=1u<<SPRGRP_KEEPALIVE;
+  int i=0; for (;i<32;i++) {
+    if (!(grpmask&(1u<<i))) continue;
+    if (sprgrp_add(sprgrpv+i,sprite)<0) {
+      sprite_kill(sprite);
+      sprite_del(sprite);
+      return 0;
+    }
+  }
+  return sprite;
+}
+
+/* Restore extra fields.
+ */
+
+static int savestate_load_extra(struct sprite *sprite,const uint8_t *src,int srcc) {
+  if (sprite->sprctl&&sprite->sprctl->load) return sprite->sprctl->load(sprite,src,srcc);
+  int expect=(sprite->sprctl?sprite->sprctl->objlen:sizeof(struct sprite))-sizeof(struct sprite);
+  if (srcc!=expect) {
+    egg_log("Savestate: Expected %d extra bytes for sprctl '%s', found %d",expect,sprite->sprctl?sprite->sprctl->name:"",srcc);
+    return -1;
+  }
+  memcpy((char*)sprite+sizeof(struct sprite),src,srcc);
+  return 0;
+}
+
+/* Decode.
+ * Anything we reject up front returns -2, with the game untouched.
+ */
+
+int savestate_decode(const void *src,int srcc) {
+  struct savestate_reader reader={.v=src,.c=srcc};
+  const uint8_t *signature=savestate_read_raw(&reader,4);
+  if (!signature||memcmp(signature,"\0ASv",4)) return -2;
+  if (savestate_read_u8(&reader)!=SAVESTATE_VERSION) {
+    egg_log("Savestate: Unsupported version.");
+    return -2;
+  }
+
+  // Read the header fully before touching anything.
+  uint16_t mapid=savestate_read_u16(&reader);
+  int16_t ucoordx=savestate_read_u16(&reader);
+  int16_t ucoordy=savestate_read_u16(&reader);
+  uint8_t aitem=savestate_read_u8(&reader);
+  uint8_t bitem=savestate_read_u8(&reader);
+  uint8_t hp=savestate_read_u8(&reader);
+  uint8_t hpmax=savestate_read_u8(&reader);
+  int menu_pause_selection=savestate_read_u8(&reader);
+  double compassangle=savestate_read_f64(&reader);
+  uint32_t next_serial=savestate_read_u32(&reader);
+  const uint8_t *inventory=savestate_read_raw(&reader,sizeof(g.inventory));
+  const uint8_t *itemqual=savestate_read_raw(&reader,sizeof(g.itemqual));
+  const uint8_t *cells=savestate_read_raw(&reader,sizeof(g.map.v));
+  int stobusc=savestate_read_u16(&reader);
+  const char *stobus=(const char*)savestate_read_raw(&reader,stobusc);
+  int spritec=savestate_read_u16(&reader);
+  if (reader.err||!mapid) return -2;
+  if (savestate_validate_sprites(reader,spritec,next_serial)<0) return -2;
+  if (stobus_decode(&g.stobus,stobus,stobusc)<0) return -2; // Validates before changing anything.
+
+  // Everything goes: Sprites, pending navigation, transition.
+  sprgrp_kill(sprgrpv+SPRGRP_KEEPALIVE);
+  g.mapnext.mapid=0;
+  g.transition=0;
+  g.transclock=0.0;
+  g.game_over=0;
+
+  if (prefetch_take_map(mapid)<0) return -1;
+  g.mapid=mapid;
+  if (memcmp(g.map.v,cells,sizeof(g.map.v))) {
+    memcpy(g.map.v,cells,sizeof(g.map.v));
+    physics_rebuild_map();
+  }
+  map_dirty_all();
+  int songid=map_get_command(&g.map,MAPCMD_song);
+  if (songid) egg_audio_play_song(0,songid,0,1);
+  g.ucoordx=ucoordx;
+  g.ucoordy=ucoordy;
+  g.aitem=aitem;
+  g.bitem=bitem;
+  g.hp=hp;
+  g.hpmax=hpmax;
+  g.menu_pause_selection=menu_pause_selection;
+  g.compassangle=compassangle;
+  memcpy(g.inventory,inventory,sizeof(g.inventory));
+  memcpy(g.itemqual,itemqual,sizeof(g.itemqual));
+
+  /* Sprites in two passes: Create all of them with their generic fields and groups, then run the hooks.
+   * So hooks can translate handles to sprites that come after them.
+   * We hold a STRONG reference to each until the end.
+   */
+  int err=0;
+  if (savestate_spritev_require(spritec)<0) return -1;
+  savestate_spritec=0;
+  while (savestate_spritec<spritec) {
+    struct savestate_sprite *entry=savestate_spritev+savestate_spritec;
+    if (!(entry->sprite=savestate_decode_sprite(&reader,&entry->extrav,&entry->extrac))) {
+      err=-1;
+      break;
+    }
+    savestate_spritec++;
+  }
+  sprite_set_next_serial(next_serial);
+  struct savestate_sprite *entry=savestate_spritev;
+  int i=savestate_spritec;
+  for (;(err>=0)&&(i-->0);entry++) {
+    err=savestate_load_extra(entry->sprite,entry->extrav,entry->extrac);
+  }
+  for (entry=savestate_spritev,i=savestate_spritec;i-->0;entry++) {
+    if (err<0) sprite_kill(entry->sprite);
+    sprite_del(entry->sprite);
+  }
+  savestate_spritec=0;
+  sprgrp_index_invalidate(0);
+  return err;
+}
@@ -43,15 +43,8 @@ static void _blinktoast_update(struct sprite *sprite,double elapsed) {
 static void _blinktoast_render(int dsttexid,struct sprite *sprite) {
   int texid=texcache_get(&g.texcache,sprite->imageid);
   if (texid<1) return;
-  if (SPRITE->phase) egg_render_alpha(0x80);
-  struct egg_draw_tile vtx={
-    .x=sprite->bx+(sprite->bw>>1),
-    .y=sprite->by+(sprite->bh>>1),
-    .tileid=sprite->tileid,
-    .xform=sprite->xform,
-  };
-  egg_draw_tile(dsttexid,texid,&vtx,1);
-  if (SPRITE->phase) egg_render_alpha(0xff);
+  sprite_render_begin(texid,0,SPRITE->phase?0x80:0xff);
+  sprite_render_tile(sprite->bx+(sprite->bw>>1),sprite->by+(sprite->bh>>1),sprite->tileid,sprite->xform);
 }
 
 /* Type definition.
@@ -43,7 +43,7 @@ static void _bomb_update(struct sprite *sprite,double elapsed) {
   }
   
   // Add ourselves to the SOLID group if the hero is not colliding, then stay in it.
-  if (!sprgrp_has(sprgrpv+SPRGRP_SOLID,sprite)) {
+  if (!sprite_in_group(sprite,SOLID)) {
     if (!sprite_collides_with_group(sprite,sprgrpv+SPRGRP_HERO)) {
       sprgrp_add(sprgrpv+SPRGRP_SOLID,sprite);
     }
@@ -66,8 +66,8 @@ static void _bomb_damage(struct sprite *sprite,int qual,struct sprite *assailant
  */
  
 static void _bomb_render(int dsttexid,struct sprite *sprite) {
-  int dstx=(int)(sprite->x*TILESIZE);
-  int dsty=(int)(sprite->y*TILESIZE);
+  int dstx=sprite->bx+(sprite->bw>>1);
+  int dsty=sprite->by+(sprite->bh>>1);
   uint8_t tileid=sprite->tileid;
   switch (SPRITE->animframe) {
     case 1: tileid+=0x01; break;
@@ -77,10 +77,9 @@ static void _bomb_render(int dsttexid,struct sprite *sprite) {
   if (fuseframe<0) fuseframe=0;
   else if (fuseframe>6) fuseframe=6;
   uint8_t fusetileid=sprite->tileid+3+fuseframe;
-  tile_renderer_begin(&g.tile_renderer,texcache_get(&g.texcache,sprite->imageid),0,0xff);
-  tile_renderer_tile(&g.tile_renderer,dstx,dsty,tileid,0);
-  tile_renderer_tile(&g.tile_renderer,dstx,dsty,fusetileid,0);
-  tile_renderer_end(&g.tile_renderer);
+  sprite_render_begin(texcache_get(&g.texcache,sprite->imageid),0,0xff);
+  sprite_render_tile(dstx,dsty,tileid,0);
+  sprite_render_tile(dstx,dsty,fusetileid,0);
 }
 
 /* Type definition.
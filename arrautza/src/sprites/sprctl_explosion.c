@@ -41,24 +41,26 @@ static int _explosion_ready(struct sprite *sprite,const uint8_t *argv,int argc)
  
 static void explosion_deal_damage(struct sprite *sprite) {
   const double radius=2.0;
-  const double radius2=radius*radius;
-  struct sprgrp *sprgrp;
-  int i;
+  struct sprite *victimv_local[32];
+  struct sprite **victimv=victimv_local;
+  int victimc,i;
   
   // Damage fragile sprites in range.
   // This will trigger other bombs.
-  sprgrp=sprgrpv+SPRGRP_FRAGILE;
-  for (i=sprgrp->sprc;i-->0;) {
-    struct sprite *victim=sprgrp->sprv[i];
+  // Query everybody before damaging anybody: Damage might change the group.
+  victimc=sprgrp_query_radius(victimv,32,sprgrpv+SPRGRP_FRAGILE,sprite->x,sprite->y,radius);
+  if (victimc>32) {
+    if (!(victimv=malloc(sizeof(void*)*victimc))) return;
+    int victima=victimc;
+    victimc=sprgrp_query_radius(victimv,victima,sprgrpv+SPRGRP_FRAGILE,sprite->x,sprite->y,radius);
+    if (victimc>victima) victimc=victima;
+  }
+  for (i=victimc;i-->0;) {
+    struct sprite *victim=victimv[i];
     if (!victim->sprctl||!victim->sprctl->damage) continue;
-    double adx=victim->x-sprite->x; if (adx<0.0) adx=-adx;
-    if (adx>=radius) continue;
-    double ady=victim->y-sprite->y; if (ady<0.0) ady=-ady;
-    if (ady>=radius) continue;
-    double d2=adx*adx+ady*ady;
-    if (d2>radius2) continue;
     victim->sprctl->damage(victim,1,sprite);
   }
+  if (victimv!=victimv_local) free(victimv);
 
   //TODO Eliminate specially-marked map cells.
 }
@@ -86,18 +88,17 @@ static void _explosion_update(struct sprite *sprite,double elapsed) {
  */
  
 static void _explosion_render(int dsttexid,struct sprite *sprite) {
-  // (dstx,dsty): Position of top-left tile.
-  int dstx=(int)(sprite->x*TILESIZE)-(TILESIZE>>1);
-  int dsty=(int)(sprite->y*TILESIZE)-(TILESIZE>>1);
+  // (dstx,dsty): Position of top-left tile. Our bounds are the default single tile centered on (x,y).
+  int dstx=sprite->bx;
+  int dsty=sprite->by;
   int frame=(int)(((EXPLOSION_TTL-SPRITE->ttl)*4.0)/EXPLOSION_TTL);
   if (frame<0) frame=0;
   else if (frame>3) frame=3;
-  tile_renderer_begin(&g.tile_renderer,texcache_get(&g.texcache,sprite->imageid),0,0xff);
-  tile_renderer_tile(&g.tile_renderer,dstx,dsty,sprite->tileid+frame,0);
-  tile_renderer_tile(&g.tile_renderer,dstx+TILESIZE,dsty,sprite->tileid+frame,EGG_XFORM_SWAP|EGG_XFORM_YREV);
-  tile_renderer_tile(&g.tile_renderer,dstx,dsty+TILESIZE,sprite->tileid+frame,EGG_XFORM_SWAP|EGG_XFORM_XREV);
-  tile_renderer_tile(&g.tile_renderer,dstx+TILESIZE,dsty+TILESIZE,sprite->tileid+frame,EGG_XFORM_XREV|EGG_XFORM_YREV);
-  tile_renderer_end(&g.tile_renderer);
+  sprite_render_begin(texcache_get(&g.texcache,sprite->imageid),0,0xff);
+  sprite_render_tile(dstx,dsty,sprite->tileid+frame,0);
+  sprite_render_tile(dstx+TILESIZE,dsty,sprite->tileid+frame,EGG_XFORM_SWAP|EGG_XFORM_YREV);
+  sprite_render_tile(dstx,dsty+TILESIZE,sprite->tileid+frame,EGG_XFORM_SWAP|EGG_XFORM_XREV);
+  sprite_render_tile(dstx+TILESIZE,dsty+TILESIZE,sprite->tileid+frame,EGG_XFORM_XREV|EGG_XFORM_YREV);
 }
 
 /* Type definition.
@@ -17,6 +17,7 @@ struct sprite_missile {
  */
  
 static int _missile_init(struct sprite *sprite) {
+  sprite->ccd=1;
   return 0;
 }
 
@@ -52,6 +53,9 @@ static int _missile_ready(struct sprite *sprite,const uint8_t *argv,int argc) {
  */
  
 static void _missile_update(struct sprite *sprite,double elapsed) {
+  // We're not in SOLID, so physics doesn't track our previous position. Do it ourselves, for the swept map check.
+  sprite->pvx=sprite->x;
+  sprite->pvy=sprite->y;
   sprite->x+=SPRITE->dx*elapsed;
   sprite->y+=SPRITE->dy*elapsed;
   if ((sprite->x<-1.0)||(sprite->y<-1.0)||(sprite->x>COLC+1.0)||(sprite->y>ROWC+1.0)) {
@@ -10,7 +10,7 @@
  
 struct sprite_pushtrigger {
   struct sprite hdr;
-  struct sprite *hero; // WEAK
+  uint32_t hero; // Handle.
   int gothero;
   double blackout;
   int k,v;
@@ -63,10 +63,28 @@ static void _pushtrigger_update(struct sprite *sprite,double elapsed) {
 static void _pushtrigger_collision(struct sprite *sprite,struct sprite *other,uint8_t dir,int physics) {
   if (other&&(other->sprctl==&sprctl_hero)) {
     SPRITE->gothero=1;
-    SPRITE->hero=other;
+    SPRITE->hero=sprite_handle(other);
   }
 }
 
+/* Savestate.
+ */
+ 
+static int _pushtrigger_save(void *dst,int dsta,struct sprite *sprite) {
+  struct sprite_pushtrigger tmp=*SPRITE;
+  tmp.hero=savestate_handle_save(tmp.hero);
+  int dstc=sizeof(tmp)-sizeof(struct sprite);
+  if (dstc<=dsta) memcpy(dst,(char*)&tmp+sizeof(struct sprite),dstc);
+  return dstc;
+}
+
+static int _pushtrigger_load(struct sprite *sprite,const void *src,int srcc) {
+  if (srcc!=sizeof(struct sprite_pushtrigger)-sizeof(struct sprite)) return -1;
+  memcpy((char*)sprite+sizeof(struct sprite),src,srcc);
+  SPRITE->hero=savestate_handle_load(SPRITE->hero);
+  return 0;
+}
+
 /* Type definition.
  */
  
@@ -81,6 +99,8 @@ const struct sprctl sprctl_pushtrigger={
   .ready=_pushtrigger_ready,
   .update=_pushtrigger_update,
   .collision=_pushtrigger_collision,
+  .save=_pushtrigger_save,
+  .load=_pushtrigger_load,
 };
 
 /* Activate.
@@ -48,6 +48,8 @@ void *malloc(int c) {
       }
       p+=available;
     }
+    // Nothing usable below the top. Skip that scan next time, same as when we do find one.
+    gmalloc.deadp=gmalloc.heapc;
   }
   
   // Append.
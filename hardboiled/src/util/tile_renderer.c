@@ -1,5 +1,12 @@
 #include "tile_renderer.h"
 
+/* Projects that want to count draw calls can define TILE_RENDERER_HOOKS as a header to include here.
+ * It may redefine egg_draw_tile, egg_render_tint, and egg_render_alpha.
+ */
+#ifdef TILE_RENDERER_HOOKS
+  #include TILE_RENDERER_HOOKS
+#endif
+
 /* Flush.
  */
  